@@ -0,0 +1,18 @@
+#ifndef ARGS_H
+#define ARGS_H
+
+extern int verbose;
+extern int no_output;
+extern int output_freq;
+extern int enable_checkpoints;
+extern int fixed_dt;
+extern int lb_freq;
+extern double lb_threshold;
+extern int halo_mode;
+extern int num_threads;
+
+void parse_args(int argc, char *argv[]);
+void print_opts();
+const char * halo_mode_name(int mode);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,7 @@
+#ifndef BALANCE_H
+#define BALANCE_H
+
+void record_force_time(double t);
+void load_balance(int iters);
+
+#endif
@@ -0,0 +1,515 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "args.h"
+#include "boundary.h"
+#include "data.h"
+
+// number of doubles used to send one migrating particle (position, velocity,
+// acceleration, global id and the index of its cell along the shared edge)
+#define MIGRATE_DOUBLES 8
+
+static double * send_buf_lo, * send_buf_hi, * recv_buf_lo, * recv_buf_hi;
+static int send_size_lo, send_size_hi, recv_size_lo, recv_size_hi;
+
+// persistent halo requests for the x phase and the y phase
+static MPI_Request halo_requests[2][4];
+static int num_halo_requests[2];
+static int halo_ready = 0;
+
+// a neighbour on the same node, whose cells are read directly from the shared window
+struct shared_neighbour {
+	int on_node;
+	int sizei, sizej;
+	double * x, * y;
+	struct cell_list * cells;
+};
+static struct shared_neighbour shared_west, shared_east, shared_south, shared_north;
+
+/**
+ * @brief Make sure a communication buffer can hold at least n doubles
+ *
+ * @param buf The buffer to grow
+ * @param buf_size The current size of the buffer (updated on growth)
+ * @param n The number of doubles required
+ */
+static void reserve_buffer(double ** buf, int * buf_size, int n) {
+	if (n > *buf_size) {
+		*buf_size = n;
+		free(*buf);
+		*buf = malloc(sizeof(double) * n);
+	}
+}
+
+/**
+ * @brief Pack the counts and positions of a line of cells into a buffer. The
+ *        counts come first, followed by the x/y pairs of every particle.
+ *
+ * @param buf The buffer to pack into
+ * @param i0 The i index of the first cell
+ * @param j0 The j index of the first cell
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param n The number of cells
+ * @return int The number of doubles packed
+ */
+static int pack_halo(double * buf, int i0, int j0, int di, int dj, int n) {
+	int pos = n;
+	for (int c = 0; c < n; c++) {
+		struct cell_list * cell = &cells[i0 + c*di][j0 + c*dj];
+		buf[c] = cell->count;
+		for (int k = 0; k < cell->count; k++) {
+			buf[pos++] = particles.x[cell->offset + k];
+			buf[pos++] = particles.y[cell->offset + k];
+		}
+	}
+	return pos;
+}
+
+/**
+ * @brief Unpack a buffer produced by pack_halo into a line of ghost cells
+ *
+ * @param buf The buffer to unpack
+ * @param i0 The i index of the first cell
+ * @param j0 The j index of the first cell
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param n The number of cells
+ */
+static void unpack_halo(double * buf, int i0, int j0, int di, int dj, int n) {
+	int pos = n;
+	for (int c = 0; c < n; c++) {
+		struct cell_list * cell = &cells[i0 + c*di][j0 + c*dj];
+		cell->count = (int) buf[c];
+		for (int k = 0; k < cell->count; k++) {
+			particles.x[cell->offset + k] = buf[pos++];
+			particles.y[cell->offset + k] = buf[pos++];
+		}
+	}
+}
+
+/**
+ * @brief Exchange a line of halo cells in both directions of one dimension
+ *
+ * @param lo_rank The neighbour in the negative direction
+ * @param hi_rank The neighbour in the positive direction
+ * @param n The number of cells in the line
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param send_lo The first cell to send to lo_rank (as i, j)
+ * @param send_hi The first cell to send to hi_rank (as i, j)
+ * @param recv_lo The first ghost cell to fill from lo_rank (as i, j)
+ * @param recv_hi The first ghost cell to fill from hi_rank (as i, j)
+ */
+static void exchange_halo_line(int lo_rank, int hi_rank, int n, int di, int dj,
+							   int send_lo[2], int send_hi[2], int recv_lo[2], int recv_hi[2]) {
+	int max_size = n + (2 * n * cell_capacity);
+	reserve_buffer(&send_buf_lo, &send_size_lo, max_size);
+	reserve_buffer(&send_buf_hi, &send_size_hi, max_size);
+	reserve_buffer(&recv_buf_lo, &recv_size_lo, max_size);
+	reserve_buffer(&recv_buf_hi, &recv_size_hi, max_size);
+
+	int n_hi = pack_halo(send_buf_hi, send_hi[0], send_hi[1], di, dj, n);
+	int n_lo = pack_halo(send_buf_lo, send_lo[0], send_lo[1], di, dj, n);
+
+	MPI_Sendrecv(send_buf_hi, n_hi, MPI_DOUBLE, hi_rank, 1, recv_buf_lo, max_size, MPI_DOUBLE, lo_rank, 1,
+				 cart_comm, MPI_STATUS_IGNORE);
+	MPI_Sendrecv(send_buf_lo, n_lo, MPI_DOUBLE, lo_rank, 2, recv_buf_hi, max_size, MPI_DOUBLE, hi_rank, 2,
+				 cart_comm, MPI_STATUS_IGNORE);
+
+	unpack_halo(recv_buf_lo, recv_lo[0], recv_lo[1], di, dj, n);
+	unpack_halo(recv_buf_hi, recv_hi[0], recv_hi[1], di, dj, n);
+}
+
+/**
+ * @brief Build a datatype that describes a line of cells in place: the x and y slots of
+ *        every cell, and the cell counts. Addresses are absolute, so the type is used
+ *        with MPI_BOTTOM.
+ *
+ * @param i0 The i index of the first cell
+ * @param j0 The j index of the first cell
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param n The number of cells
+ * @return MPI_Datatype The committed datatype
+ */
+static MPI_Datatype halo_line_type(int i0, int j0, int di, int dj, int n) {
+	int cell_stride = (di * (sizej+2)) + dj;
+
+	MPI_Datatype slots, counts, line;
+	MPI_Type_vector(n, cell_capacity, cell_stride * cell_capacity, MPI_DOUBLE, &slots);
+	MPI_Type_create_hvector(n, 1, cell_stride * sizeof(struct cell_list), MPI_INT, &counts);
+
+	int block_lengths[3] = {1, 1, 1};
+	MPI_Datatype types[3] = {slots, slots, counts};
+	MPI_Aint displacements[3];
+	MPI_Get_address(&particles.x[cells[i0][j0].offset], &displacements[0]);
+	MPI_Get_address(&particles.y[cells[i0][j0].offset], &displacements[1]);
+	MPI_Get_address(&cells[i0][j0].count, &displacements[2]);
+
+	MPI_Type_create_struct(3, block_lengths, displacements, types, &line);
+	MPI_Type_commit(&line);
+
+	MPI_Type_free(&slots);
+	MPI_Type_free(&counts);
+	return line;
+}
+
+/**
+ * @brief Create a persistent send of a line of cells for one phase of the exchange
+ *
+ * @param cell The first cell to send (as i, j)
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param n The number of cells
+ * @param dest The rank to send to
+ * @param tag The message tag
+ * @param phase The phase of the exchange (0 for x, 1 for y)
+ */
+static void init_halo_send(int cell[2], int di, int dj, int n, int dest, int tag, int phase) {
+	MPI_Datatype type = halo_line_type(cell[0], cell[1], di, dj, n);
+	MPI_Send_init(MPI_BOTTOM, 1, type, dest, tag, cart_comm, &halo_requests[phase][num_halo_requests[phase]++]);
+	// the request keeps its own reference to the type
+	MPI_Type_free(&type);
+}
+
+/**
+ * @brief Create a persistent receive into a line of ghost cells for one phase of the exchange
+ *
+ * @param cell The first ghost cell to receive into (as i, j)
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param n The number of cells
+ * @param source The rank to receive from
+ * @param tag The message tag
+ * @param phase The phase of the exchange (0 for x, 1 for y)
+ */
+static void init_halo_recv(int cell[2], int di, int dj, int n, int source, int tag, int phase) {
+	MPI_Datatype type = halo_line_type(cell[0], cell[1], di, dj, n);
+	MPI_Recv_init(MPI_BOTTOM, 1, type, source, tag, cart_comm, &halo_requests[phase][num_halo_requests[phase]++]);
+	MPI_Type_free(&type);
+}
+
+/**
+ * @brief Find a neighbour's cells in the shared window, if it is on the same node
+ *
+ * @param neighbour_rank The rank of the neighbour in cart_comm
+ * @param neighbour The neighbour to fill in
+ */
+static void query_shared_neighbour(int neighbour_rank, struct shared_neighbour * neighbour) {
+	neighbour->on_node = 0;
+	if (halo_mode != HALO_SHM) {
+		return;
+	}
+
+	MPI_Group cart_group, node_group;
+	int node_rank;
+	MPI_Comm_group(cart_comm, &cart_group);
+	MPI_Comm_group(node_comm, &node_group);
+	MPI_Group_translate_ranks(cart_group, 1, &neighbour_rank, node_group, &node_rank);
+	MPI_Group_free(&cart_group);
+	MPI_Group_free(&node_group);
+	if (node_rank == MPI_UNDEFINED) {
+		return;
+	}
+
+	MPI_Aint bytes;
+	int disp_unit;
+	char * base;
+	MPI_Win_shared_query(cells_win, node_rank, &bytes, &disp_unit, &base);
+
+	int * header = (int *) base;
+	int num_slots = (header[0]+2) * (header[1]+2) * cell_capacity;
+	neighbour->sizei = header[0];
+	neighbour->sizej = header[1];
+	neighbour->x = (double *) (base + SHARED_HEADER_BYTES);
+	neighbour->y = neighbour->x + num_slots;
+	neighbour->cells = (struct cell_list *) (neighbour->y + num_slots);
+	neighbour->on_node = 1;
+}
+
+/**
+ * @brief Copy a line of cells straight out of an on-node neighbour's shared window into
+ *        a line of ghost cells
+ *
+ * @param neighbour The neighbour to read from
+ * @param src The first cell to read, in the neighbour's grid (as i, j)
+ * @param dst The first ghost cell to fill (as i, j)
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param n The number of cells
+ */
+static void read_shared_line(struct shared_neighbour * neighbour, int src[2], int dst[2], int di, int dj, int n) {
+	for (int c = 0; c < n; c++) {
+		struct cell_list * from = &neighbour->cells[((src[0] + c*di) * (neighbour->sizej+2)) + src[1] + c*dj];
+		struct cell_list * to = &cells[dst[0] + c*di][dst[1] + c*dj];
+		to->count = from->count;
+		memcpy(&particles.x[to->offset], &neighbour->x[from->offset], sizeof(double) * from->count);
+		memcpy(&particles.y[to->offset], &neighbour->y[from->offset], sizeof(double) * from->count);
+	}
+}
+
+/**
+ * @brief Make the cell updates of every rank on the node visible to the others
+ *
+ */
+static void shared_fence() {
+	MPI_Win_sync(cells_win);
+	MPI_Barrier(node_comm);
+	MPI_Win_sync(cells_win);
+}
+
+/**
+ * @brief Set up the persistent halo requests for the current cell grid. The edge cells are
+ *        sent straight out of (and received straight into) the cell slots, with derived
+ *        datatypes covering the strided rows, so no packing is needed. With --halo=shm,
+ *        neighbours on the same node skip the messages and read each other's shared
+ *        windows instead. This has to be called again whenever the cell grid is reallocated.
+ *
+ */
+void setup_halo() {
+	if (halo_mode == HALO_SENDRECV) {
+		return;
+	}
+
+	if (halo_mode == HALO_SHM) {
+		MPI_Win_lock_all(MPI_MODE_NOCHECK, cells_win);
+		shared_fence();
+	}
+	query_shared_neighbour(west_rank, &shared_west);
+	query_shared_neighbour(east_rank, &shared_east);
+	query_shared_neighbour(south_rank, &shared_south);
+	query_shared_neighbour(north_rank, &shared_north);
+
+	num_halo_requests[0] = 0;
+	num_halo_requests[1] = 0;
+
+	// east/west: columns 1 and sizei, rows 1..sizej
+	int col_w[2] = {1, 1}, col_e[2] = {sizei, 1};
+	int ghost_w[2] = {0, 1}, ghost_e[2] = {sizei+1, 1};
+	if (!shared_east.on_node) {
+		init_halo_send(col_e, 0, 1, sizej, east_rank, 1, 0);
+		init_halo_recv(ghost_e, 0, 1, sizej, east_rank, 2, 0);
+	}
+	if (!shared_west.on_node) {
+		init_halo_send(col_w, 0, 1, sizej, west_rank, 2, 0);
+		init_halo_recv(ghost_w, 0, 1, sizej, west_rank, 1, 0);
+	}
+
+	// north/south: rows 1 and sizej, columns 0..sizei+1
+	int row_s[2] = {0, 1}, row_n[2] = {0, sizej};
+	int ghost_s[2] = {0, 0}, ghost_n[2] = {0, sizej+1};
+	if (!shared_north.on_node) {
+		init_halo_send(row_n, 1, 0, sizei+2, north_rank, 3, 1);
+		init_halo_recv(ghost_n, 1, 0, sizei+2, north_rank, 4, 1);
+	}
+	if (!shared_south.on_node) {
+		init_halo_send(row_s, 1, 0, sizei+2, south_rank, 4, 1);
+		init_halo_recv(ghost_s, 1, 0, sizei+2, south_rank, 3, 1);
+	}
+
+	halo_ready = 1;
+}
+
+/**
+ * @brief Release the persistent halo requests (before the cell grid is freed)
+ *
+ */
+void free_halo() {
+	if (!halo_ready) {
+		return;
+	}
+	for (int phase = 0; phase < 2; phase++) {
+		for (int r = 0; r < num_halo_requests[phase]; r++) {
+			MPI_Request_free(&halo_requests[phase][r]);
+		}
+	}
+	if (halo_mode == HALO_SHM) {
+		MPI_Win_unlock_all(cells_win);
+	}
+	halo_ready = 0;
+}
+
+/**
+ * @brief Apply the boundary conditions. This fills the ghost cell layer with the positions
+ *        of the particles in the neighbouring ranks' edge cells. The domain is periodic, so
+ *        the ranks on the edge of the Cartesian grid wrap around. The exchange is done in x
+ *        first and then in y (including the x ghost cells), so the corners are filled too.
+ *        This has to be done after every cell list update.
+ *
+ */
+void apply_boundary() {
+	if (halo_mode != HALO_SENDRECV) {
+		int shared = (halo_mode == HALO_SHM);
+
+		// wait for every rank on the node to finish updating its cells
+		if (shared) shared_fence();
+
+		MPI_Startall(num_halo_requests[0], halo_requests[0]);
+		if (shared_west.on_node) {
+			int src[2] = {shared_west.sizei, 1}, dst[2] = {0, 1};
+			read_shared_line(&shared_west, src, dst, 0, 1, sizej);
+		}
+		if (shared_east.on_node) {
+			int src[2] = {1, 1}, dst[2] = {sizei+1, 1};
+			read_shared_line(&shared_east, src, dst, 0, 1, sizej);
+		}
+		MPI_Waitall(num_halo_requests[0], halo_requests[0], MPI_STATUSES_IGNORE);
+
+		// the y phase reads the neighbours' x ghost cells (for the corners)
+		if (shared) shared_fence();
+
+		MPI_Startall(num_halo_requests[1], halo_requests[1]);
+		if (shared_south.on_node) {
+			int src[2] = {0, shared_south.sizej}, dst[2] = {0, 0};
+			read_shared_line(&shared_south, src, dst, 1, 0, sizei+2);
+		}
+		if (shared_north.on_node) {
+			int src[2] = {0, 1}, dst[2] = {0, sizej+1};
+			read_shared_line(&shared_north, src, dst, 1, 0, sizei+2);
+		}
+		MPI_Waitall(num_halo_requests[1], halo_requests[1], MPI_STATUSES_IGNORE);
+
+		// don't let a neighbour move its particles until everyone has finished reading
+		if (shared) shared_fence();
+		return;
+	}
+
+	// east/west: columns 1 and sizei, rows 1..sizej
+	int send_w[2] = {1, 1}, send_e[2] = {sizei, 1};
+	int recv_w[2] = {0, 1}, recv_e[2] = {sizei+1, 1};
+	exchange_halo_line(west_rank, east_rank, sizej, 0, 1, send_w, send_e, recv_w, recv_e);
+
+	// north/south: rows 1 and sizej, columns 0..sizei+1
+	int send_s[2] = {0, 1}, send_n[2] = {0, sizej};
+	int recv_s[2] = {0, 0}, recv_n[2] = {0, sizej+1};
+	exchange_halo_line(south_rank, north_rank, sizei+2, 1, 0, send_s, send_n, recv_s, recv_n);
+}
+
+/**
+ * @brief Pack every particle in a line of ghost cells for migration and empty the cells
+ *
+ * @param buf The buffer to pack into (grown if required)
+ * @param buf_size The size of the buffer
+ * @param i0 The i index of the first cell
+ * @param j0 The j index of the first cell
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param n The number of cells
+ * @return int The number of particles packed
+ */
+static int pack_migrants(double ** buf, int * buf_size, int i0, int j0, int di, int dj, int n) {
+	int num = 0;
+	for (int c = 0; c < n; c++) {
+		num += cells[i0 + c*di][j0 + c*dj].count;
+	}
+	reserve_buffer(buf, buf_size, num * MIGRATE_DOUBLES);
+
+	double * b = *buf;
+	for (int c = 0; c < n; c++) {
+		struct cell_list * cell = &cells[i0 + c*di][j0 + c*dj];
+		for (int k = 0; k < cell->count; k++) {
+			int p = cell->offset + k;
+			b[0] = particles.x[p];
+			b[1] = particles.y[p];
+			b[2] = particles.vx[p];
+			b[3] = particles.vy[p];
+			b[4] = particles.ax[p];
+			b[5] = particles.ay[p];
+			b[6] = particles.id[p];
+			b[7] = c;
+			b += MIGRATE_DOUBLES;
+		}
+		cell->count = 0;
+	}
+	return num;
+}
+
+/**
+ * @brief Add received migrants to a line of cells
+ *
+ * @param buf The received particles
+ * @param num The number of particles
+ * @param i0 The i index of the first cell
+ * @param j0 The j index of the first cell
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ */
+static void unpack_migrants(double * buf, int num, int i0, int j0, int di, int dj) {
+	for (int m = 0; m < num; m++) {
+		double * b = buf + (m * MIGRATE_DOUBLES);
+		int c = (int) b[7];
+		add_particle(&(cells[i0 + c*di][j0 + c*dj]), b[0], b[1], b[2], b[3], b[4], b[5], (int) b[6]);
+	}
+}
+
+/**
+ * @brief Send the particles that update_cells() moved into a line of ghost cells to the
+ *        neighbours that own those cells, in both directions of one dimension.
+ *
+ * @param lo_rank The neighbour in the negative direction
+ * @param hi_rank The neighbour in the positive direction
+ * @param n The number of cells in the line
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param ghost_lo The first ghost cell owned by lo_rank (as i, j)
+ * @param ghost_hi The first ghost cell owned by hi_rank (as i, j)
+ * @param edge_lo The first local cell on the lo edge (as i, j)
+ * @param edge_hi The first local cell on the hi edge (as i, j)
+ */
+static void migrate_line(int lo_rank, int hi_rank, int n, int di, int dj,
+						 int ghost_lo[2], int ghost_hi[2], int edge_lo[2], int edge_hi[2]) {
+	int num_lo = pack_migrants(&send_buf_lo, &send_size_lo, ghost_lo[0], ghost_lo[1], di, dj, n);
+	int num_hi = pack_migrants(&send_buf_hi, &send_size_hi, ghost_hi[0], ghost_hi[1], di, dj, n);
+
+	int recv_num_lo, recv_num_hi;
+	MPI_Sendrecv(&num_hi, 1, MPI_INT, hi_rank, 3, &recv_num_lo, 1, MPI_INT, lo_rank, 3, cart_comm, MPI_STATUS_IGNORE);
+	MPI_Sendrecv(&num_lo, 1, MPI_INT, lo_rank, 4, &recv_num_hi, 1, MPI_INT, hi_rank, 4, cart_comm, MPI_STATUS_IGNORE);
+
+	reserve_buffer(&recv_buf_lo, &recv_size_lo, recv_num_lo * MIGRATE_DOUBLES);
+	reserve_buffer(&recv_buf_hi, &recv_size_hi, recv_num_hi * MIGRATE_DOUBLES);
+
+	MPI_Sendrecv(send_buf_hi, num_hi * MIGRATE_DOUBLES, MPI_DOUBLE, hi_rank, 5,
+				 recv_buf_lo, recv_num_lo * MIGRATE_DOUBLES, MPI_DOUBLE, lo_rank, 5, cart_comm, MPI_STATUS_IGNORE);
+	MPI_Sendrecv(send_buf_lo, num_lo * MIGRATE_DOUBLES, MPI_DOUBLE, lo_rank, 6,
+				 recv_buf_hi, recv_num_hi * MIGRATE_DOUBLES, MPI_DOUBLE, hi_rank, 6, cart_comm, MPI_STATUS_IGNORE);
+
+	unpack_migrants(recv_buf_lo, recv_num_lo, edge_lo[0], edge_lo[1], di, dj);
+	unpack_migrants(recv_buf_hi, recv_num_hi, edge_hi[0], edge_hi[1], di, dj);
+}
+
+/**
+ * @brief Migrate particles that have left this rank's subdomain to the rank that now owns
+ *        them. update_cells() places such particles in the ghost layer; they are forwarded
+ *        in x first (whole ghost columns, including the corners) and then in y, so diagonal
+ *        moves reach the diagonal neighbour in two hops. Positions are cell relative, so
+ *        no adjustment is needed when a particle crosses the periodic boundary.
+ *
+ */
+void exchange_particles() {
+	// east/west: ghost columns 0 and sizei+1, rows 0..sizej+1
+	int ghost_w[2] = {0, 0}, ghost_e[2] = {sizei+1, 0};
+	int edge_w[2] = {1, 0}, edge_e[2] = {sizei, 0};
+	migrate_line(west_rank, east_rank, sizej+2, 0, 1, ghost_w, ghost_e, edge_w, edge_e);
+
+	// north/south: ghost rows 0 and sizej+1, columns 1..sizei
+	int ghost_s[2] = {1, 0}, ghost_n[2] = {1, sizej+1};
+	int edge_s[2] = {1, 1}, edge_n[2] = {1, sizej};
+	migrate_line(south_rank, north_rank, sizei, 1, 0, ghost_s, ghost_n, edge_s, edge_n);
+}
+
+/**
+ * @brief Empty the ghost layer, ready for update_cells() to move departing particles into it
+ *
+ */
+void clear_ghosts() {
+	for (int i = 0; i < sizei+2; i++) {
+		cells[i][0].count = 0;
+		cells[i][sizej+1].count = 0;
+	}
+	for (int j = 1; j < sizej+1; j++) {
+		cells[0][j].count = 0;
+		cells[sizei+1][j].count = 0;
+	}
+}
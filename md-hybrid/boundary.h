@@ -0,0 +1,17 @@
+#ifndef BOUNDARY_H
+#define BOUNDARY_H
+
+// halo exchange implementations
+enum halo_mode {
+	HALO_SENDRECV,
+	HALO_PERSISTENT,
+	HALO_SHM
+};
+
+void setup_halo();
+void free_halo();
+void apply_boundary();
+void exchange_particles();
+void clear_ghosts();
+
+#endif
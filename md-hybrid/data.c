@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "data.h"
+
+// parameters for end time, cut off, cell size, grid size and number of particles
+double t_end = 0.5;
+double r_cut_off = 2.5;
+double cell_size = 2.5;
+int x = 500;
+int y = 500;
+int num_particles_total;
+
+// number of iterations, timestep duration and half-timestep duration
+int niters = 1000;
+double dt;
+double dth;
+
+// square of the cut off (to prevent need for some sqrts later)
+double r_cut_off_2;
+
+// constants required to calculate the potential energy
+double r_cut_off_2_inv;
+double r_cut_off_6_inv;
+double Uc;
+double Duc;
+
+// random seed (to allow reproducibility)
+long seed;
+
+// initial temperature and the number of particles per cell per dimension
+double init_temp = 1.0;
+int num_part_per_dim = 2;
+
+// the maximum number of particles a single cell can hold (0 means 4 * num_part_per_dim^2)
+int cell_capacity = 0;
+
+// the cell list
+struct cell_list ** cells;
+
+struct particle_t particles;
+
+int size, rank;
+int sizei, sizej;
+int starti, startj;
+int dims[2], coords[2];
+int * bounds_x, * bounds_y;
+MPI_Comm cart_comm;
+int east_rank, west_rank, north_rank, south_rank;
+
+// the ranks sharing this node, and the shared window holding the cells (--halo=shm only)
+MPI_Comm node_comm = MPI_COMM_NULL;
+MPI_Win cells_win = MPI_WIN_NULL;
+
+/**
+ * @brief Add a particle to a particular cell list
+ *
+ * @param cell The cell list to add the particle to
+ * @param px The x position of the particle within the cell
+ * @param py The y position of the particle within the cell
+ * @param pvx The x velocity
+ * @param pvy The y velocity
+ * @param pax The x acceleration
+ * @param pay The y acceleration
+ * @param pid The global id of the particle
+ */
+void add_particle(struct cell_list * cell, double px, double py, double pvx, double pvy, double pax, double pay, int pid) {
+	if (cell->count == cell_capacity) {
+		fprintf(stderr, "Rank %d: a cell has overflowed its %d slots, increase --cell-capacity\n", rank, cell_capacity);
+		MPI_Abort(MPI_COMM_WORLD, 2);
+	}
+	int p = cell->offset + cell->count;
+	particles.x[p] = px;
+	particles.y[p] = py;
+	particles.vx[p] = pvx;
+	particles.vy[p] = pvy;
+	particles.ax[p] = pax;
+	particles.ay[p] = pay;
+	particles.id[p] = pid;
+	cell->count++;
+}
+
+/**
+ * @brief Remove a particle from a particular cell list. The last particle in the cell
+ *        is moved into the freed slot, so slots [0, count) stay dense.
+ *
+ * @param cell The cell list to remove the particle from
+ * @param idx The index of the particle within the cell
+ */
+void remove_particle(struct cell_list * cell, int idx) {
+	int p = cell->offset + idx;
+	int last = cell->offset + cell->count - 1;
+	particles.x[p] = particles.x[last];
+	particles.y[p] = particles.y[last];
+	particles.vx[p] = particles.vx[last];
+	particles.vy[p] = particles.vy[last];
+	particles.ax[p] = particles.ax[last];
+	particles.ay[p] = particles.ay[last];
+	particles.id[p] = particles.id[last];
+	cell->count--;
+}
+
+/**
+ * @brief Allocate the local cell grid (including the ghost layer) and the particle slots
+ *        for the current sizei x sizej subdomain. All cells start empty. If node_comm is
+ *        set, the cell counts and positions are placed in a shared memory window (preceded
+ *        by the subdomain size), so that neighbours on the same node can read them directly.
+ *        In that case this is collective over node_comm.
+ *
+ */
+void alloc_cells() {
+	int num_cells = (sizei+2) * (sizej+2);
+	int num_slots = num_cells * cell_capacity;
+
+	if (node_comm != MPI_COMM_NULL) {
+		MPI_Aint bytes = SHARED_HEADER_BYTES + (2 * sizeof(double) * num_slots) + (sizeof(struct cell_list) * num_cells);
+		char * base;
+		MPI_Win_allocate_shared(bytes, 1, MPI_INFO_NULL, node_comm, &base, &cells_win);
+
+		int * header = (int *) base;
+		header[0] = sizei;
+		header[1] = sizej;
+		particles.x = (double *) (base + SHARED_HEADER_BYTES);
+		particles.y = particles.x + num_slots;
+
+		cells = (struct cell_list **) malloc((sizei+2) * sizeof(struct cell_list *));
+		cells[0] = (struct cell_list *) (particles.y + num_slots);
+		for (int i = 1; i < sizei+2; i++) {
+			cells[i] = &cells[0][i*(sizej+2)];
+		}
+	} else {
+		cells = alloc_2d_cell_list_array(sizei+2, sizej+2);
+		particles.x = malloc(sizeof(double) * num_slots);
+		particles.y = malloc(sizeof(double) * num_slots);
+	}
+
+	particles.ax = malloc(sizeof(double) * num_slots);
+	particles.ay = malloc(sizeof(double) * num_slots);
+	particles.vx = malloc(sizeof(double) * num_slots);
+	particles.vy = malloc(sizeof(double) * num_slots);
+	particles.id = malloc(sizeof(int) * num_slots);
+
+	for (int i = 0; i < sizei+2; i++) {
+		for (int j = 0; j < sizej+2; j++) {
+			cells[i][j].count = 0;
+			cells[i][j].offset = ((i * (sizej+2)) + j) * cell_capacity;
+		}
+	}
+}
+
+/**
+ * @brief Free the local cell grid and the particle slots
+ *
+ */
+void free_cells() {
+	free(particles.ax);
+	free(particles.ay);
+	free(particles.vx);
+	free(particles.vy);
+	free(particles.id);
+
+	if (node_comm != MPI_COMM_NULL) {
+		free(cells);
+		MPI_Win_free(&cells_win);
+	} else {
+		free(particles.x);
+		free(particles.y);
+		free_2d_array((void **) cells);
+	}
+}
+
+/**
+ * @brief Count the particles owned by this rank (i.e. those in the non-ghost cells)
+ *
+ * @return int The number of local particles
+ */
+int count_local_particles() {
+	int count = 0;
+	for (int i = 1; i < sizei+1; i++) {
+		for (int j = 1; j < sizej+1; j++) {
+			count += cells[i][j].count;
+		}
+	}
+	return count;
+}
+
+/**
+ * @brief Allocate a 2D array of cell list structures
+ *
+ * @param m Dimension in X direction
+ * @param n Dimension in Y direction
+ * @return struct cell_list** An allocated 2D cell list structure
+ */
+struct cell_list ** alloc_2d_cell_list_array(int m, int n) {
+  	struct cell_list ** x;
+
+  	x = (struct cell_list **) malloc(m * sizeof(struct cell_list *));
+  	x[0] = (struct cell_list *) calloc(m * n, sizeof(struct cell_list));
+  	for (int i = 1; i < m; i++)
+    	x[i] = &x[0][i*n];
+	return x;
+}
+
+/**
+ * @brief Free a 2D array
+ *
+ * @param array The 2D array to free
+ */
+void free_2d_array(void ** array) {
+	free(array[0]);
+	free(array);
+}
@@ -0,0 +1,81 @@
+#ifndef DATA_H
+#define DATA_H
+#include <mpi.h>
+// particle data type. Particles are stored in fixed-capacity slots, one block of
+// cell_capacity slots per cell (including ghost cells), so cell (i,j) owns the
+// slots [cells[i][j].offset, cells[i][j].offset + cell_capacity)
+struct particle_t {
+	double * x, * y; // position within cell
+	double * ax, * ay; // acceleration
+	double * vx, * vy; // velocity
+	int * id; // global particle id
+};
+
+// list for a cell, with the offset of its first slot
+struct cell_list {
+	int count;
+	int offset;
+};
+
+// parameters for end time, cut off, cell size, grid size and number of particles
+extern double t_end;
+extern double r_cut_off;
+extern double cell_size;
+extern int x;
+extern int y;
+extern int num_particles_total;
+
+// number of iterations, timestep duration and half-timestep duration
+extern int niters;
+extern double dt;
+extern double dth;
+
+// square of the cut off (to prevent need for some sqrts later)
+extern double r_cut_off_2;
+
+// constants required to calculate the potential energy
+extern double r_cut_off_2_inv;
+extern double r_cut_off_6_inv;
+extern double Uc;
+extern double Duc;
+
+// random seed (to allow reproducibility)
+extern long seed;
+
+// initial temperature and the number of particles per cell per dimension
+extern double init_temp;
+extern int num_part_per_dim;
+
+// the maximum number of particles a single cell can hold
+extern int cell_capacity;
+
+// the cell list (local cells 1..sizei, 1..sizej, surrounded by a layer of ghost cells)
+extern struct cell_list ** cells;
+extern struct particle_t particles;
+
+// the Cartesian decomposition. bounds_x/bounds_y hold the first global cell of every
+// rank column/row (dims[d]+1 entries), this rank owns global cells [starti, starti+sizei)
+// and [startj, startj+sizej)
+extern int size, rank;
+extern int sizei, sizej;
+extern int starti, startj;
+extern int dims[2], coords[2];
+extern int * bounds_x, * bounds_y;
+extern MPI_Comm cart_comm;
+extern int east_rank, west_rank, north_rank, south_rank;
+
+// shared memory cells (--halo=shm). The window starts with a header holding sizei and
+// sizej, followed by the x slots, the y slots and the cell lists
+#define SHARED_HEADER_BYTES 16
+extern MPI_Comm node_comm;
+extern MPI_Win cells_win;
+
+void add_particle(struct cell_list * cell, double px, double py, double pvx, double pvy, double pax, double pay, int pid);
+void remove_particle(struct cell_list * cell, int idx);
+void alloc_cells();
+void free_cells();
+int count_local_particles();
+struct cell_list ** alloc_2d_cell_list_array(int m, int n);
+void free_2d_array(void ** array);
+
+#endif
@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <omp.h>
+
+#include "args.h"
+#include "balance.h"
+#include "boundary.h"
+#include "data.h"
+#include "setup.h"
+#include "vtk.h"
+
+struct timeval t;
+
+double get_time() {
+  gettimeofday(&t, NULL);
+  return t.tv_sec + (1e-6 * t.tv_usec);
+}
+
+/**
+ * @brief Calculate the acceleration of every particle in one cell, by evaluating the Lennard-Jones
+ *        potential with the particles in the 9 surrounding cells (within the cut-off radius).
+ * 
+ * @param i The i index of the cell
+ * @param j The j index of the cell
+ * @return double The potential energy of the cell's particles
+ */
+static inline double comp_accel_cell(int i, int j) {
+	double pot_energy = 0.0;
+
+	for (int k = 0; k < cells[i][j].count; k++) {
+		int p = cells[i][j].offset + k;
+
+		// zero acceleration for every particle
+		double p_ax = 0.0;
+		double p_ay = 0.0;
+
+		// Compare each particle with all particles in the 9 cells
+		for (int a = -1; a <= 1; a++) {
+			for (int b = -1; b <= 1; b++) {
+				for (int l = 0; l < cells[i+a][j+b].count; l++) {
+					int q = cells[i+a][j+b].offset + l;
+					if (p == q) {
+						continue;
+					}
+
+					// since particles are stored relative to their cell, calculate the
+					// actual x and y coordinates.
+					double p_real_x = ((i-1) * cell_size) + particles.x[p];
+					double p_real_y = ((j-1) * cell_size) + particles.y[p];
+					double q_real_x = ((i+a-1) * cell_size) + particles.x[q];
+					double q_real_y = ((j+b-1) * cell_size) + particles.y[q];
+					
+					// calculate distance in x and y, then absolute distance
+					double dx = p_real_x - q_real_x;
+					double dy = p_real_y - q_real_y;
+					double r_2 = dx*dx + dy*dy;
+					
+					// if distance less than cut off, calculate force and 
+					// use this to calculate acceleration in each dimension
+					// calculate potential energy of each particle at the same time
+					if (r_2 < r_cut_off_2) {
+						double r_2_inv = 1.0 / r_2;
+						double r_6_inv = r_2_inv * r_2_inv * r_2_inv;
+						
+						double f = (48.0 * r_2_inv * r_6_inv * (r_6_inv - 0.5));
+
+						p_ax += f*dx;
+						p_ay += f*dy;
+
+						pot_energy += 4.0 * r_6_inv * (r_6_inv - 1.0) - Uc - Duc * (sqrt(r_2) - r_cut_off);
+					}
+				}
+			}
+		}
+
+		particles.ax[p] = p_ax;
+		particles.ay[p] = p_ay;
+	}
+
+	return pot_energy;
+}
+
+/**
+ * @brief This routine calculates the acceleration felt by each particle based on evaluating the Lennard-Jones 
+ *        potential with its neighbours. It only evaluates particles within a cut-off radius, and uses cells to 
+ *        reduce the search space. It also calculates the potential energy of the system. 
+ *        The halo exchange is overlapped with the force calculation: the master thread fills
+ *        the ghost layer (it is the only thread that calls MPI, as required by MPI_THREAD_FUNNELED)
+ *        while the other threads work through the interior cells, which don't touch the ghost
+ *        layer. Once the halo has arrived, the whole team computes the cells on the edge.
+ * 
+ * @param wait Set to the time the team spent waiting for the halo (the part of the exchange
+ *             that the interior cells didn't hide)
+ * @return double The potential energy of the local particles (summed, not averaged)
+ */
+double comp_accel(double * wait) {
+	double pot_energy = 0.0;
+	double start = omp_get_wtime();
+	double halo_done = start;
+	double interior_done = start;
+
+	#pragma omp parallel reduction(+:pot_energy) reduction(max:interior_done)
+	{
+		#pragma omp master
+		{
+			apply_boundary();
+			halo_done = omp_get_wtime();
+		}
+
+		// interior cells (the master joins in once the halo is done)
+		#pragma omp for collapse(2) schedule(dynamic) nowait
+		for (int i = 2; i < sizei; i++) {
+			for (int j = 2; j < sizej; j++) {
+				pot_energy += comp_accel_cell(i, j);
+			}
+		}
+		if (omp_get_thread_num() != 0) interior_done = omp_get_wtime();
+
+		// the ghost layer must be complete before the edge cells are computed
+		#pragma omp barrier
+
+		#pragma omp for collapse(2) schedule(dynamic)
+		for (int i = 1; i < sizei+1; i++) {
+			for (int j = 1; j < sizej+1; j++) {
+				if (i == 1 || i == sizei || j == 1 || j == sizej) {
+					pot_energy += comp_accel_cell(i, j);
+				}
+			}
+		}
+	}
+
+	// the halo only held the team up if it finished after the other threads ran out of interior cells
+	*wait = (halo_done > interior_done) ? halo_done - interior_done : 0.0;
+
+	// the sum is averaged over the global particle count once it has been reduced
+	return pot_energy;
+}
+
+/**
+ * @brief This routine updates the velocity of each particle for half a time step and then 
+ *        moves the particle for a whole time step
+ * 
+ */
+void move_particles() {
+	// move all particles half a time step
+	#pragma omp parallel for collapse(2)
+	for (int i = 1; i < sizei+1; i++) {
+		for (int j = 1; j < sizej+1; j++) {
+			for (int k = 0; k < cells[i][j].count; k++) {
+				int p = cells[i][j].offset + k;
+
+				// update velocity to obtain v(t + Dt/2)
+				particles.vx[p] += dth * particles.ax[p];
+				particles.vy[p] += dth * particles.ay[p];
+
+				// update particle coordinates to p(t + Dt) (scaled to the cell_size)
+				particles.x[p] += (dt * particles.vx[p]);
+				particles.y[p] += (dt * particles.vy[p]);
+			}
+		}
+	}
+}
+
+/**
+ * @brief This routine updates the cell lists. If a particles coordinates are not within a cell
+ *        any more, this function calculates the cell it should be in and performs the move.
+ *        If a particle moves more than 1 cell in any direction, this indicates poor settings
+ *        and therefore an error is generated. Particles that leave the subdomain are moved
+ *        into the (emptied) ghost layer, from where exchange_particles() sends them on.
+ * 
+ */
+void update_cells() {
+	// move particles that need to move cell lists
+	for (int i = 1; i < sizei+1; i++) {
+		for (int j = 1; j < sizej+1; j++) {
+			// walk backwards, as remove_particle moves the last particle into the freed slot
+			for (int k = cells[i][j].count - 1; k >= 0; k--) {
+				int p = cells[i][j].offset + k;
+
+				// if a particles x or y value is greater than the cell size or less than 0, it must have moved cell
+				// do a quick check to make sure its not moved 2 cells (since this means our time step is too large, or something else is going wrong)
+				if ((particles.x[p] < 0.0) | (particles.x[p] >= cell_size) | (particles.y[p] < 0.0) | (particles.y[p] >= cell_size)) {
+					if ((particles.x[p] < (-cell_size)) || (particles.x[p] >= (2*cell_size)) || (particles.y[p] < (-cell_size)) || (particles.y[p] >= (2*cell_size))) {
+						fprintf(stderr, "A particle has moved more than one cell!\n");
+						MPI_Abort(MPI_COMM_WORLD, 1);
+					}
+
+					// work out whether we've moved a cell in the x and the y dimension
+					int x_shift = (particles.x[p] < 0.0) ? -1 : (particles.x[p] >= cell_size) ? +1 : 0;
+					int y_shift = (particles.y[p] < 0.0) ? -1 : (particles.y[p] >= cell_size) ? +1 : 0;
+					
+					// the new i and j are +/- 1 in each dimension (possibly a ghost cell)
+					int new_i = i+x_shift;
+					int new_j = j+y_shift;
+
+					// update x and y coordinates (i.e. remove the additional cell size)
+					particles.x[p] = particles.x[p] + (x_shift * -cell_size);
+					particles.y[p] = particles.y[p] + (y_shift * -cell_size);
+
+					// add the particle to the new cell list, then remove it from its current cell list
+					add_particle(&(cells[new_i][new_j]), particles.x[p], particles.y[p], particles.vx[p], particles.vy[p],
+								 particles.ax[p], particles.ay[p], particles.id[p]);
+					remove_particle(&(cells[i][j]), k);
+				}
+			}
+		}
+	}
+}
+
+/**
+ * @brief This updates the velocity of particles for the whole time step (i.e. adds the acceleration for another
+ *        half step, since its already done half a time step in the move_particles routine). Additionally, this
+ *        function calculated the kinetic energy of the system.
+ * 
+ * @return double The kinetic energy of the local particles (summed, not averaged)
+ */
+double update_velocity() {
+	double kinetic_energy = 0.0;
+
+	#pragma omp parallel for collapse(2) reduction(+:kinetic_energy)
+	for (int i = 1; i < sizei+1; i++) {
+		for (int j = 1; j < sizej+1; j++) {
+			for (int k = 0; k < cells[i][j].count; k++) {
+				int p = cells[i][j].offset + k;
+
+				// update velocity again by half time to obtain v(t + Dt)
+				particles.vx[p] += dth * particles.ax[p];
+				particles.vy[p] += dth * particles.ay[p];
+
+				// calculate the kinetic energy by adding up the squares of the velocities in each dim
+				kinetic_energy += (particles.vx[p] * particles.vx[p]) + (particles.vy[p] * particles.vy[p]);
+			}
+		}
+	}
+
+	// KE = (1/2)mv^2
+	kinetic_energy *= 0.5;
+	return kinetic_energy;
+}
+
+/**
+ * @brief This is the main routine that sets up the problem space and then drives the solving routines.
+ * 
+ * @param argc The number of arguments passed to the program
+ * @param argv An array of the arguments passed to the program
+ * @return int The exit code of the application
+ */
+int main(int argc, char *argv[]) {
+
+	// only the master thread makes MPI calls
+	int provided;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+	if (provided < MPI_THREAD_FUNNELED) {
+		if (rank == 0) fprintf(stderr, "Error: The MPI library does not support MPI_THREAD_FUNNELED.\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	// Set default parameters
+	set_defaults();
+	// parse the arguments
+	parse_args(argc, argv);
+
+	if (num_threads > 0) {
+		omp_set_num_threads(num_threads);
+	}
+	// call set up to update defaults
+	setup();
+	// split the cell grid over the ranks
+	setup_decomposition();
+
+	if (rank == 0 && verbose) print_opts();
+	
+	double time = get_time();
+
+	// set up problem
+	problem_setup();
+	setup_halo();
+	// compute the initial accelerations (this also fills the ghost cells from the neighbouring ranks)
+	double halo_wait = 0.0;
+	comp_accel(&halo_wait);
+
+	double potential_energy = 0.0;
+	double kinetic_energy = 0.0;
+
+	int iters = 0;
+	double t;
+	for (t = 0.0; t < t_end; t+=dt, iters++) {
+		// move particles half a time step
+		move_particles();
+
+		// update cell lists (i.e. move any particles between cell lists if required)
+		clear_ghosts();
+		update_cells();
+
+		// send particles that have left the subdomain to their new owner
+		exchange_particles();
+
+		// compute acceleration for each particle and calculate potential energy
+		// (the ghost cells are updated in here, overlapped with the interior cells)
+		double force_time = get_time();
+		potential_energy = comp_accel(&halo_wait);
+		record_force_time(get_time() - force_time - halo_wait);
+
+		// update velocity based on the acceleration and calculate the kinetic energy
+		kinetic_energy = update_velocity();
+	
+		if (iters % output_freq == 0) {
+			// calculate temperature and total energy
+			double global_potential, global_kinetic;
+			MPI_Allreduce(&potential_energy, &global_potential, 1, MPI_DOUBLE, MPI_SUM, cart_comm);
+			MPI_Allreduce(&kinetic_energy, &global_kinetic, 1, MPI_DOUBLE, MPI_SUM, cart_comm);
+			global_potential /= num_particles_total;
+			global_kinetic /= num_particles_total;
+
+			double total_energy = global_kinetic + global_potential;
+			double temp = global_kinetic * 2.0 / 3.0;
+			
+			if(rank == 0) {
+				printf("Step %8d, Time: %14.8e (dt: %14.8e), Total energy: %14.8e (p:%14.8e,k:%14.8e), Temp: %14.8e\n", iters, t+dt, dt, total_energy, global_potential, global_kinetic, temp);
+			}
+ 
+			// if output is enabled and checkpointing is enabled, write out
+            if ((!no_output) && (enable_checkpoints))
+                write_checkpoint(iters, t+dt);
+		}
+
+		// move the subdomain boundaries if the force calculation has become unbalanced
+		load_balance(iters);
+	}
+
+	// calculate the final energy and write out a final status message
+	MPI_Allreduce(MPI_IN_PLACE, &potential_energy, 1, MPI_DOUBLE, MPI_SUM, cart_comm);
+	MPI_Allreduce(MPI_IN_PLACE, &kinetic_energy, 1, MPI_DOUBLE, MPI_SUM, cart_comm);
+	double final_energy = (kinetic_energy + potential_energy) / num_particles_total;
+	
+	if (rank == 0) {
+		printf("Step %8d, Time: %14.8e, Final energy: %14.8e\n", iters, t, final_energy);
+		printf("Simulation complete.\n");
+
+		time = get_time() - time;
+		printf("Total time: %14.8lf seconds\n", time);
+	}
+
+	// if output is enabled, write the mesh file and the final state (which every rank writes a part of)
+	if (!no_output) {
+		if (rank == 0) write_mesh();
+		write_result(iters, t);
+	}
+
+	MPI_Finalize();	
+
+	return 0;
+}
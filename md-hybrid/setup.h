@@ -0,0 +1,11 @@
+#ifndef SETUP_H
+#define SETUP_H
+
+#include <stdlib.h>
+
+void set_defaults();
+void setup();
+void setup_decomposition();
+void problem_setup();
+
+#endif
\ No newline at end of file
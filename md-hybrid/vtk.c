@@ -0,0 +1,184 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include "vtk.h"
+#include "data.h"
+
+char checkpoint_basename[1024];
+char result_filename[1024];
+char mesh_filename[1024];
+
+/**
+ * @brief Set the default basename for file output to out/vortex
+ * 
+ */
+void set_default_base() {
+    set_basename("out/md");
+}
+
+/**
+ * @brief Set the basename for file output
+ * 
+ * @param base Basename string
+ */
+void set_basename(char *base) {
+    checkpoint_basename[0] = '\0';
+    result_filename[0] = '\0';
+    sprintf(checkpoint_basename, "%s-%%d.vtp", base);
+    sprintf(result_filename, "%s.vtp", base);
+	sprintf(mesh_filename, "%s-mesh.vti", base);
+}
+
+/**
+ * @brief Get the basename for file output
+ * 
+ * @return char* Basename string
+ */
+char *get_basename() {
+    return checkpoint_basename;
+}
+
+/**
+ * @brief Write a checkpoint VTK file (with the iteration number in the filename)
+ * 
+ * @param iteration The current iteration number
+ * @return int Return whether the write was successful
+ */
+int write_checkpoint(int iters, double t) { 
+    char filename[1024];
+    sprintf(filename, checkpoint_basename, iters);
+    return write_vtk(filename, iters, t);
+}
+
+/**
+ * @brief Write the final output to a VTK file
+ * 
+ * @return int Return whether the write was successful
+ */
+int write_result(int iters, double t) {
+    return write_vtk(result_filename, iters, t);
+}
+
+/**
+ * @brief Get the byte order of this machine, as named in VTK files
+ *
+ * @return const char* "LittleEndian" or "BigEndian"
+ */
+static const char * byte_order() {
+	int one = 1;
+	return (*(char *) &one == 1) ? "LittleEndian" : "BigEndian";
+}
+
+/**
+ * @brief Write out a particle VTK file (i.e. a .vtp file) in parallel. The positions are
+ *        stored as raw binary appended data, so every rank can work out where its particles
+ *        go from an MPI_Exscan of the particle counts and write them with a single collective
+ *        MPI_File_write_at_all. Rank 0 writes the XML header and footer around them. This is
+ *        collective over cart_comm.
+ * 
+ * @param filename The filename to use for output
+ * @param iters The number of iterations
+ * @param t The simulation time
+ * @return int Return whether the write was successful
+ */
+int write_vtk(char * filename, int iters, double t) {
+	long long num_local = count_local_particles();
+	long long num_before = 0, num_total;
+	MPI_Exscan(&num_local, &num_before, 1, MPI_LONG_LONG, MPI_SUM, cart_comm);
+	MPI_Allreduce(&num_local, &num_total, 1, MPI_LONG_LONG, MPI_SUM, cart_comm);
+	if (rank == 0) {
+		// MPI_Exscan leaves the first rank's result undefined
+		num_before = 0;
+	}
+
+	// every rank builds the same header, so they all know where the data starts
+	char header[2048];
+	int header_size = snprintf(header, sizeof(header),
+		"<?xml version=\"1.0\"?>\n"
+		"<VTKFile type=\"PolyData\" version=\"0.1\" byte_order=\"%s\" header_type=\"UInt64\">\n"
+		"<PolyData>\n"
+		"<FieldData>\n"
+		"<DataArray type=\"Float64\" Name=\"TIME\" NumberOfTuples=\"1\" format=\"ascii\">\n"
+		"%.12e\n"
+		"</DataArray>\n"
+		"<DataArray type=\"Int32\" Name=\"CYCLE\" NumberOfTuples=\"1\" format=\"ascii\">\n"
+		"%d\n"
+		"</DataArray>\n"
+		"</FieldData>\n"
+		"<Piece NumberOfPoints=\"%lld\" NumberOfVerts=\"0\" NumberOfLines=\"0\" NumberOfStrips=\"0\" NumberOfCells=\"0\">\n"
+		"<Points>\n"
+		"<DataArray type=\"Float64\" Name=\"particles\" NumberOfComponents=\"3\" format=\"appended\" offset=\"0\"/>\n"
+		"</Points>\n"
+		"</Piece>\n"
+		"</PolyData>\n"
+		"<AppendedData encoding=\"raw\">\n"
+		"_", byte_order(), t, iters, num_total);
+	const char * footer = "\n</AppendedData>\n</VTKFile>\n";
+
+	// the appended data is the size of the array in bytes, followed by the points
+	unsigned long long data_size = num_total * 3 * sizeof(double);
+	MPI_Offset data_start = header_size + sizeof(data_size);
+
+	MPI_File fh;
+	if (MPI_File_open(cart_comm, filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+		if (rank == 0) fprintf(stderr, "Error: could not open %s for writing\n", filename);
+		return -1;
+	}
+	MPI_File_set_size(fh, 0);
+
+	double * points = malloc(sizeof(double) * 3 * (num_local > 0 ? num_local : 1));
+	double * point = points;
+	for (int i = 1; i < sizei+1; i++) {
+		for (int j = 1; j < sizej+1; j++) {
+			for (int k = 0; k < cells[i][j].count; k++) {
+				int p = cells[i][j].offset + k;
+				point[0] = ((starti+i-1) * cell_size) + particles.x[p];
+				point[1] = ((startj+j-1) * cell_size) + particles.y[p];
+				point[2] = 0.0;
+				point += 3;
+			}
+		}
+	}
+
+	if (rank == 0) {
+		MPI_File_write_at(fh, 0, header, header_size, MPI_CHAR, MPI_STATUS_IGNORE);
+		MPI_File_write_at(fh, header_size, &data_size, sizeof(data_size), MPI_BYTE, MPI_STATUS_IGNORE);
+		MPI_File_write_at(fh, data_start + data_size, footer, strlen(footer), MPI_CHAR, MPI_STATUS_IGNORE);
+	}
+	MPI_File_write_at_all(fh, data_start + (num_before * 3 * sizeof(double)), points, 3 * num_local, MPI_DOUBLE, MPI_STATUS_IGNORE);
+
+	MPI_File_close(&fh);
+	free(points);
+	return 0;
+}
+
+/**
+ * @brief Write out the mesh VTK file (i.e. a .vti file). This mesh can be plotted
+ *        alongside the particle data to show the data grid as an overlay.
+ * 
+ * @return int Return whether the write was successful
+ */
+int write_mesh() {
+	FILE * f = fopen(mesh_filename, "w");
+    if (f == NULL) {
+        perror("Error");
+        return -1;
+    }
+
+	fprintf(f, "<?xml version=\"1.0\"?>\n");
+	fprintf(f, "<VTKFile type=\"ImageData\" version=\"0.1\" byte_order=\"LittleEndian\">\n");
+	fprintf(f, "<ImageData WholeExtent=\"0 %d 0 %d 0 0\" Origin=\"0 0 0\" Spacing=\"%lf %lf 0\">\n", x, y, cell_size, cell_size);
+	fprintf(f, "<Piece Extent=\"0 %d 0 %d 0 0\">\n", x, y);
+	fprintf(f, "<CellData></CellData>\n");
+	fprintf(f, "<PointData></PointData>\n");
+	fprintf(f, "<Points></Points>\n");
+	fprintf(f, "</Piece>\n");
+	fprintf(f, "</ImageData>\n");
+	fprintf(f, "</VTKFile>\n");
+
+	fclose(f);
+	return 0;
+}
@@ -3,15 +3,29 @@
 #include <math.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <string.h>
 
 #include "args.h"
+#include "boundary.h"
+#include "diagnostics.h"
 #include "data.h"
+#include "decomp.h"
+#include "restart.h"
+#include "setup.h"
 #include "vtk.h"
 
 int verbose = 0;
 int no_output = 0;
 int output_freq = 100;
 int enable_checkpoints = 0;
+int lb_freq = 0;
+double lb_threshold = 0.1;
+int halo_mode = HALO_PERSISTENT;
+int reduce_mode = REDUCE_ALL;
+int decomp_mode = DECOMP_PLAN;
+int progress_mode = PROGRESS_OFF;
+int newton = 0;
+int timings = 0;
 
 static struct option long_options[] = {
 	{"cellx",         required_argument, 0, 'x'},
@@ -27,11 +41,23 @@ static struct option long_options[] = {
 	{"noio",          no_argument,       0, 'n'},
 	{"output",        required_argument, 0, 'o'},
 	{"checkpoint",    no_argument,       0, 'c'},	
+	{"cell-capacity", required_argument, 0, 'k'},
+	{"lb-freq",       required_argument, 0, 'b'},
+	{"lb-threshold",  required_argument, 0, 'B'},
+	{"halo",          required_argument, 0, 'H'},
+	{"reduce",        required_argument, 0, 'R'},
+	{"decomp",        required_argument, 0, 'D'},
+	{"progress",      required_argument, 0, 'P'},
+	{"newton",        no_argument,       0, 'N'},
+	{"timings",       no_argument,       0, 'T'},
+	{"ghost-depth",   required_argument, 0, 'g'},
+	{"ghost-interval", required_argument, 0, 'G'},
+	{"restart",       required_argument, 0, 'l'},
     {"verbose",       no_argument,       0, 'v'},
     {"help",          no_argument,       0, 'h'},
 	{0, 0, 0, 0}
 };
-#define GETOPTS "x:y:p:s:r:t:i:d:f:e:no:cvh"
+#define GETOPTS "x:y:p:s:r:t:i:d:f:e:no:ck:b:B:H:R:D:P:NTg:G:l:vh"
 
 /**
  * @brief Print a help message
@@ -55,6 +81,26 @@ void print_help(char *progname) {
 	fprintf(stderr, "  -n, --noio              Disable file I/O\n");
 	fprintf(stderr, "  -o FILE, --output=FILE  Set base filename for particle output (final output will be in BASENAME.vtp)\n");
 	fprintf(stderr, "  -c, --checkpoint        Enable checkpointing, checkpoints will be in BASENAME-ITERATION.vtp\n");
+	fprintf(stderr, "                          (with restart files in BASENAME-ITERATION.rst and BASENAME.rst)\n");
+	fprintf(stderr, "  -k N, --cell-capacity=N Set the maximum number of particles per cell (default 4 * parts-per-dim^2)\n");
+	fprintf(stderr, "  -b N, --lb-freq=N       Check the load balance every N steps (0 disables load balancing)\n");
+	fprintf(stderr, "  -B T, --lb-threshold=T  Rebalance when the force time imbalance (max / mean - 1) exceeds T\n");
+	fprintf(stderr, "  -H MODE, --halo=MODE    Set the halo exchange: persistent (default, zero-copy), sendrecv (packed),\n");
+	fprintf(stderr, "                          shm (on-node neighbours read each other's cells from shared memory)\n");
+	fprintf(stderr, "                          neighbourhood (MPI_Neighbor_alltoallv over all 8 neighbours)\n");
+	fprintf(stderr, "                          rma (one-sided MPI_Get with post-start-complete-wait sync)\n");
+	fprintf(stderr, "                          or compressed (packed, with positions as 32-bit fractions of the cell size)\n");
+	fprintf(stderr, "  -R MODE, --reduce=MODE  Reduce the output diagnostics to all ranks (all, default) or to rank 0 only (root)\n");
+	fprintf(stderr, "  -D MODE, --decomp=MODE  Shape the rank grid to minimise the ghost region per rank and between nodes\n");
+	fprintf(stderr, "                          (plan, default), or as squarely as possible with MPI_Dims_create (mpi)\n");
+	fprintf(stderr, "  -P MODE, --progress=MODE Overlap the halo exchange with the interior forces, keeping it moving with\n");
+	fprintf(stderr, "                          MPI_Testall between rows (test) or a helper thread (thread), or don't (off, default)\n");
+	fprintf(stderr, "  -N, --newton            Evaluate every pair once (half-shell), sending the ghost forces back to their owners\n");
+	fprintf(stderr, "  -g N, --ghost-depth=N   Set the number of layers of ghost cells (default: enough for the interval)\n");
+	fprintf(stderr, "  -G N, --ghost-interval=N Refill the ghost cells every N steps, integrating them locally in between\n");
+	fprintf(stderr, "                          (deeper ghost regions need --halo=sendrecv)\n");
+	fprintf(stderr, "  -l FILE, --restart=FILE Resume from a restart file (written on any number of ranks), up to --endtime\n");
+	fprintf(stderr, "  -T, --timings           Print the time spent in each phase of the step (on one line, for scripts)\n");
 	fprintf(stderr, "  -v, --verbose           Set verbose output\n");
 	fprintf(stderr, "  -h, --help              Print this message and exit\n");
 	fprintf(stderr, "\n");
@@ -112,6 +158,84 @@ void parse_args(int argc, char *argv[]) {
 			case 'c':
 				enable_checkpoints = 1;
 				break;
+			case 'k':
+				cell_capacity = atoi(optarg);
+				break;
+			case 'b':
+				lb_freq = atoi(optarg);
+				break;
+			case 'B':
+				lb_threshold = atof(optarg);
+				break;
+			case 'R':
+				if (strcmp(optarg, "all") == 0) {
+					reduce_mode = REDUCE_ALL;
+				} else if (strcmp(optarg, "root") == 0) {
+					reduce_mode = REDUCE_ROOT;
+				} else {
+					fprintf(stderr, "Error: Unknown reduction mode '%s'.\n", optarg);
+					print_help(argv[0]);
+					exit(1);
+				}
+				break;
+			case 'H':
+				if (strcmp(optarg, "persistent") == 0) {
+					halo_mode = HALO_PERSISTENT;
+				} else if (strcmp(optarg, "sendrecv") == 0) {
+					halo_mode = HALO_SENDRECV;
+				} else if (strcmp(optarg, "shm") == 0) {
+					halo_mode = HALO_SHM;
+				} else if (strcmp(optarg, "neighbourhood") == 0) {
+					halo_mode = HALO_NEIGHBOURHOOD;
+				} else if (strcmp(optarg, "rma") == 0) {
+					halo_mode = HALO_RMA;
+				} else if (strcmp(optarg, "compressed") == 0) {
+					halo_mode = HALO_COMPRESSED;
+				} else {
+					fprintf(stderr, "Error: Unknown halo exchange '%s'.\n", optarg);
+					print_help(argv[0]);
+					exit(1);
+				}
+				break;
+			case 'D':
+				if (strcmp(optarg, "plan") == 0) {
+					decomp_mode = DECOMP_PLAN;
+				} else if (strcmp(optarg, "mpi") == 0) {
+					decomp_mode = DECOMP_MPI;
+				} else {
+					fprintf(stderr, "Error: Unknown decomposition '%s'.\n", optarg);
+					print_help(argv[0]);
+					exit(1);
+				}
+				break;
+			case 'P':
+				if (strcmp(optarg, "off") == 0) {
+					progress_mode = PROGRESS_OFF;
+				} else if (strcmp(optarg, "test") == 0) {
+					progress_mode = PROGRESS_TEST;
+				} else if (strcmp(optarg, "thread") == 0) {
+					progress_mode = PROGRESS_THREAD;
+				} else {
+					fprintf(stderr, "Error: Unknown progress mode '%s'.\n", optarg);
+					print_help(argv[0]);
+					exit(1);
+				}
+				break;
+			case 'N':
+				newton = 1;
+				break;
+			case 'T':
+				timings = 1;
+				break;
+			case 'g':
+				ghost_depth = atoi(optarg);
+				break;
+			case 'G':
+				ghost_interval = atoi(optarg);
+				break;
+			case 'l':
+				strncpy(restart_file, optarg, sizeof(restart_file) - 1);
+				break;
 			case 'v':
 				verbose = 1;
 				break;
@@ -122,11 +246,51 @@ void parse_args(int argc, char *argv[]) {
         }
     }
 
-	if (r_cut_off > cell_size) {
-		fprintf(stderr, "Error: The cell size must be greater than or equal to the cut off distance.\n");
+	// forces are only exact one cut off further in from the edge of the ghost region every step,
+	// and the particles drift further in as well
+	if (ghost_interval < 1) {
+		fprintf(stderr, "Error: The ghost interval must be at least 1.\n");
 		print_help(argv[0]);
 		exit(1);
 	}
+	if ((ghost_depth > 1 || ghost_interval > 1) && halo_mode != HALO_SENDRECV) {
+		fprintf(stderr, "Error: Ghost regions deeper than one cell are only supported with --halo=sendrecv.\n");
+		print_help(argv[0]);
+		exit(1);
+	}
+	if (newton && (ghost_depth > 1 || ghost_interval > 1 || progress_mode != PROGRESS_OFF)) {
+		fprintf(stderr, "Error: --newton needs a one cell deep ghost region, and can't be used with --progress.\n");
+		print_help(argv[0]);
+		exit(1);
+	}
+	if (progress_mode != PROGRESS_OFF && halo_mode != HALO_PERSISTENT) {
+		fprintf(stderr, "Error: Overlapping the halo exchange is only supported with --halo=persistent.\n");
+		print_help(argv[0]);
+		exit(1);
+	}
+}
+
+/**
+ * @brief Get the command line name of a halo exchange mode
+ * 
+ * @param mode The halo exchange mode
+ * @return const char* The name of the mode
+ */
+const char * halo_mode_name(int mode) {
+	switch (mode) {
+		case HALO_SENDRECV:
+			return "sendrecv";
+		case HALO_SHM:
+			return "shm";
+		case HALO_NEIGHBOURHOOD:
+			return "neighbourhood";
+		case HALO_RMA:
+			return "rma";
+		case HALO_COMPRESSED:
+			return "compressed";
+		default:
+			return "persistent";
+	}
 }
 
 /**
@@ -148,5 +312,20 @@ void print_opts() {
 	printf("  noio             = %14d\n", no_output);
 	printf("  output           = %s\n", get_basename());
 	printf("  checkpoint       = %14d\n", enable_checkpoints);	
+	printf("  cell-capacity    = %14d\n", cell_capacity);
+	printf("  lb-freq          = %14d\n", lb_freq);
+	printf("  lb-threshold     = %14lf\n", lb_threshold);
+	printf("  halo             = %14s\n", halo_mode_name(halo_mode));
+	printf("  reduce           = %14s\n", reduce_mode == REDUCE_ROOT ? "root" : "all");
+	printf("  decomp           = %14s\n", decomp_mode == DECOMP_MPI ? "mpi" : "plan");
+	char rank_grid[32];
+	snprintf(rank_grid, sizeof(rank_grid), "%d x %d", dims[0], dims[1]);
+	printf("  ranks            = %14s\n", rank_grid);
+	printf("  progress         = %14s\n", progress_mode == PROGRESS_THREAD ? "thread" : (progress_mode == PROGRESS_TEST ? "test" : "off"));
+	printf("  newton           = %14d\n", newton);
+	printf("  timings          = %14d\n", timings);
+	printf("  ghost-depth      = %14d\n", ghost_depth);
+	printf("  ghost-interval   = %14d\n", ghost_interval);
+	printf("  restart          = %s\n", restart_file);
     printf("=======================================\n");
 }
\ No newline at end of file
@@ -6,8 +6,17 @@ extern int no_output;
 extern int output_freq;
 extern int enable_checkpoints;
 extern int fixed_dt;
+extern int lb_freq;
+extern double lb_threshold;
+extern int halo_mode;
+extern int reduce_mode;
+extern int decomp_mode;
+extern int progress_mode;
+extern int newton;
+extern int timings;
 
 void parse_args(int argc, char *argv[]);
 void print_opts();
+const char * halo_mode_name(int mode);
 
 #endif
\ No newline at end of file
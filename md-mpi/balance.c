@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "args.h"
+#include "balance.h"
+#include "boundary.h"
+#include "data.h"
+
+// number of doubles used to send one particle when cells change owner (global cell
+// coordinates, position, velocity, acceleration and global id)
+#define CELL_MOVE_DOUBLES 9
+
+// force computation time accumulated since the last rebalance check
+static double force_time = 0.0;
+
+/**
+ * @brief Add the time spent in comp_accel() to the current load balancing window
+ *
+ * @param t The time taken by one call to comp_accel()
+ */
+void record_force_time(double t) {
+	force_time += t;
+}
+
+/**
+ * @brief Split a 1D cost profile into parts of (roughly) equal cost. Every part is
+ *        given at least ghost_depth cells, so the neighbours' ghost regions still fit.
+ *
+ * @param cost The cost of each of the n cells
+ * @param n The number of cells
+ * @param parts The number of parts
+ * @param bounds The first cell of every part (parts+1 entries, updated in place)
+ */
+static void partition_profile(double * cost, int n, int parts, int * bounds) {
+	double total = 0.0;
+	for (int c = 0; c < n; c++) {
+		total += cost[c];
+	}
+	if (total <= 0.0) {
+		return;
+	}
+
+	bounds[0] = 0;
+	bounds[parts] = n;
+
+	double prefix = 0.0;
+	int c = 0;
+	for (int k = 1; k < parts; k++) {
+		double target = (total * k) / parts;
+		// advance while including the next cell gets us closer to the target
+		while (c < n && fabs(prefix + cost[c] - target) < fabs(prefix - target)) {
+			prefix += cost[c];
+			c++;
+		}
+		int lo = bounds[k-1] + ghost_depth;
+		int hi = n - ((parts - k) * ghost_depth);
+		int b = c < lo ? lo : (c > hi ? hi : c);
+		while (c < b) {
+			prefix += cost[c];
+			c++;
+		}
+		while (c > b) {
+			c--;
+			prefix -= cost[c];
+		}
+		bounds[k] = b;
+	}
+}
+
+/**
+ * @brief Give every cell to the rank that owns it under the new boundaries. Whole cells
+ *        are packed up with their particles and exchanged with an all-to-all, then the
+ *        local cell grid is reallocated for the new subdomain.
+ *
+ * @param new_bounds_x The new first global cell of every rank column
+ * @param new_bounds_y The new first global cell of every rank row
+ */
+static void migrate_cells(int * new_bounds_x, int * new_bounds_y) {
+	// the rank column (row) that will own every global column (row)
+	int * owner_x = malloc(sizeof(int) * x);
+	int * owner_y = malloc(sizeof(int) * y);
+	for (int c = 0; c < dims[0]; c++) {
+		for (int gi = new_bounds_x[c]; gi < new_bounds_x[c+1]; gi++) owner_x[gi] = c;
+	}
+	for (int c = 0; c < dims[1]; c++) {
+		for (int gj = new_bounds_y[c]; gj < new_bounds_y[c+1]; gj++) owner_y[gj] = c;
+	}
+
+	int * send_counts = calloc(size, sizeof(int));
+	int * recv_counts = malloc(sizeof(int) * size);
+	int * send_displs = malloc(sizeof(int) * size);
+	int * recv_displs = malloc(sizeof(int) * size);
+	int * cell_dest = malloc(sizeof(int) * sizei * sizej);
+
+	for (int i = 1; i < sizei+1; i++) {
+		for (int j = 1; j < sizej+1; j++) {
+			int dest_coords[2] = {owner_x[starti+i-1], owner_y[startj+j-1]};
+			int dest;
+			MPI_Cart_rank(cart_comm, dest_coords, &dest);
+			cell_dest[((i-1)*sizej) + (j-1)] = dest;
+			send_counts[dest] += cells[i][j].count * CELL_MOVE_DOUBLES;
+		}
+	}
+
+	MPI_Alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT, cart_comm);
+
+	int send_total = 0, recv_total = 0;
+	for (int r = 0; r < size; r++) {
+		send_displs[r] = send_total;
+		recv_displs[r] = recv_total;
+		send_total += send_counts[r];
+		recv_total += recv_counts[r];
+	}
+
+	double * send_buf = malloc(sizeof(double) * (send_total > 0 ? send_total : 1));
+	double * recv_buf = malloc(sizeof(double) * (recv_total > 0 ? recv_total : 1));
+	int * fill = malloc(sizeof(int) * size);
+	memcpy(fill, send_displs, sizeof(int) * size);
+
+	for (int i = 1; i < sizei+1; i++) {
+		for (int j = 1; j < sizej+1; j++) {
+			int dest = cell_dest[((i-1)*sizej) + (j-1)];
+			for (int k = 0; k < cells[i][j].count; k++) {
+				int p = cells[i][j].offset + k;
+				double * b = send_buf + fill[dest];
+				b[0] = starti + i - 1;
+				b[1] = startj + j - 1;
+				b[2] = particles.x[p];
+				b[3] = particles.y[p];
+				b[4] = particles.vx[p];
+				b[5] = particles.vy[p];
+				b[6] = particles.ax[p];
+				b[7] = particles.ay[p];
+				b[8] = particles.id[p];
+				fill[dest] += CELL_MOVE_DOUBLES;
+			}
+		}
+	}
+
+	MPI_Alltoallv(send_buf, send_counts, send_displs, MPI_DOUBLE,
+				  recv_buf, recv_counts, recv_displs, MPI_DOUBLE, cart_comm);
+
+	// rebuild the local grid (and the halo requests that point into it) for the new subdomain
+	free_halo();
+	free_cells();
+	memcpy(bounds_x, new_bounds_x, sizeof(int) * (dims[0]+1));
+	memcpy(bounds_y, new_bounds_y, sizeof(int) * (dims[1]+1));
+	starti = bounds_x[coords[0]];
+	sizei = bounds_x[coords[0]+1] - starti;
+	startj = bounds_y[coords[1]];
+	sizej = bounds_y[coords[1]+1] - startj;
+	alloc_cells();
+	setup_halo();
+
+	for (int m = 0; m < recv_total; m += CELL_MOVE_DOUBLES) {
+		double * b = recv_buf + m;
+		int i = (int) b[0] - starti + 1;
+		int j = (int) b[1] - startj + 1;
+		add_particle(&(cells[i][j]), b[2], b[3], b[4], b[5], b[6], b[7], (int) b[8]);
+	}
+
+	free(owner_x);
+	free(owner_y);
+	free(send_counts);
+	free(recv_counts);
+	free(send_displs);
+	free(recv_displs);
+	free(cell_dest);
+	free(send_buf);
+	free(recv_buf);
+	free(fill);
+}
+
+/**
+ * @brief Rebalance the decomposition every lb_freq steps if the force computation time
+ *        is unbalanced by more than lb_threshold (as max / mean - 1). The measured time of
+ *        each rank is spread over its cells in proportion to an estimate of their pair work,
+ *        summed into a cost profile per global column and row, and the boundaries along
+ *        each dimension of the Cartesian grid are moved so every rank column (row) gets an
+ *        equal share of the cost. This must be called with the ghost layer filled.
+ *
+ * @param iters The current iteration
+ */
+void load_balance(int iters) {
+	if (lb_freq <= 0 || iters == 0 || (iters % lb_freq) != 0 || size == 1) {
+		return;
+	}
+
+	double max_time, sum_time;
+	MPI_Allreduce(&force_time, &max_time, 1, MPI_DOUBLE, MPI_MAX, cart_comm);
+	MPI_Allreduce(&force_time, &sum_time, 1, MPI_DOUBLE, MPI_SUM, cart_comm);
+
+	double imbalance = (sum_time > 0.0) ? (max_time * size / sum_time) - 1.0 : 0.0;
+	if (imbalance <= lb_threshold) {
+		force_time = 0.0;
+		return;
+	}
+
+	// estimate the work of each cell as its number of candidate pairs (plus a per particle cost)
+	double cell_work_total = 0.0;
+	double * profile = calloc(x + y, sizeof(double));
+	double * work = malloc(sizeof(double) * sizei * sizej);
+	for (int i = 1; i < sizei+1; i++) {
+		for (int j = 1; j < sizej+1; j++) {
+			int neighbours = 0;
+			for (int a = -1; a <= 1; a++) {
+				for (int b = -1; b <= 1; b++) {
+					neighbours += cells[i+a][j+b].count;
+				}
+			}
+			work[((i-1)*sizej) + (j-1)] = (double) cells[i][j].count * (neighbours + 1);
+			cell_work_total += work[((i-1)*sizej) + (j-1)];
+		}
+	}
+
+	// spread the measured time over the cells, then sum into the column and row profiles
+	double scale = (cell_work_total > 0.0) ? force_time / cell_work_total : 0.0;
+	for (int i = 1; i < sizei+1; i++) {
+		for (int j = 1; j < sizej+1; j++) {
+			double cost = work[((i-1)*sizej) + (j-1)] * scale;
+			profile[starti+i-1] += cost;
+			profile[x + startj+j-1] += cost;
+		}
+	}
+	MPI_Allreduce(MPI_IN_PLACE, profile, x + y, MPI_DOUBLE, MPI_SUM, cart_comm);
+
+	int * new_bounds_x = malloc(sizeof(int) * (dims[0]+1));
+	int * new_bounds_y = malloc(sizeof(int) * (dims[1]+1));
+	memcpy(new_bounds_x, bounds_x, sizeof(int) * (dims[0]+1));
+	memcpy(new_bounds_y, bounds_y, sizeof(int) * (dims[1]+1));
+	partition_profile(profile, x, dims[0], new_bounds_x);
+	partition_profile(profile + x, y, dims[1], new_bounds_y);
+
+	if (memcmp(new_bounds_x, bounds_x, sizeof(int) * (dims[0]+1)) != 0 ||
+		memcmp(new_bounds_y, bounds_y, sizeof(int) * (dims[1]+1)) != 0) {
+		migrate_cells(new_bounds_x, new_bounds_y);
+		if (rank == 0 && verbose) {
+			printf("Step %8d, rebalanced (force time imbalance %6.2f%%)\n", iters, imbalance * 100.0);
+		}
+	}
+
+	free(profile);
+	free(work);
+	free(new_bounds_x);
+	free(new_bounds_y);
+	force_time = 0.0;
+}
@@ -1,90 +1,1361 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
+#include "args.h"
 #include "boundary.h"
 #include "data.h"
 
+// number of doubles used to send one migrating particle (position, velocity,
+// acceleration, global id and the index of its cell along the shared edge)
+#define MIGRATE_DOUBLES 8
+
+// number of doubles used to send one particle of a deep ghost region (position, velocity,
+// acceleration and global id)
+#define GHOST_DOUBLES 7
+
+// with --halo=compressed, ghost positions are sent as 32-bit fractions of the cell size
+#define HALO_FIXED_SCALE 4294967296.0
+
+static double * send_buf_lo, * send_buf_hi, * recv_buf_lo, * recv_buf_hi;
+static int send_size_lo, send_size_hi, recv_size_lo, recv_size_hi;
+
+// persistent halo requests for the x phase and the y phase
+static MPI_Request halo_requests[2][4];
+static int num_halo_requests[2];
+static int halo_ready = 0;
+
+// the phase of the persistent exchange in flight (2 once it has finished), and the helper
+// thread that keeps it moving with --progress=thread. The helper is started once, and is
+// woken up (under progress_lock) for each exchange.
+static int halo_phase = 2;
+static pthread_t progress_helper;
+static int progress_started = 0;
+static atomic_int progress_stop;
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress_cond = PTHREAD_COND_INITIALIZER;
+static int progress_active = 0, progress_exit = 0;
+static void * progress_thread(void * arg);
+
+// time from starting the exchange to it finishing, and time spent waiting for it (summed over steps)
+static double halo_start = 0.0, halo_done = 0.0;
+static double halo_flight = 0.0, halo_exposed = 0.0;
+
+// bytes sent by the halo exchange (and the number of exchanges), and the bytes sent by the
+// persistent requests each time they are started
+static double halo_bytes = 0.0;
+static int halo_exchanges = 0;
+static int persistent_bytes = 0;
+
+// the 8 neighbours used by the neighbourhood collectives (west, east, south, north, then the diagonals)
+#define NUM_NEIGHBOURS 8
+static const int directions[NUM_NEIGHBOURS][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}, {-1, -1}, {1, -1}, {-1, 1}, {1, 1}};
+static MPI_Comm graph_comm = MPI_COMM_NULL;
+static int nb_send_counts[NUM_NEIGHBOURS], nb_recv_counts[NUM_NEIGHBOURS];
+static int nb_send_displs[NUM_NEIGHBOURS], nb_recv_displs[NUM_NEIGHBOURS];
+
+// a neighbour on the same node, whose cells are read directly from the shared window
+struct shared_neighbour {
+	int on_node;
+	int sizei, sizej;
+	double * x, * y;
+	struct cell_list * cells;
+};
+static struct shared_neighbour shared_west, shared_east, shared_south, shared_north;
+
+// a one-sided get of a line of ghost cells from a neighbour's window, for the x phase
+// (west, east) or the y phase (south, north) of the exchange
+struct rma_get {
+	int target;
+	MPI_Datatype origin_type, target_type;
+};
+static struct rma_get rma_gets[2][2];
+static MPI_Group rma_groups[2];
+
+// steps since the ghost region was last filled, and how far its particles have drifted since
+static int ghost_steps = 0;
+static double ghost_drift = 0.0;
+
+/**
+ * @brief Make sure a communication buffer can hold at least n doubles
+ *
+ * @param buf The buffer to grow
+ * @param buf_size The current size of the buffer (updated on growth)
+ * @param n The number of doubles required
+ */
+static void reserve_buffer(double ** buf, int * buf_size, int n) {
+	if (n > *buf_size) {
+		*buf_size = n;
+		free(*buf);
+		*buf = malloc(sizeof(double) * n);
+	}
+}
+
+/**
+ * @brief Pack the counts and positions of a line of cells into a buffer. The
+ *        counts come first, followed by the x/y pairs of every particle.
+ *
+ * @param buf The buffer to pack into
+ * @param i0 The i index of the first cell
+ * @param j0 The j index of the first cell
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param n The number of cells
+ * @return int The number of doubles packed
+ */
+static int pack_halo(double * buf, int i0, int j0, int di, int dj, int n) {
+	int pos = n;
+	for (int c = 0; c < n; c++) {
+		struct cell_list * cell = &cells[i0 + c*di][j0 + c*dj];
+		buf[c] = cell->count;
+		for (int k = 0; k < cell->count; k++) {
+			buf[pos++] = particles.x[cell->offset + k];
+			buf[pos++] = particles.y[cell->offset + k];
+		}
+	}
+	return pos;
+}
+
+/**
+ * @brief Unpack a buffer produced by pack_halo into a line of ghost cells
+ *
+ * @param buf The buffer to unpack
+ * @param i0 The i index of the first cell
+ * @param j0 The j index of the first cell
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param n The number of cells
+ */
+static void unpack_halo(double * buf, int i0, int j0, int di, int dj, int n) {
+	int pos = n;
+	for (int c = 0; c < n; c++) {
+		struct cell_list * cell = &cells[i0 + c*di][j0 + c*dj];
+		cell->count = (int) buf[c];
+		for (int k = 0; k < cell->count; k++) {
+			particles.x[cell->offset + k] = buf[pos++];
+			particles.y[cell->offset + k] = buf[pos++];
+		}
+	}
+}
+
+/**
+ * @brief Quantise a position within a cell to a 32-bit fraction of the cell size
+ *
+ * @param v The position (0 <= v < cell_size)
+ * @return uint32_t The fixed point position
+ */
+static uint32_t quantise(double v) {
+	double q = v * (HALO_FIXED_SCALE / cell_size);
+	if (q <= 0.0) {
+		return 0;
+	}
+	if (q >= HALO_FIXED_SCALE) {
+		return UINT32_MAX;
+	}
+	return (uint32_t) q;
+}
+
+/**
+ * @brief Turn a quantised position back into a position within the cell (the middle of
+ *        its quantisation interval, so the error is at most cell_size / 2^33)
+ *
+ * @param q The fixed point position
+ * @return double The position
+ */
+static double dequantise(uint32_t q) {
+	return (q + 0.5) * (cell_size / HALO_FIXED_SCALE);
+}
+
+/**
+ * @brief Pack the counts and quantised positions of a line of cells into a buffer, in
+ *        the same layout as pack_halo (--halo=compressed)
+ *
+ * @param buf The buffer to pack into
+ * @param i0 The i index of the first cell
+ * @param j0 The j index of the first cell
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param n The number of cells
+ * @return int The number of words packed
+ */
+static int pack_halo_fixed(uint32_t * buf, int i0, int j0, int di, int dj, int n) {
+	int pos = n;
+	for (int c = 0; c < n; c++) {
+		struct cell_list * cell = &cells[i0 + c*di][j0 + c*dj];
+		buf[c] = cell->count;
+		for (int k = 0; k < cell->count; k++) {
+			buf[pos++] = quantise(particles.x[cell->offset + k]);
+			buf[pos++] = quantise(particles.y[cell->offset + k]);
+		}
+	}
+	return pos;
+}
+
+/**
+ * @brief Unpack a buffer produced by pack_halo_fixed into a line of ghost cells
+ *
+ * @param buf The buffer to unpack
+ * @param i0 The i index of the first cell
+ * @param j0 The j index of the first cell
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param n The number of cells
+ */
+static void unpack_halo_fixed(uint32_t * buf, int i0, int j0, int di, int dj, int n) {
+	int pos = n;
+	for (int c = 0; c < n; c++) {
+		struct cell_list * cell = &cells[i0 + c*di][j0 + c*dj];
+		cell->count = (int) buf[c];
+		for (int k = 0; k < cell->count; k++) {
+			particles.x[cell->offset + k] = dequantise(buf[pos++]);
+			particles.y[cell->offset + k] = dequantise(buf[pos++]);
+		}
+	}
+}
+
+/**
+ * @brief Count the particles in a line of cells
+ *
+ * @param i0 The i index of the first cell
+ * @param j0 The j index of the first cell
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param n The number of cells
+ * @return int The number of particles
+ */
+static int count_line(int i0, int j0, int di, int dj, int n) {
+	int num = 0;
+	for (int c = 0; c < n; c++) {
+		num += cells[i0 + c*di][j0 + c*dj].count;
+	}
+	return num;
+}
+
+/**
+ * @brief Pack every particle in a line of ghost cells for migration and empty the cells
+ *
+ * @param buf The buffer to pack into (must hold count_line() * MIGRATE_DOUBLES doubles)
+ * @param i0 The i index of the first cell
+ * @param j0 The j index of the first cell
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param n The number of cells
+ * @return int The number of particles packed
+ */
+static int pack_migrants(double * buf, int i0, int j0, int di, int dj, int n) {
+	double * b = buf;
+	for (int c = 0; c < n; c++) {
+		struct cell_list * cell = &cells[i0 + c*di][j0 + c*dj];
+		for (int k = 0; k < cell->count; k++) {
+			int p = cell->offset + k;
+			b[0] = particles.x[p];
+			b[1] = particles.y[p];
+			b[2] = particles.vx[p];
+			b[3] = particles.vy[p];
+			b[4] = particles.ax[p];
+			b[5] = particles.ay[p];
+			b[6] = particles.id[p];
+			b[7] = c;
+			b += MIGRATE_DOUBLES;
+		}
+		cell->count = 0;
+	}
+	return (b - buf) / MIGRATE_DOUBLES;
+}
+
+/**
+ * @brief Add received migrants to a line of cells
+ *
+ * @param buf The received particles
+ * @param num The number of particles
+ * @param i0 The i index of the first cell
+ * @param j0 The j index of the first cell
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ */
+static void unpack_migrants(double * buf, int num, int i0, int j0, int di, int dj) {
+	for (int m = 0; m < num; m++) {
+		double * b = buf + (m * MIGRATE_DOUBLES);
+		int c = (int) b[7];
+		add_particle(&(cells[i0 + c*di][j0 + c*dj]), b[0], b[1], b[2], b[3], b[4], b[5], (int) b[6]);
+	}
+}
+
+/**
+ * @brief Exchange a line of halo cells in both directions of one dimension
+ *
+ * @param lo_rank The neighbour in the negative direction
+ * @param hi_rank The neighbour in the positive direction
+ * @param n The number of cells in the line
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param send_lo The first cell to send to lo_rank (as i, j)
+ * @param send_hi The first cell to send to hi_rank (as i, j)
+ * @param recv_lo The first ghost cell to fill from lo_rank (as i, j)
+ * @param recv_hi The first ghost cell to fill from hi_rank (as i, j)
+ */
+static void exchange_halo_line(int lo_rank, int hi_rank, int n, int di, int dj,
+							   int send_lo[2], int send_hi[2], int recv_lo[2], int recv_hi[2]) {
+	int max_size = n + (2 * n * cell_capacity);
+	reserve_buffer(&send_buf_lo, &send_size_lo, max_size);
+	reserve_buffer(&send_buf_hi, &send_size_hi, max_size);
+	reserve_buffer(&recv_buf_lo, &recv_size_lo, max_size);
+	reserve_buffer(&recv_buf_hi, &recv_size_hi, max_size);
+
+	if (halo_mode == HALO_COMPRESSED) {
+		// the buffers hold max_size doubles, so they have room for max_size words
+		int n_hi = pack_halo_fixed((uint32_t *) send_buf_hi, send_hi[0], send_hi[1], di, dj, n);
+		int n_lo = pack_halo_fixed((uint32_t *) send_buf_lo, send_lo[0], send_lo[1], di, dj, n);
+
+		MPI_Sendrecv(send_buf_hi, n_hi, MPI_UINT32_T, hi_rank, 1, recv_buf_lo, max_size, MPI_UINT32_T, lo_rank, 1,
+					 cart_comm, MPI_STATUS_IGNORE);
+		MPI_Sendrecv(send_buf_lo, n_lo, MPI_UINT32_T, lo_rank, 2, recv_buf_hi, max_size, MPI_UINT32_T, hi_rank, 2,
+					 cart_comm, MPI_STATUS_IGNORE);
+
+		unpack_halo_fixed((uint32_t *) recv_buf_lo, recv_lo[0], recv_lo[1], di, dj, n);
+		unpack_halo_fixed((uint32_t *) recv_buf_hi, recv_hi[0], recv_hi[1], di, dj, n);
+		halo_bytes += (double) (n_hi + n_lo) * sizeof(uint32_t);
+		return;
+	}
+
+	int n_hi = pack_halo(send_buf_hi, send_hi[0], send_hi[1], di, dj, n);
+	int n_lo = pack_halo(send_buf_lo, send_lo[0], send_lo[1], di, dj, n);
+
+	MPI_Sendrecv(send_buf_hi, n_hi, MPI_DOUBLE, hi_rank, 1, recv_buf_lo, max_size, MPI_DOUBLE, lo_rank, 1,
+				 cart_comm, MPI_STATUS_IGNORE);
+	MPI_Sendrecv(send_buf_lo, n_lo, MPI_DOUBLE, lo_rank, 2, recv_buf_hi, max_size, MPI_DOUBLE, hi_rank, 2,
+				 cart_comm, MPI_STATUS_IGNORE);
+
+	unpack_halo(recv_buf_lo, recv_lo[0], recv_lo[1], di, dj, n);
+	unpack_halo(recv_buf_hi, recv_hi[0], recv_hi[1], di, dj, n);
+	halo_bytes += (double) (n_hi + n_lo) * sizeof(double);
+}
+
+/**
+ * @brief Pack the full state of every particle in a block of cells into a buffer. The
+ *        counts of the ni x nj cells come first (i major), followed by the particles.
+ *
+ * @param buf The buffer to pack into
+ * @param block The first cell of the block (as i, j) and its size (ni, nj)
+ * @return int The number of doubles packed
+ */
+static int pack_block(double * buf, int block[4]) {
+	int pos = block[2] * block[3];
+	for (int i = 0; i < block[2]; i++) {
+		for (int j = 0; j < block[3]; j++) {
+			struct cell_list * cell = &cells[block[0] + i][block[1] + j];
+			buf[(i * block[3]) + j] = cell->count;
+			for (int k = 0; k < cell->count; k++) {
+				int p = cell->offset + k;
+				buf[pos++] = particles.x[p];
+				buf[pos++] = particles.y[p];
+				buf[pos++] = particles.vx[p];
+				buf[pos++] = particles.vy[p];
+				buf[pos++] = particles.ax[p];
+				buf[pos++] = particles.ay[p];
+				buf[pos++] = particles.id[p];
+			}
+		}
+	}
+	return pos;
+}
+
+/**
+ * @brief Unpack a buffer produced by pack_block into a block of ghost cells, replacing
+ *        whatever they held
+ *
+ * @param buf The buffer to unpack
+ * @param block The first cell of the block (as i, j) and its size (ni, nj)
+ */
+static void unpack_block(double * buf, int block[4]) {
+	int pos = block[2] * block[3];
+	for (int i = 0; i < block[2]; i++) {
+		for (int j = 0; j < block[3]; j++) {
+			struct cell_list * cell = &cells[block[0] + i][block[1] + j];
+			cell->count = (int) buf[(i * block[3]) + j];
+			for (int k = 0; k < cell->count; k++) {
+				int p = cell->offset + k;
+				particles.x[p] = buf[pos++];
+				particles.y[p] = buf[pos++];
+				particles.vx[p] = buf[pos++];
+				particles.vy[p] = buf[pos++];
+				particles.ax[p] = buf[pos++];
+				particles.ay[p] = buf[pos++];
+				particles.id[p] = (int) buf[pos++];
+			}
+		}
+	}
+}
+
+/**
+ * @brief Exchange blocks of ghost cells (with the full particle state) in both directions
+ *        of one dimension
+ *
+ * @param lo_rank The neighbour in the negative direction
+ * @param hi_rank The neighbour in the positive direction
+ * @param send_lo The block of local cells to send to lo_rank
+ * @param send_hi The block of local cells to send to hi_rank
+ * @param recv_lo The block of ghost cells to fill from lo_rank
+ * @param recv_hi The block of ghost cells to fill from hi_rank
+ */
+static void exchange_ghost_block(int lo_rank, int hi_rank, int send_lo[4], int send_hi[4], int recv_lo[4], int recv_hi[4]) {
+	int num_cells = send_lo[2] * send_lo[3];
+	int max_size = num_cells + (GHOST_DOUBLES * num_cells * cell_capacity);
+	reserve_buffer(&send_buf_lo, &send_size_lo, max_size);
+	reserve_buffer(&send_buf_hi, &send_size_hi, max_size);
+	reserve_buffer(&recv_buf_lo, &recv_size_lo, max_size);
+	reserve_buffer(&recv_buf_hi, &recv_size_hi, max_size);
+
+	int n_hi = pack_block(send_buf_hi, send_hi);
+	int n_lo = pack_block(send_buf_lo, send_lo);
+
+	MPI_Sendrecv(send_buf_hi, n_hi, MPI_DOUBLE, hi_rank, 1, recv_buf_lo, max_size, MPI_DOUBLE, lo_rank, 1,
+				 cart_comm, MPI_STATUS_IGNORE);
+	MPI_Sendrecv(send_buf_lo, n_lo, MPI_DOUBLE, lo_rank, 2, recv_buf_hi, max_size, MPI_DOUBLE, hi_rank, 2,
+				 cart_comm, MPI_STATUS_IGNORE);
+
+	unpack_block(recv_buf_lo, recv_lo);
+	unpack_block(recv_buf_hi, recv_hi);
+	halo_bytes += (double) (n_hi + n_lo) * sizeof(double);
+}
+
+/**
+ * @brief Fill all ghost_depth layers of ghost cells with the full state of the neighbours'
+ *        particles, in x first and then in y (including the x ghost cells, for the corners)
+ *
+ */
+static void fill_ghost_region() {
+	int g = ghost_depth;
+
+	// east/west: the g columns on each edge, rows 1..sizej
+	int send_w[4] = {1, 1, g, sizej}, send_e[4] = {sizei-g+1, 1, g, sizej};
+	int recv_w[4] = {1-g, 1, g, sizej}, recv_e[4] = {sizei+1, 1, g, sizej};
+	exchange_ghost_block(west_rank, east_rank, send_w, send_e, recv_w, recv_e);
+
+	// north/south: the g rows on each edge, columns 1-g..sizei+g
+	int send_s[4] = {1-g, 1, sizei+(2*g), g}, send_n[4] = {1-g, sizej-g+1, sizei+(2*g), g};
+	int recv_s[4] = {1-g, 1-g, sizei+(2*g), g}, recv_n[4] = {1-g, sizej+1, sizei+(2*g), g};
+	exchange_ghost_block(south_rank, north_rank, send_s, send_n, recv_s, recv_n);
+}
+
+/**
+ * @brief Build a datatype that describes a line of cells in place: the x and y slots of
+ *        every cell, and the cell counts. Addresses are absolute, so the type is used
+ *        with MPI_BOTTOM.
+ *
+ * @param i0 The i index of the first cell
+ * @param j0 The j index of the first cell
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param n The number of cells
+ * @return MPI_Datatype The committed datatype
+ */
+static MPI_Datatype halo_line_type(int i0, int j0, int di, int dj, int n) {
+	int cell_stride = (di * (sizej+2)) + dj;
+
+	MPI_Datatype slots, counts, line;
+	MPI_Type_vector(n, cell_capacity, cell_stride * cell_capacity, MPI_DOUBLE, &slots);
+	MPI_Type_create_hvector(n, 1, cell_stride * sizeof(struct cell_list), MPI_INT, &counts);
+
+	int block_lengths[3] = {1, 1, 1};
+	MPI_Datatype types[3] = {slots, slots, counts};
+	MPI_Aint displacements[3];
+	MPI_Get_address(&particles.x[cells[i0][j0].offset], &displacements[0]);
+	MPI_Get_address(&particles.y[cells[i0][j0].offset], &displacements[1]);
+	MPI_Get_address(&cells[i0][j0].count, &displacements[2]);
+
+	MPI_Type_create_struct(3, block_lengths, displacements, types, &line);
+	MPI_Type_commit(&line);
+
+	MPI_Type_free(&slots);
+	MPI_Type_free(&counts);
+	return line;
+}
+
+/**
+ * @brief Create a persistent send of a line of cells for one phase of the exchange
+ *
+ * @param cell The first cell to send (as i, j)
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param n The number of cells
+ * @param dest The rank to send to
+ * @param tag The message tag
+ * @param phase The phase of the exchange (0 for x, 1 for y)
+ */
+static void init_halo_send(int cell[2], int di, int dj, int n, int dest, int tag, int phase) {
+	MPI_Datatype type = halo_line_type(cell[0], cell[1], di, dj, n);
+	int bytes;
+	MPI_Type_size(type, &bytes);
+	persistent_bytes += bytes;
+	MPI_Send_init(MPI_BOTTOM, 1, type, dest, tag, cart_comm, &halo_requests[phase][num_halo_requests[phase]++]);
+	// the request keeps its own reference to the type
+	MPI_Type_free(&type);
+}
+
 /**
- * @brief Apply the boundary conditions. This effectively points the ghost cell areas
- *        to the same cell list as the opposite edge (i.e. wraps the domain).
- *        This has to be done after every cell list update, just to ensure that a destructive
- *        operations hasn't broken things.
- * 
+ * @brief Create a persistent receive into a line of ghost cells for one phase of the exchange
+ *
+ * @param cell The first ghost cell to receive into (as i, j)
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param n The number of cells
+ * @param source The rank to receive from
+ * @param tag The message tag
+ * @param phase The phase of the exchange (0 for x, 1 for y)
+ */
+static void init_halo_recv(int cell[2], int di, int dj, int n, int source, int tag, int phase) {
+	MPI_Datatype type = halo_line_type(cell[0], cell[1], di, dj, n);
+	MPI_Recv_init(MPI_BOTTOM, 1, type, source, tag, cart_comm, &halo_requests[phase][num_halo_requests[phase]++]);
+	MPI_Type_free(&type);
+}
+
+/**
+ * @brief Find a neighbour's cells in the shared window, if it is on the same node
+ *
+ * @param neighbour_rank The rank of the neighbour in cart_comm
+ * @param neighbour The neighbour to fill in
+ */
+static void query_shared_neighbour(int neighbour_rank, struct shared_neighbour * neighbour) {
+	neighbour->on_node = 0;
+	if (halo_mode != HALO_SHM) {
+		return;
+	}
+
+	MPI_Group cart_group, node_group;
+	int node_rank;
+	MPI_Comm_group(cart_comm, &cart_group);
+	MPI_Comm_group(node_comm, &node_group);
+	MPI_Group_translate_ranks(cart_group, 1, &neighbour_rank, node_group, &node_rank);
+	MPI_Group_free(&cart_group);
+	MPI_Group_free(&node_group);
+	if (node_rank == MPI_UNDEFINED) {
+		return;
+	}
+
+	MPI_Aint bytes;
+	int disp_unit;
+	char * base;
+	MPI_Win_shared_query(cells_win, node_rank, &bytes, &disp_unit, &base);
+
+	int * header = (int *) base;
+	int num_slots = (header[0]+2) * (header[1]+2) * cell_capacity;
+	neighbour->sizei = header[0];
+	neighbour->sizej = header[1];
+	neighbour->x = (double *) (base + SHARED_HEADER_BYTES);
+	neighbour->y = neighbour->x + num_slots;
+	neighbour->cells = (struct cell_list *) (neighbour->y + num_slots);
+	neighbour->on_node = 1;
+}
+
+/**
+ * @brief Copy a line of cells straight out of an on-node neighbour's shared window into
+ *        a line of ghost cells
+ *
+ * @param neighbour The neighbour to read from
+ * @param src The first cell to read, in the neighbour's grid (as i, j)
+ * @param dst The first ghost cell to fill (as i, j)
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param n The number of cells
+ */
+static void read_shared_line(struct shared_neighbour * neighbour, int src[2], int dst[2], int di, int dj, int n) {
+	for (int c = 0; c < n; c++) {
+		struct cell_list * from = &neighbour->cells[((src[0] + c*di) * (neighbour->sizej+2)) + src[1] + c*dj];
+		struct cell_list * to = &cells[dst[0] + c*di][dst[1] + c*dj];
+		to->count = from->count;
+		memcpy(&particles.x[to->offset], &neighbour->x[from->offset], sizeof(double) * from->count);
+		memcpy(&particles.y[to->offset], &neighbour->y[from->offset], sizeof(double) * from->count);
+	}
+}
+
+/**
+ * @brief Make the cell updates of every rank on the node visible to the others
+ *
+ */
+static void shared_fence() {
+	MPI_Win_sync(cells_win);
+	MPI_Barrier(node_comm);
+	MPI_Win_sync(cells_win);
+}
+
+/**
+ * @brief Build a datatype that describes a line of cells in a neighbour's RMA window: the x
+ *        and y slots of every cell, and the cell counts. Displacements are in bytes from the
+ *        start of the window, following the layout set up by alloc_cells().
+ *
+ * @param nsizei The number of local cells of the neighbour in i
+ * @param nsizej The number of local cells of the neighbour in j
+ * @param i0 The i index of the first cell, in the neighbour's grid
+ * @param j0 The j index of the first cell, in the neighbour's grid
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param n The number of cells
+ * @return MPI_Datatype The committed datatype
+ */
+static MPI_Datatype remote_line_type(int nsizei, int nsizej, int i0, int j0, int di, int dj, int n) {
+	int num_slots = (nsizei+2) * (nsizej+2) * cell_capacity;
+	int first_cell = (i0 * (nsizej+2)) + j0;
+	int cell_stride = (di * (nsizej+2)) + dj;
+
+	MPI_Datatype slots, counts, line;
+	MPI_Type_vector(n, cell_capacity, cell_stride * cell_capacity, MPI_DOUBLE, &slots);
+	MPI_Type_create_hvector(n, 1, cell_stride * sizeof(struct cell_list), MPI_INT, &counts);
+
+	int block_lengths[3] = {1, 1, 1};
+	MPI_Datatype types[3] = {slots, slots, counts};
+	MPI_Aint displacements[3];
+	displacements[0] = SHARED_HEADER_BYTES + (sizeof(double) * first_cell * cell_capacity);
+	displacements[1] = displacements[0] + (sizeof(double) * num_slots);
+	displacements[2] = SHARED_HEADER_BYTES + (2 * sizeof(double) * num_slots) + (sizeof(struct cell_list) * first_cell);
+
+	MPI_Type_create_struct(3, block_lengths, displacements, types, &line);
+	MPI_Type_commit(&line);
+
+	MPI_Type_free(&slots);
+	MPI_Type_free(&counts);
+	return line;
+}
+
+/**
+ * @brief Set up the one-sided get of a line of ghost cells from the edge cells of the
+ *        neighbour in direction (dx, dy) that face them. The neighbour's subdomain size
+ *        comes from the global bounds, so nothing needs to be exchanged.
+ *
+ * @param get The get to fill in
+ * @param target The rank of the neighbour in cart_comm
+ * @param dx The direction of the neighbour in x (-1, 0 or 1)
+ * @param dy The direction of the neighbour in y (-1, 0 or 1)
+ * @param ghost The first ghost cell to fill (as i, j)
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param n The number of cells
+ */
+static void init_rma_get(struct rma_get * get, int target, int dx, int dy, int ghost[2], int di, int dj, int n) {
+	int ci = (coords[0] + dx + dims[0]) % dims[0];
+	int cj = (coords[1] + dy + dims[1]) % dims[1];
+	int nsizei = bounds_x[ci+1] - bounds_x[ci];
+	int nsizej = bounds_y[cj+1] - bounds_y[cj];
+
+	// the neighbour's edge line, in its own grid
+	int ei = (dx < 0) ? nsizei : (dx > 0) ? 1 : ghost[0];
+	int ej = (dy < 0) ? nsizej : (dy > 0) ? 1 : ghost[1];
+
+	get->target = target;
+	get->origin_type = halo_line_type(ghost[0], ghost[1], di, dj, n);
+	get->target_type = remote_line_type(nsizei, nsizej, ei, ej, di, dj, n);
+}
+
+/**
+ * @brief Create the group of (distinct) ranks that access this rank's window in one phase
+ *
+ * @param lo_rank The neighbour in the negative direction
+ * @param hi_rank The neighbour in the positive direction
+ * @param group The group to create
+ */
+static void rma_group(int lo_rank, int hi_rank, MPI_Group * group) {
+	MPI_Group cart_group;
+	int ranks[2] = {lo_rank, hi_rank};
+	MPI_Comm_group(cart_comm, &cart_group);
+	MPI_Group_incl(cart_group, (lo_rank == hi_rank) ? 1 : 2, ranks, group);
+	MPI_Group_free(&cart_group);
+}
+
+/**
+ * @brief Run one phase of the one-sided halo exchange. Each rank exposes its window to its
+ *        two neighbours in this phase and gets their edge lines into its ghost cells, using
+ *        post-start-complete-wait synchronisation so only neighbours wait on each other.
+ *
+ * @param phase The phase of the exchange (0 for x, 1 for y)
+ */
+static void rma_halo_phase(int phase) {
+	MPI_Win_post(rma_groups[phase], MPI_MODE_NOPUT, cells_win);
+	MPI_Win_start(rma_groups[phase], 0, cells_win);
+	for (int g = 0; g < 2; g++) {
+		struct rma_get * get = &rma_gets[phase][g];
+		MPI_Get(MPI_BOTTOM, 1, get->origin_type, get->target, 0, 1, get->target_type, cells_win);
+	}
+	MPI_Win_complete(cells_win);
+	MPI_Win_wait(cells_win);
+}
+
+/**
+ * @brief Find the line of cells on one side of the subdomain: either the ghost cells in the
+ *        direction (dx, dy), or the local edge cells that face it. Corners are a single cell.
+ *
+ * @param dx The x direction (-1, 0 or 1)
+ * @param dy The y direction (-1, 0 or 1)
+ * @param ghost Whether to find the ghost cells (1) or the edge cells (0)
+ * @param line The first cell (as i, j), the step in i and j, and the number of cells
+ */
+static void side_line(int dx, int dy, int ghost, int line[5]) {
+	line[0] = (dx < 0) ? (ghost ? 0 : 1) : (dx > 0) ? (ghost ? sizei+1 : sizei) : 1;
+	line[1] = (dy < 0) ? (ghost ? 0 : 1) : (dy > 0) ? (ghost ? sizej+1 : sizej) : 1;
+	line[2] = (dx == 0) ? 1 : 0;
+	line[3] = (dy == 0) ? 1 : 0;
+	line[4] = (dx == 0) ? sizei : (dy == 0) ? sizej : 1;
+}
+
+/**
+ * @brief Create the distributed graph communicator for the neighbourhood collectives. Every
+ *        rank sends to its 8 neighbours (including the diagonals) in the order of directions[],
+ *        and receives block k from the neighbour in the opposite direction, so that block k
+ *        always carries data travelling in direction k. A neighbour can appear more than once
+ *        (e.g. with only one or two ranks in a dimension); messages between the same pair of
+ *        ranks are matched in order, which keeps the blocks lined up.
+ *
+ */
+static void setup_graph() {
+	if (graph_comm != MPI_COMM_NULL) {
+		return;
+	}
+
+	int destinations[NUM_NEIGHBOURS], sources[NUM_NEIGHBOURS], weights[NUM_NEIGHBOURS];
+	for (int d = 0; d < NUM_NEIGHBOURS; d++) {
+		weights[d] = 1;
+		int to[2] = {coords[0] + directions[d][0], coords[1] + directions[d][1]};
+		int from[2] = {coords[0] - directions[d][0], coords[1] - directions[d][1]};
+		MPI_Cart_rank(cart_comm, to, &destinations[d]);
+		MPI_Cart_rank(cart_comm, from, &sources[d]);
+	}
+
+	MPI_Dist_graph_create_adjacent(cart_comm, NUM_NEIGHBOURS, sources, weights,
+								   NUM_NEIGHBOURS, destinations, weights, MPI_INFO_NULL, 0, &graph_comm);
+}
+
+/**
+ * @brief Exchange variable sized blocks with the 8 neighbours: the block sizes are swapped
+ *        with MPI_Neighbor_alltoall, then the data with MPI_Neighbor_alltoallv.
+ *        send_counts must be filled in and the data packed in send_buf (at offsets given by
+ *        nb_send_displs); the received data is left in recv_buf at nb_recv_displs.
+ *
+ */
+static void neighbourhood_exchange() {
+	MPI_Neighbor_alltoall(nb_send_counts, 1, MPI_INT, nb_recv_counts, 1, MPI_INT, graph_comm);
+
+	int recv_total = 0;
+	for (int d = 0; d < NUM_NEIGHBOURS; d++) {
+		nb_recv_displs[d] = recv_total;
+		recv_total += nb_recv_counts[d];
+	}
+	reserve_buffer(&recv_buf_lo, &recv_size_lo, recv_total);
+
+	MPI_Neighbor_alltoallv(send_buf_lo, nb_send_counts, nb_send_displs, MPI_DOUBLE,
+						   recv_buf_lo, nb_recv_counts, nb_recv_displs, MPI_DOUBLE, graph_comm);
+}
+
+/**
+ * @brief Fill the ghost layer (including the corners) in one step with a neighbourhood
+ *        collective over the 8 neighbours, rather than two phases of point-to-point messages.
+ *
+ */
+static void neighbourhood_halo() {
+	int send_total = 0;
+	for (int d = 0; d < NUM_NEIGHBOURS; d++) {
+		int line[5];
+		side_line(directions[d][0], directions[d][1], 0, line);
+		nb_send_displs[d] = send_total;
+		send_total += line[4] + (2 * count_line(line[0], line[1], line[2], line[3], line[4]));
+	}
+	reserve_buffer(&send_buf_lo, &send_size_lo, send_total);
+
+	for (int d = 0; d < NUM_NEIGHBOURS; d++) {
+		int line[5];
+		side_line(directions[d][0], directions[d][1], 0, line);
+		nb_send_counts[d] = pack_halo(send_buf_lo + nb_send_displs[d], line[0], line[1], line[2], line[3], line[4]);
+	}
+
+	neighbourhood_exchange();
+
+	// block d travelled in direction d, so it came from the neighbour on the opposite side
+	for (int d = 0; d < NUM_NEIGHBOURS; d++) {
+		int line[5];
+		side_line(-directions[d][0], -directions[d][1], 1, line);
+		unpack_halo(recv_buf_lo + nb_recv_displs[d], line[0], line[1], line[2], line[3], line[4]);
+	}
+}
+
+/**
+ * @brief Migrate the particles in the ghost layer straight to whichever of the 8 neighbours
+ *        owns them (diagonal moves included), with a neighbourhood collective.
+ *
+ */
+static void neighbourhood_migrate() {
+	int send_total = 0;
+	for (int d = 0; d < NUM_NEIGHBOURS; d++) {
+		int line[5];
+		side_line(directions[d][0], directions[d][1], 1, line);
+		nb_send_displs[d] = send_total;
+		send_total += count_line(line[0], line[1], line[2], line[3], line[4]) * MIGRATE_DOUBLES;
+	}
+	reserve_buffer(&send_buf_lo, &send_size_lo, send_total);
+
+	for (int d = 0; d < NUM_NEIGHBOURS; d++) {
+		int line[5];
+		side_line(directions[d][0], directions[d][1], 1, line);
+		nb_send_counts[d] = pack_migrants(send_buf_lo + nb_send_displs[d], line[0], line[1], line[2], line[3], line[4]) * MIGRATE_DOUBLES;
+	}
+
+	neighbourhood_exchange();
+
+	// particles that travelled in direction d arrive on the edge facing the opposite way
+	for (int d = 0; d < NUM_NEIGHBOURS; d++) {
+		int line[5];
+		side_line(-directions[d][0], -directions[d][1], 0, line);
+		unpack_migrants(recv_buf_lo + nb_recv_displs[d], nb_recv_counts[d] / MIGRATE_DOUBLES, line[0], line[1], line[2], line[3]);
+	}
+}
+
+/**
+ * @brief Set up the persistent halo requests for the current cell grid. The edge cells are
+ *        sent straight out of (and received straight into) the cell slots, with derived
+ *        datatypes covering the strided rows, so no packing is needed. With --halo=shm,
+ *        neighbours on the same node skip the messages and read each other's shared
+ *        windows instead, and with --halo=rma every rank gets its ghost cells out of its
+ *        neighbours' windows with one-sided MPI_Get. This has to be called again whenever
+ *        the cell grid is reallocated.
+ *
+ */
+void setup_halo() {
+	// the (new) ghost region is empty, so it has to be filled before the next force computation
+	ghost_steps = ghost_interval;
+
+	// the helper thread is kept for the whole run (it sleeps between exchanges)
+	if (progress_mode == PROGRESS_THREAD && !progress_started) {
+		pthread_create(&progress_helper, NULL, progress_thread, NULL);
+		progress_started = 1;
+	}
+
+	if (halo_mode == HALO_NEIGHBOURHOOD) {
+		setup_graph();
+	}
+	if (halo_mode == HALO_SENDRECV || halo_mode == HALO_NEIGHBOURHOOD || halo_mode == HALO_COMPRESSED) {
+		return;
+	}
+
+	if (halo_mode == HALO_RMA) {
+		// x phase: the ghost columns, from the facing columns of the west and east neighbours
+		int ghost_w[2] = {0, 1}, ghost_e[2] = {sizei+1, 1};
+		init_rma_get(&rma_gets[0][0], west_rank, -1, 0, ghost_w, 0, 1, sizej);
+		init_rma_get(&rma_gets[0][1], east_rank, 1, 0, ghost_e, 0, 1, sizej);
+
+		// y phase: the ghost rows (including the corners), from the south and north neighbours
+		int ghost_s[2] = {0, 0}, ghost_n[2] = {0, sizej+1};
+		init_rma_get(&rma_gets[1][0], south_rank, 0, -1, ghost_s, 1, 0, sizei+2);
+		init_rma_get(&rma_gets[1][1], north_rank, 0, 1, ghost_n, 1, 0, sizei+2);
+
+		rma_group(west_rank, east_rank, &rma_groups[0]);
+		rma_group(south_rank, north_rank, &rma_groups[1]);
+		halo_ready = 1;
+		return;
+	}
+
+	if (halo_mode == HALO_SHM) {
+		MPI_Win_lock_all(MPI_MODE_NOCHECK, cells_win);
+		shared_fence();
+	}
+	query_shared_neighbour(west_rank, &shared_west);
+	query_shared_neighbour(east_rank, &shared_east);
+	query_shared_neighbour(south_rank, &shared_south);
+	query_shared_neighbour(north_rank, &shared_north);
+
+	num_halo_requests[0] = 0;
+	num_halo_requests[1] = 0;
+	persistent_bytes = 0;
+
+	// east/west: columns 1 and sizei, rows 1..sizej
+	int col_w[2] = {1, 1}, col_e[2] = {sizei, 1};
+	int ghost_w[2] = {0, 1}, ghost_e[2] = {sizei+1, 1};
+	if (!shared_east.on_node) {
+		init_halo_send(col_e, 0, 1, sizej, east_rank, 1, 0);
+		init_halo_recv(ghost_e, 0, 1, sizej, east_rank, 2, 0);
+	}
+	if (!shared_west.on_node) {
+		init_halo_send(col_w, 0, 1, sizej, west_rank, 2, 0);
+		init_halo_recv(ghost_w, 0, 1, sizej, west_rank, 1, 0);
+	}
+
+	// north/south: rows 1 and sizej, columns 0..sizei+1
+	int row_s[2] = {0, 1}, row_n[2] = {0, sizej};
+	int ghost_s[2] = {0, 0}, ghost_n[2] = {0, sizej+1};
+	if (!shared_north.on_node) {
+		init_halo_send(row_n, 1, 0, sizei+2, north_rank, 3, 1);
+		init_halo_recv(ghost_n, 1, 0, sizei+2, north_rank, 4, 1);
+	}
+	if (!shared_south.on_node) {
+		init_halo_send(row_s, 1, 0, sizei+2, south_rank, 4, 1);
+		init_halo_recv(ghost_s, 1, 0, sizei+2, south_rank, 3, 1);
+	}
+
+	halo_ready = 1;
+}
+
+/**
+ * @brief Release the persistent halo requests (before the cell grid is freed)
+ *
+ */
+void free_halo() {
+	if (!halo_ready) {
+		return;
+	}
+	if (halo_mode == HALO_RMA) {
+		for (int phase = 0; phase < 2; phase++) {
+			for (int g = 0; g < 2; g++) {
+				MPI_Type_free(&rma_gets[phase][g].origin_type);
+				MPI_Type_free(&rma_gets[phase][g].target_type);
+			}
+			MPI_Group_free(&rma_groups[phase]);
+		}
+		halo_ready = 0;
+		return;
+	}
+	for (int phase = 0; phase < 2; phase++) {
+		for (int r = 0; r < num_halo_requests[phase]; r++) {
+			MPI_Request_free(&halo_requests[phase][r]);
+		}
+	}
+	if (halo_mode == HALO_SHM) {
+		MPI_Win_unlock_all(cells_win);
+	}
+	halo_ready = 0;
+}
+
+/**
+ * @brief Apply the boundary conditions. This fills the ghost cell layer with the positions
+ *        of the particles in the neighbouring ranks' edge cells. The domain is periodic, so
+ *        the ranks on the edge of the Cartesian grid wrap around. The exchange is done in x
+ *        first and then in y (including the x ghost cells), so the corners are filled too.
+ *        This has to be done after every cell list update, unless the ghost region is deeper
+ *        than one layer; then the full state of every ghost particle is sent, so that ranks
+ *        can keep integrating the ghost region themselves until it is next refilled.
+ *
  */
 void apply_boundary() {
-	MPI_Request requests[10];
+	ghost_steps = 0;
+	ghost_drift = 0.0;
+	halo_exchanges++;
+
+	if (ghost_depth > 1) {
+		fill_ghost_region();
+		return;
+	}
+
+	if (halo_mode == HALO_NEIGHBOURHOOD) {
+		neighbourhood_halo();
+		return;
+	}
+
+	if (halo_mode == HALO_RMA) {
+		// the y phase gets the neighbours' x ghost cells (for the corners)
+		rma_halo_phase(0);
+		rma_halo_phase(1);
+		return;
+	}
+
+	if (halo_mode != HALO_SENDRECV && halo_mode != HALO_COMPRESSED) {
+		int shared = (halo_mode == HALO_SHM);
+		halo_bytes += persistent_bytes;
 
-	for (int j = 1; j < sizei+1; j++) {
-		for (int k = 0; k < 2*num_part_per_dim*num_part_per_dim; k++) {
-			east_part_ids[((j-1)*2*num_part_per_dim*num_part_per_dim) + k] = cells[sizei][j].part_ids[k];
-			west_part_ids[((j-1)*2*num_part_per_dim*num_part_per_dim) + k] = cells[1][j].part_ids[k];
+		// wait for every rank on the node to finish updating its cells
+		if (shared) shared_fence();
+
+		MPI_Startall(num_halo_requests[0], halo_requests[0]);
+		if (shared_west.on_node) {
+			int src[2] = {shared_west.sizei, 1}, dst[2] = {0, 1};
+			read_shared_line(&shared_west, src, dst, 0, 1, sizej);
+		}
+		if (shared_east.on_node) {
+			int src[2] = {1, 1}, dst[2] = {sizei+1, 1};
+			read_shared_line(&shared_east, src, dst, 0, 1, sizej);
+		}
+		MPI_Waitall(num_halo_requests[0], halo_requests[0], MPI_STATUSES_IGNORE);
+
+		// the y phase reads the neighbours' x ghost cells (for the corners)
+		if (shared) shared_fence();
+
+		MPI_Startall(num_halo_requests[1], halo_requests[1]);
+		if (shared_south.on_node) {
+			int src[2] = {0, shared_south.sizej}, dst[2] = {0, 0};
+			read_shared_line(&shared_south, src, dst, 1, 0, sizei+2);
 		}
-		east_counts[(j-1)] = cells[sizei][j].count;
-		west_counts[(j-1)] = cells[1][j].count;
+		if (shared_north.on_node) {
+			int src[2] = {0, 1}, dst[2] = {0, sizej+1};
+			read_shared_line(&shared_north, src, dst, 1, 0, sizei+2);
+		}
+		MPI_Waitall(num_halo_requests[1], halo_requests[1], MPI_STATUSES_IGNORE);
+
+		// don't let a neighbour move its particles until everyone has finished reading
+		if (shared) shared_fence();
+		return;
 	}
 
-	for (int i = 0; i < sizej+2; i++) {
-		for (int k = 0; k < 2*num_part_per_dim*num_part_per_dim; k++) {
-			south_part_ids[(i*2*num_part_per_dim*num_part_per_dim) + k] = cells[i][sizej].part_ids[k];
-			north_part_ids[(i*2*num_part_per_dim*num_part_per_dim) + k] = cells[i][1].part_ids[k];
+	// east/west: columns 1 and sizei, rows 1..sizej
+	int send_w[2] = {1, 1}, send_e[2] = {sizei, 1};
+	int recv_w[2] = {0, 1}, recv_e[2] = {sizei+1, 1};
+	exchange_halo_line(west_rank, east_rank, sizej, 0, 1, send_w, send_e, recv_w, recv_e);
+
+	// north/south: rows 1 and sizej, columns 0..sizei+1
+	int send_s[2] = {0, 1}, send_n[2] = {0, sizej};
+	int recv_s[2] = {0, 0}, recv_n[2] = {0, sizej+1};
+	exchange_halo_line(south_rank, north_rank, sizei+2, 1, 0, send_s, send_n, recv_s, recv_n);
+}
+
+/**
+ * @brief Move the persistent exchange on to its next phase, once the current one has finished.
+ *        The y phase sends the x ghost cells (for the corners), so it can only start then.
+ *
+ */
+static void next_halo_phase() {
+	halo_phase++;
+	if (halo_phase == 1) {
+		MPI_Startall(num_halo_requests[1], halo_requests[1]);
+	} else {
+		halo_done = MPI_Wtime();
+	}
+}
+
+/**
+ * @brief Test whether the current phase of the halo exchange has finished, and if so move on
+ *
+ */
+static void test_halo() {
+	int done;
+	MPI_Testall(num_halo_requests[halo_phase], halo_requests[halo_phase], &done, MPI_STATUSES_IGNORE);
+	if (done) {
+		next_halo_phase();
+	}
+}
+
+/**
+ * @brief The helper thread for --progress=thread. Each time it is woken up by
+ *        start_boundary(), it keeps polling the halo exchange until it has finished, or until
+ *        the main thread needs it in finish_boundary(). The main thread makes no MPI calls in
+ *        the meantime (it times the steps with get_time()), as only MPI_THREAD_SERIALIZED is
+ *        asked for.
+ *
+ * @param arg Unused
+ * @return void* NULL
+ */
+static void * progress_thread(void * arg) {
+	(void) arg;
+	pthread_mutex_lock(&progress_lock);
+	while (1) {
+		while (!progress_active && !progress_exit) {
+			pthread_cond_wait(&progress_cond, &progress_lock);
+		}
+		if (progress_exit) {
+			break;
 		}
-		south_counts[i] = cells[i][sizej].count;
-		north_counts[i] = cells[i][1].count;
+		pthread_mutex_unlock(&progress_lock);
+
+		while (!atomic_load(&progress_stop) && halo_phase <= 1) {
+			test_halo();
+			sched_yield();
+		}
+
+		pthread_mutex_lock(&progress_lock);
+		progress_active = 0;
+		pthread_cond_broadcast(&progress_cond);
 	}
+	pthread_mutex_unlock(&progress_lock);
+	return NULL;
+}
 
-	MPI_Iallgather(particles.ax, num_particles_per_proc, MPI_DOUBLE, temp_part_ax, num_particles_per_proc, MPI_DOUBLE, MPI_COMM_WORLD, &requests[0]);
-	MPI_Iallgather(particles.ay, num_particles_per_proc, MPI_DOUBLE, temp_part_ay, num_particles_per_proc, MPI_DOUBLE, MPI_COMM_WORLD, &requests[1]);
-	MPI_Iallgather(particles.vx, num_particles_per_proc, MPI_DOUBLE, temp_part_vx, num_particles_per_proc, MPI_DOUBLE, MPI_COMM_WORLD, &requests[2]);
-	MPI_Iallgather(particles.vy, num_particles_per_proc, MPI_DOUBLE, temp_part_vy, num_particles_per_proc, MPI_DOUBLE, MPI_COMM_WORLD, &requests[3]);
-	MPI_Iallgather(particles.x, num_particles_per_proc, MPI_DOUBLE, temp_part_x, num_particles_per_proc, MPI_DOUBLE, MPI_COMM_WORLD, &requests[4]);
-	MPI_Iallgather(particles.y, num_particles_per_proc, MPI_DOUBLE, temp_part_y, num_particles_per_proc, MPI_DOUBLE, MPI_COMM_WORLD, &requests[5]);
+/**
+ * @brief Stop the --progress=thread helper thread (if it was started). This has to be called
+ *        before MPI_Finalize().
+ *
+ */
+void stop_progress_helper() {
+	if (!progress_started) {
+		return;
+	}
+	pthread_mutex_lock(&progress_lock);
+	progress_exit = 1;
+	pthread_cond_broadcast(&progress_cond);
+	pthread_mutex_unlock(&progress_lock);
+	pthread_join(progress_helper, NULL);
+	progress_started = 0;
+}
 
-	MPI_Sendrecv_replace(east_part_ids, sizei*2*num_part_per_dim*num_part_per_dim, MPI_INT, east_rank, 1, 
-						west_rank, 1, cart_comm, MPI_STATUS_IGNORE);
-	
-	MPI_Sendrecv_replace(west_part_ids, sizei*2*num_part_per_dim*num_part_per_dim, MPI_INT, west_rank, 1, 
-						east_rank, 1, cart_comm, MPI_STATUS_IGNORE);
+/**
+ * @brief Start filling the ghost cells. Without --progress, this is just apply_boundary().
+ *        Otherwise the persistent exchange is started, and it has to be finished with
+ *        finish_boundary() before the ghost cells are read.
+ *
+ */
+void start_boundary() {
+	halo_start = MPI_Wtime();
+	if (progress_mode == PROGRESS_OFF) {
+		apply_boundary();
+		halo_done = MPI_Wtime();
+		halo_flight += halo_done - halo_start;
+		halo_exposed += halo_done - halo_start;
+		return;
+	}
+
+	ghost_steps = 0;
+	ghost_drift = 0.0;
+	halo_exchanges++;
+	halo_bytes += persistent_bytes;
+	halo_phase = 0;
+	MPI_Startall(num_halo_requests[0], halo_requests[0]);
+
+	if (progress_mode == PROGRESS_THREAD) {
+		atomic_store(&progress_stop, 0);
+		pthread_mutex_lock(&progress_lock);
+		progress_active = 1;
+		pthread_cond_broadcast(&progress_cond);
+		pthread_mutex_unlock(&progress_lock);
+	}
+}
+
+/**
+ * @brief Give the halo exchange a chance to move on, without waiting for it. This only does
+ *        anything with --progress=test (with --progress=thread, the helper thread does it).
+ *
+ */
+void progress_boundary() {
+	if (progress_mode == PROGRESS_TEST && halo_phase <= 1) {
+		test_halo();
+	}
+}
 
-	MPI_Sendrecv_replace(east_counts, sizei, MPI_INT, east_rank, 1, west_rank, 1, cart_comm, MPI_STATUS_IGNORE);
+/**
+ * @brief Finish the halo exchange started by start_boundary()
+ *
+ * @return double The time spent waiting for it
+ */
+double finish_boundary() {
+	if (progress_mode == PROGRESS_OFF) {
+		return 0.0;
+	}
+	if (progress_mode == PROGRESS_THREAD) {
+		// wait for the helper to stop polling, so this thread can make MPI calls again
+		atomic_store(&progress_stop, 1);
+		pthread_mutex_lock(&progress_lock);
+		while (progress_active) {
+			pthread_cond_wait(&progress_cond, &progress_lock);
+		}
+		pthread_mutex_unlock(&progress_lock);
+	}
 
-	MPI_Sendrecv_replace(west_counts, sizei, MPI_INT, west_rank, 1, east_rank, 1, cart_comm, MPI_STATUS_IGNORE);
-	
-	MPI_Sendrecv_replace(north_part_ids, sizei*2*num_part_per_dim*num_part_per_dim, MPI_INT, north_rank, 1,
-						south_rank, 1, cart_comm, MPI_STATUS_IGNORE);
+	double wait = MPI_Wtime();
+	while (halo_phase <= 1) {
+		MPI_Waitall(num_halo_requests[halo_phase], halo_requests[halo_phase], MPI_STATUSES_IGNORE);
+		next_halo_phase();
+	}
+	wait = MPI_Wtime() - wait;
 
-	MPI_Sendrecv_replace(south_part_ids, sizei*2*num_part_per_dim*num_part_per_dim, MPI_INT, south_rank, 1,
-						north_rank, 1, cart_comm, MPI_STATUS_IGNORE);	
+	halo_flight += halo_done - halo_start;
+	halo_exposed += wait;
+	return wait;
+}
 
-	MPI_Sendrecv_replace(north_counts, sizei, MPI_INT, north_rank, 1, south_rank, 1, cart_comm, MPI_STATUS_IGNORE);
-	
-	MPI_Sendrecv_replace(south_counts, sizei, MPI_INT, south_rank, 1, north_rank, 1, cart_comm, MPI_STATUS_IGNORE);
+/**
+ * @brief Print the bytes sent by the halo exchange (by messages, not through shared memory
+ *        or RMA), and how much of the time it was in flight was hidden behind the force
+ *        computation, averaged over the ranks. This is collective over cart_comm.
+ *
+ */
+void print_halo_stats() {
+	double stats[3] = {halo_flight, halo_exposed, halo_bytes};
+	MPI_Reduce((rank == 0) ? MPI_IN_PLACE : stats, stats, 3, MPI_DOUBLE, MPI_SUM, 0, cart_comm);
+	if (rank == 0) {
+		double hidden = (stats[0] > 0.0) ? 100.0 * (1.0 - (stats[1] / stats[0])) : 0.0;
+		printf("Halo exchange: %.0lf bytes sent per rank per exchange (%d exchanges)\n",
+			   (halo_exchanges > 0) ? stats[2] / (size * halo_exchanges) : 0.0, halo_exchanges);
+		printf("Halo exchange: %.4lf seconds in flight, %.4lf seconds exposed per rank (%.1f%% hidden)\n",
+			   stats[0] / size, stats[1] / size, hidden);
+	}
+}
 
-	MPI_Waitall(6, requests, MPI_STATUS_IGNORE);
+/**
+ * @brief Send the forces on a line of ghost particles back to the neighbours that own them, in
+ *        both directions of one dimension, and add the forces received to the edge particles
+ *        they were copied from. The ghost slots are in the same order as the owner's, so only
+ *        the accelerations are sent.
+ *
+ * @param lo_rank The neighbour in the negative direction
+ * @param hi_rank The neighbour in the positive direction
+ * @param n The number of cells in the line
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param ghost_lo The first ghost cell holding lo_rank's particles (as i, j)
+ * @param ghost_hi The first ghost cell holding hi_rank's particles (as i, j)
+ * @param edge_lo The first cell copied to lo_rank's ghost cells (as i, j)
+ * @param edge_hi The first cell copied to hi_rank's ghost cells (as i, j)
+ */
+static void return_force_line(int lo_rank, int hi_rank, int n, int di, int dj,
+							  int ghost_lo[2], int ghost_hi[2], int edge_lo[2], int edge_hi[2]) {
+	int num_hi = count_line(ghost_hi[0], ghost_hi[1], di, dj, n);
+	int num_lo = count_line(ghost_lo[0], ghost_lo[1], di, dj, n);
+	int recv_num_lo = count_line(edge_lo[0], edge_lo[1], di, dj, n);
+	int recv_num_hi = count_line(edge_hi[0], edge_hi[1], di, dj, n);
+	reserve_buffer(&send_buf_hi, &send_size_hi, 2 * num_hi);
+	reserve_buffer(&send_buf_lo, &send_size_lo, 2 * num_lo);
+	reserve_buffer(&recv_buf_lo, &recv_size_lo, 2 * recv_num_lo);
+	reserve_buffer(&recv_buf_hi, &recv_size_hi, 2 * recv_num_hi);
 
-	for (int p = 0; p < num_particles_total; p++) {
-		particles.ax[p] = temp_part_ax[p];
-		particles.ay[p] = temp_part_ay[p];
-		particles.vx[p] = temp_part_vx[p];
-		particles.vy[p] = temp_part_vy[p];
-		particles.x[p] = temp_part_x[p];
-		particles.y[p] = temp_part_y[p];
+	int * ghost[2] = {ghost_hi, ghost_lo};
+	double * send[2] = {send_buf_hi, send_buf_lo};
+	for (int s = 0; s < 2; s++) {
+		double * b = send[s];
+		for (int c = 0; c < n; c++) {
+			struct cell_list * cell = &cells[ghost[s][0] + c*di][ghost[s][1] + c*dj];
+			for (int k = 0; k < cell->count; k++) {
+				*b++ = particles.ax[cell->offset + k];
+				*b++ = particles.ay[cell->offset + k];
+			}
+		}
 	}
 
-	for (int j = 1; j < sizei+1; j++) {
-		for (int k = 0; k < 2*num_part_per_dim*num_part_per_dim; k++) {
-			cells[0][j].part_ids[k] = east_part_ids[((j-1)*2*num_part_per_dim*num_part_per_dim) + k];
-			cells[sizei+1][j].part_ids[k] = west_part_ids[((j-1)*2*num_part_per_dim*num_part_per_dim) + k];
+	MPI_Sendrecv(send_buf_hi, 2 * num_hi, MPI_DOUBLE, hi_rank, 7, recv_buf_lo, 2 * recv_num_lo, MPI_DOUBLE, lo_rank, 7,
+				 cart_comm, MPI_STATUS_IGNORE);
+	MPI_Sendrecv(send_buf_lo, 2 * num_lo, MPI_DOUBLE, lo_rank, 8, recv_buf_hi, 2 * recv_num_hi, MPI_DOUBLE, hi_rank, 8,
+				 cart_comm, MPI_STATUS_IGNORE);
+
+	int * edge[2] = {edge_lo, edge_hi};
+	double * recv[2] = {recv_buf_lo, recv_buf_hi};
+	for (int s = 0; s < 2; s++) {
+		double * b = recv[s];
+		for (int c = 0; c < n; c++) {
+			struct cell_list * cell = &cells[edge[s][0] + c*di][edge[s][1] + c*dj];
+			for (int k = 0; k < cell->count; k++) {
+				particles.ax[cell->offset + k] += *b++;
+				particles.ay[cell->offset + k] += *b++;
+			}
 		}
-		cells[0][j].count = east_counts[(j-1)];
-		cells[sizei+1][j].count = west_counts[(j-1)] ;
 	}
+}
+
+/**
+ * @brief Send the forces accumulated on ghost particles (by comp_accel_half()) back to their
+ *        owners. This is the halo exchange in reverse: the y phase goes first, so that the
+ *        forces on the corner ghost cells reach the neighbours' x ghost cells, which the
+ *        x phase then sends on to the diagonal neighbours.
+ *
+ */
+void reverse_forces() {
+	// north/south: ghost rows 0 and sizej+1 back into rows 1 and sizej, columns 0..sizei+1
+	int ghost_s[2] = {0, 0}, ghost_n[2] = {0, sizej+1};
+	int edge_s[2] = {0, 1}, edge_n[2] = {0, sizej};
+	return_force_line(south_rank, north_rank, sizei+2, 1, 0, ghost_s, ghost_n, edge_s, edge_n);
+
+	// east/west: ghost columns 0 and sizei+1 back into columns 1 and sizei, rows 1..sizej
+	int ghost_w[2] = {0, 1}, ghost_e[2] = {sizei+1, 1};
+	int edge_w[2] = {1, 1}, edge_e[2] = {sizei, 1};
+	return_force_line(west_rank, east_rank, sizej, 0, 1, ghost_w, ghost_e, edge_w, edge_e);
+}
+
+/**
+ * @brief Send the particles that update_cells() moved into a line of ghost cells to the
+ *        neighbours that own those cells, in both directions of one dimension.
+ *
+ * @param lo_rank The neighbour in the negative direction
+ * @param hi_rank The neighbour in the positive direction
+ * @param n The number of cells in the line
+ * @param di The step in i between cells
+ * @param dj The step in j between cells
+ * @param ghost_lo The first ghost cell owned by lo_rank (as i, j)
+ * @param ghost_hi The first ghost cell owned by hi_rank (as i, j)
+ * @param edge_lo The first local cell on the lo edge (as i, j)
+ * @param edge_hi The first local cell on the hi edge (as i, j)
+ */
+static void migrate_line(int lo_rank, int hi_rank, int n, int di, int dj,
+						 int ghost_lo[2], int ghost_hi[2], int edge_lo[2], int edge_hi[2]) {
+	reserve_buffer(&send_buf_lo, &send_size_lo, count_line(ghost_lo[0], ghost_lo[1], di, dj, n) * MIGRATE_DOUBLES);
+	reserve_buffer(&send_buf_hi, &send_size_hi, count_line(ghost_hi[0], ghost_hi[1], di, dj, n) * MIGRATE_DOUBLES);
+	int num_lo = pack_migrants(send_buf_lo, ghost_lo[0], ghost_lo[1], di, dj, n);
+	int num_hi = pack_migrants(send_buf_hi, ghost_hi[0], ghost_hi[1], di, dj, n);
+
+	int recv_num_lo, recv_num_hi;
+	MPI_Sendrecv(&num_hi, 1, MPI_INT, hi_rank, 3, &recv_num_lo, 1, MPI_INT, lo_rank, 3, cart_comm, MPI_STATUS_IGNORE);
+	MPI_Sendrecv(&num_lo, 1, MPI_INT, lo_rank, 4, &recv_num_hi, 1, MPI_INT, hi_rank, 4, cart_comm, MPI_STATUS_IGNORE);
+
+	reserve_buffer(&recv_buf_lo, &recv_size_lo, recv_num_lo * MIGRATE_DOUBLES);
+	reserve_buffer(&recv_buf_hi, &recv_size_hi, recv_num_hi * MIGRATE_DOUBLES);
+
+	MPI_Sendrecv(send_buf_hi, num_hi * MIGRATE_DOUBLES, MPI_DOUBLE, hi_rank, 5,
+				 recv_buf_lo, recv_num_lo * MIGRATE_DOUBLES, MPI_DOUBLE, lo_rank, 5, cart_comm, MPI_STATUS_IGNORE);
+	MPI_Sendrecv(send_buf_lo, num_lo * MIGRATE_DOUBLES, MPI_DOUBLE, lo_rank, 6,
+				 recv_buf_hi, recv_num_hi * MIGRATE_DOUBLES, MPI_DOUBLE, hi_rank, 6, cart_comm, MPI_STATUS_IGNORE);
+
+	unpack_migrants(recv_buf_lo, recv_num_lo, edge_lo[0], edge_lo[1], di, dj);
+	unpack_migrants(recv_buf_hi, recv_num_hi, edge_hi[0], edge_hi[1], di, dj);
+}
 
-	for (int i = 0; i < sizej+2; i++) {
-		for (int k = 0; k < 2*num_part_per_dim*num_part_per_dim; k++) {
-			cells[i][0].part_ids[k] = south_part_ids[(i*2*num_part_per_dim*num_part_per_dim) + k];
-			cells[i][sizej+1].part_ids[k] = north_part_ids[(i*2*num_part_per_dim*num_part_per_dim) + k];
+/**
+ * @brief Migrate particles that have left this rank's subdomain to the rank that now owns
+ *        them. update_cells() places such particles in the ghost layer; they are forwarded
+ *        in x first (whole ghost columns, including the corners) and then in y, so diagonal
+ *        moves reach the diagonal neighbour in two hops. Positions are cell relative, so
+ *        no adjustment is needed when a particle crosses the periodic boundary.
+ *
+ */
+void exchange_particles() {
+	if (halo_mode == HALO_NEIGHBOURHOOD) {
+		neighbourhood_migrate();
+		return;
+	}
+
+	// east/west: ghost columns 0 and sizei+1, rows 0..sizej+1
+	int ghost_w[2] = {0, 0}, ghost_e[2] = {sizei+1, 0};
+	int edge_w[2] = {1, 0}, edge_e[2] = {sizei, 0};
+	migrate_line(west_rank, east_rank, sizej+2, 0, 1, ghost_w, ghost_e, edge_w, edge_e);
+
+	// north/south: ghost rows 0 and sizej+1, columns 1..sizei
+	int ghost_s[2] = {1, 0}, ghost_n[2] = {1, sizej+1};
+	int edge_s[2] = {1, 1}, edge_n[2] = {1, sizej};
+	migrate_line(south_rank, north_rank, sizei, 1, 0, ghost_s, ghost_n, edge_s, edge_n);
+}
+
+/**
+ * @brief Empty the ghost region, ready for update_cells() to move departing particles into it
+ *
+ */
+void clear_ghosts() {
+	for (int g = 1; g <= ghost_depth; g++) {
+		for (int i = 1-g; i < sizei+1+g; i++) {
+			cells[i][1-g].count = 0;
+			cells[i][sizej+g].count = 0;
+		}
+		for (int j = 2-g; j < sizej+g; j++) {
+			cells[1-g][j].count = 0;
+			cells[sizei+g][j].count = 0;
 		}
-		cells[i][0].count = south_counts[i];
-		cells[i][sizej+1].count = north_counts[i];
+	}
+}
+
+/**
+ * @brief Check whether the ghost region has to be refilled this step, i.e. every
+ *        ghost_interval steps (and straight after the cell grid is reallocated)
+ *
+ * @return int 1 if the ghost region should be refilled this step
+ */
+int ghost_refill_due() {
+	return (ghost_steps + 1) >= ghost_interval;
+}
+
+/**
+ * @brief Account for a step in which the ghost region was integrated locally rather than
+ *        refilled. Every step, the forces are only exact one cut off further in from the edge
+ *        of the ghost region, plus however far the particles moved; if that would reach the
+ *        local cells, the particles have outrun the ghost region and the run is stopped.
+ *
+ * @param drift The largest distance (in x or y) that any particle moved this step
+ */
+void advance_ghost_region(double drift) {
+	ghost_steps++;
+	ghost_drift += drift;
+
+	if (((ghost_steps + 1) * r_cut_off) + ghost_drift > ghost_depth * cell_size) {
+		fprintf(stderr, "Rank %d: particles have moved %g in %d steps, which is more than %d ghost layers can cover, increase --ghost-depth\n",
+				rank, ghost_drift, ghost_steps, ghost_depth);
+		MPI_Abort(MPI_COMM_WORLD, 1);
 	}
 }
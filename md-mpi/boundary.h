@@ -1,6 +1,35 @@
 #ifndef BOUNDARY_H
 #define BOUNDARY_H
 
+// halo exchange implementations
+enum halo_mode {
+	HALO_SENDRECV,
+	HALO_PERSISTENT,
+	HALO_SHM,
+	HALO_NEIGHBOURHOOD,
+	HALO_RMA,
+	HALO_COMPRESSED
+};
+
+// how the halo exchange is kept moving while the interior forces are computed
+enum progress_mode {
+	PROGRESS_OFF,    // no overlap, the exchange is finished before the forces are computed
+	PROGRESS_TEST,   // MPI_Testall between rows of interior cells
+	PROGRESS_THREAD  // a helper thread polls the exchange
+};
+
+void setup_halo();
+void free_halo();
 void apply_boundary();
+void exchange_particles();
+void start_boundary();
+void progress_boundary();
+double finish_boundary();
+void stop_progress_helper();
+void print_halo_stats();
+void reverse_forces();
+void clear_ghosts();
+int ghost_refill_due();
+void advance_ghost_region(double drift);
 
-#endif
\ No newline at end of file
+#endif
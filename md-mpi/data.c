@@ -6,15 +6,13 @@
 
 #include "data.h"
 
-double growth_factor = 1.5;
-
 // parameters for end time, cut off, cell size, grid size and number of particles
 double t_end = 0.5;
 double r_cut_off = 2.5;
 double cell_size = 2.5;
 int x = 500;
 int y = 500;
-int num_particles_per_proc, num_particles_total, p_offset;
+int num_particles_total;
 
 // number of iterations, timestep duration and half-timestep duration
 int niters = 1000;
@@ -25,15 +23,8 @@ double dth;
 double r_cut_off_2;
 
 // constants required to calculate the potential energy
-double r_cut_off_2_inv; 
-double r_cut_off_6_inv;	
-double Uc;
-double Duc;
-
-
-// constants required to calculate the potential energy
-double r2cutinv;
-double r6cutinv;
+double r_cut_off_2_inv;
+double r_cut_off_6_inv;
 double Uc;
 double Duc;
 
@@ -44,6 +35,14 @@ long seed;
 double init_temp = 1.0;
 int num_part_per_dim = 2;
 
+// the maximum number of particles a single cell can hold (0 means 4 * num_part_per_dim^2)
+int cell_capacity = 0;
+
+// the depth of the ghost region (0 means just deep enough for the interval), and the number
+// of steps between refilling it
+int ghost_depth = 0;
+int ghost_interval = 1;
+
 // the cell list
 struct cell_list ** cells;
 
@@ -51,48 +50,164 @@ struct particle_t particles;
 
 int size, rank;
 int sizei, sizej;
+int starti, startj;
+int dims[2], coords[2];
+int * bounds_x, * bounds_y;
 MPI_Comm cart_comm;
-int * east_part_ids, * west_part_ids, * north_part_ids, * south_part_ids;
-int * east_counts, * west_counts, * north_counts, * south_counts;
 int east_rank, west_rank, north_rank, south_rank;
-double * temp_part_ax, * temp_part_ay, * temp_part_x, * temp_part_y, * temp_part_vx, * temp_part_vy;
+
+// the window holding the cells (if any), and the ranks sharing this node (--halo=shm only)
+int cells_window = CELLS_PRIVATE;
+MPI_Comm node_comm = MPI_COMM_NULL;
+MPI_Win cells_win = MPI_WIN_NULL;
 
 /**
  * @brief Add a particle to a particular cell list
- * 
- * @param list The cell list to add the particle to
- * @param particle The particle
+ *
+ * @param cell The cell list to add the particle to
+ * @param px The x position of the particle within the cell
+ * @param py The y position of the particle within the cell
+ * @param pvx The x velocity
+ * @param pvy The y velocity
+ * @param pax The x acceleration
+ * @param pay The y acceleration
+ * @param pid The global id of the particle
  */
-void add_particle(struct cell_list * cell, int part_id) {
-	if (cell->count == cell->size) {
-		printf("reallocating memory\n");
-		cell->size *= growth_factor;
-		int * tmp = realloc(cell->part_ids, sizeof(int) * cell->size);
-		if (!tmp) {
-			fprintf(stderr, "realloc failed\n");
-			exit(2);
-		} else {
-			cell->part_ids = tmp;
-		}
+void add_particle(struct cell_list * cell, double px, double py, double pvx, double pvy, double pax, double pay, int pid) {
+	if (cell->count == cell_capacity) {
+		fprintf(stderr, "Rank %d: a cell has overflowed its %d slots, increase --cell-capacity\n", rank, cell_capacity);
+		MPI_Abort(MPI_COMM_WORLD, 2);
 	}
-	cell->part_ids[cell->count] = part_id;
-	cell->count++; 
+	int p = cell->offset + cell->count;
+	particles.x[p] = px;
+	particles.y[p] = py;
+	particles.vx[p] = pvx;
+	particles.vy[p] = pvy;
+	particles.ax[p] = pax;
+	particles.ay[p] = pay;
+	particles.id[p] = pid;
+	cell->count++;
 }
 
 /**
- * @brief Remove a particle from a particular cell list
- * 
- * @param list The cell list to remove the particle from
- * @param particle The particle
+ * @brief Remove a particle from a particular cell list. The last particle in the cell
+ *        is moved into the freed slot, so slots [0, count) stay dense.
+ *
+ * @param cell The cell list to remove the particle from
+ * @param idx The index of the particle within the cell
  */
 void remove_particle(struct cell_list * cell, int idx) {
-	memmove(cell->part_ids + idx, cell->part_ids + idx + 1, (cell->size - idx - 1) * sizeof(int));
+	int p = cell->offset + idx;
+	int last = cell->offset + cell->count - 1;
+	particles.x[p] = particles.x[last];
+	particles.y[p] = particles.y[last];
+	particles.vx[p] = particles.vx[last];
+	particles.vy[p] = particles.vy[last];
+	particles.ax[p] = particles.ax[last];
+	particles.ay[p] = particles.ay[last];
+	particles.id[p] = particles.id[last];
 	cell->count--;
 }
 
+/**
+ * @brief Allocate the local cell grid (including ghost_depth layers of ghost cells) and the
+ *        particle slots for the current sizei x sizej subdomain. The local cells are always
+ *        cells[1..sizei][1..sizej], so with deeper ghost regions the row pointers are offset
+ *        to allow indices down to 1 - ghost_depth. All cells start empty. Depending on
+ *        cells_window, the cell counts and positions are placed in a shared memory window
+ *        (so that neighbours on the same node can read them directly), or in an RMA window
+ *        (so that neighbours can MPI_Get them); this is then collective over node_comm or
+ *        cart_comm respectively.
+ *
+ */
+void alloc_cells() {
+	int rows = sizei + (2 * ghost_depth);
+	int width = sizej + (2 * ghost_depth);
+	int num_cells = rows * width;
+	int num_slots = num_cells * cell_capacity;
+	struct cell_list * block;
+
+	if (cells_window != CELLS_PRIVATE) {
+		MPI_Aint bytes = SHARED_HEADER_BYTES + (2 * sizeof(double) * num_slots) + (sizeof(struct cell_list) * num_cells);
+		char * base;
+		if (cells_window == CELLS_SHARED) {
+			MPI_Win_allocate_shared(bytes, 1, MPI_INFO_NULL, node_comm, &base, &cells_win);
+		} else {
+			MPI_Win_allocate(bytes, 1, MPI_INFO_NULL, cart_comm, &base, &cells_win);
+		}
+
+		int * header = (int *) base;
+		header[0] = sizei;
+		header[1] = sizej;
+		particles.x = (double *) (base + SHARED_HEADER_BYTES);
+		particles.y = particles.x + num_slots;
+		block = (struct cell_list *) (particles.y + num_slots);
+	} else {
+		block = (struct cell_list *) malloc(sizeof(struct cell_list) * num_cells);
+		particles.x = malloc(sizeof(double) * num_slots);
+		particles.y = malloc(sizeof(double) * num_slots);
+	}
+
+	struct cell_list ** row_ptrs = (struct cell_list **) malloc(rows * sizeof(struct cell_list *));
+	for (int r = 0; r < rows; r++) {
+		row_ptrs[r] = &block[(r * width) + ghost_depth - 1];
+	}
+	cells = row_ptrs + ghost_depth - 1;
+
+	particles.ax = malloc(sizeof(double) * num_slots);
+	particles.ay = malloc(sizeof(double) * num_slots);
+	particles.vx = malloc(sizeof(double) * num_slots);
+	particles.vy = malloc(sizeof(double) * num_slots);
+	particles.id = malloc(sizeof(int) * num_slots);
+
+	for (int i = 1-ghost_depth; i < sizei+1+ghost_depth; i++) {
+		for (int j = 1-ghost_depth; j < sizej+1+ghost_depth; j++) {
+			cells[i][j].count = 0;
+			cells[i][j].offset = (((i+ghost_depth-1) * width) + (j+ghost_depth-1)) * cell_capacity;
+		}
+	}
+}
+
+/**
+ * @brief Free the local cell grid and the particle slots
+ *
+ */
+void free_cells() {
+	free(particles.ax);
+	free(particles.ay);
+	free(particles.vx);
+	free(particles.vy);
+	free(particles.id);
+
+	struct cell_list ** row_ptrs = cells - (ghost_depth - 1);
+	if (cells_window != CELLS_PRIVATE) {
+		MPI_Win_free(&cells_win);
+	} else {
+		free(particles.x);
+		free(particles.y);
+		free(row_ptrs[0] - (ghost_depth - 1));
+	}
+	free(row_ptrs);
+}
+
+/**
+ * @brief Count the particles owned by this rank (i.e. those in the non-ghost cells)
+ *
+ * @return int The number of local particles
+ */
+int count_local_particles() {
+	int count = 0;
+	for (int i = 1; i < sizei+1; i++) {
+		for (int j = 1; j < sizej+1; j++) {
+			count += cells[i][j].count;
+		}
+	}
+	return count;
+}
+
 /**
  * @brief Allocate a 2D array of cell list structures
- * 
+ *
  * @param m Dimension in X direction
  * @param n Dimension in Y direction
  * @return struct cell_list** An allocated 2D cell list structure
@@ -100,7 +215,7 @@ void remove_particle(struct cell_list * cell, int idx) {
 struct cell_list ** alloc_2d_cell_list_array(int m, int n) {
   	struct cell_list ** x;
 
-  	x = (struct cell_list **) malloc(m * sizeof(struct cell_list));
+  	x = (struct cell_list **) malloc(m * sizeof(struct cell_list *));
   	x[0] = (struct cell_list *) calloc(m * n, sizeof(struct cell_list));
   	for (int i = 1; i < m; i++)
     	x[i] = &x[0][i*n];
@@ -109,10 +224,10 @@ struct cell_list ** alloc_2d_cell_list_array(int m, int n) {
 
 /**
  * @brief Free a 2D array
- * 
+ *
  * @param array The 2D array to free
  */
 void free_2d_array(void ** array) {
 	free(array[0]);
 	free(array);
-}
\ No newline at end of file
+}
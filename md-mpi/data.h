@@ -1,29 +1,29 @@
 #ifndef DATA_H
 #define DATA_H
 #include <mpi.h>
-// particle data type (with pointers to next and previous for linked list)
+// particle data type. Particles are stored in fixed-capacity slots, one block of
+// cell_capacity slots per cell (including ghost cells), so cell (i,j) owns the
+// slots [cells[i][j].offset, cells[i][j].offset + cell_capacity)
 struct particle_t {
 	double * x, * y; // position within cell
 	double * ax, * ay; // acceleration
 	double * vx, * vy; // velocity
+	int * id; // global particle id
 };
 
-// list for a cell, with a head
+// list for a cell, with the offset of its first slot
 struct cell_list {
 	int count;
-	int size;
-	int * part_ids;
+	int offset;
 };
 
-extern double growth_factor;
-
 // parameters for end time, cut off, cell size, grid size and number of particles
 extern double t_end;
 extern double r_cut_off;
 extern double cell_size;
 extern int x;
 extern int y;
-extern int num_particles_per_proc, num_particles_total, p_offset;
+extern int num_particles_total;
 
 // number of iterations, timestep duration and half-timestep duration
 extern int niters;
@@ -34,8 +34,8 @@ extern double dth;
 extern double r_cut_off_2;
 
 // constants required to calculate the potential energy
-extern double r_cut_off_2_inv; 
-extern double r_cut_off_6_inv;	
+extern double r_cut_off_2_inv;
+extern double r_cut_off_6_inv;
 extern double Uc;
 extern double Duc;
 
@@ -46,21 +46,47 @@ extern long seed;
 extern double init_temp;
 extern int num_part_per_dim;
 
-// the cell list
+// the maximum number of particles a single cell can hold
+extern int cell_capacity;
+
+// the number of layers of ghost cells around the subdomain, and the number of steps between
+// refilling them from the neighbours (in between, ranks integrate the ghost particles themselves)
+extern int ghost_depth;
+extern int ghost_interval;
+
+// the cell list (local cells 1..sizei, 1..sizej, surrounded by ghost_depth layers of ghost cells)
 extern struct cell_list ** cells;
 extern struct particle_t particles;
+
+// the Cartesian decomposition. bounds_x/bounds_y hold the first global cell of every
+// rank column/row (dims[d]+1 entries), this rank owns global cells [starti, starti+sizei)
+// and [startj, startj+sizej)
 extern int size, rank;
-extern int sizej, sizei;
+extern int sizei, sizej;
+extern int starti, startj;
+extern int dims[2], coords[2];
+extern int * bounds_x, * bounds_y;
 extern MPI_Comm cart_comm;
 extern int east_rank, west_rank, north_rank, south_rank;
-extern int * east_part_ids, * west_part_ids, * north_part_ids, * south_part_ids;
-extern int * east_counts, * west_counts, * north_counts, * south_counts;
-extern double * temp_part_ax, * temp_part_ay, * temp_part_x, * temp_part_y, * temp_part_vx, * temp_part_vy;
 
+// where the cell counts and positions are allocated. In a window, the memory starts with a
+// header holding sizei and sizej, followed by the x slots, the y slots and the cell lists
+enum cells_window {
+	CELLS_PRIVATE, // plain malloc
+	CELLS_SHARED,  // MPI_Win_allocate_shared over node_comm (--halo=shm)
+	CELLS_RMA      // MPI_Win_allocate over cart_comm (--halo=rma)
+};
+#define SHARED_HEADER_BYTES 16
+extern int cells_window;
+extern MPI_Comm node_comm;
+extern MPI_Win cells_win;
 
-void add_particle(struct cell_list * list, int part_id);
-void remove_particle(struct cell_list * list, int idx);
+void add_particle(struct cell_list * cell, double px, double py, double pvx, double pvy, double pax, double pay, int pid);
+void remove_particle(struct cell_list * cell, int idx);
+void alloc_cells();
+void free_cells();
+int count_local_particles();
 struct cell_list ** alloc_2d_cell_list_array(int m, int n);
 void free_2d_array(void ** array);
 
-#endif
\ No newline at end of file
+#endif
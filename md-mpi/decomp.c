@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "args.h"
+#include "data.h"
+#include "decomp.h"
+
+/**
+ * @brief Estimate the ghost particles received each step by the rank with the largest
+ *        subdomain, if the grid is split over d0 x d1 ranks
+ *
+ * @param d0 The number of ranks in x
+ * @param d1 The number of ranks in y
+ * @return double The number of ghost particles
+ */
+static double halo_particles(int d0, int d1) {
+	long sx = (x + d0 - 1) / d0;
+	long sy = (y + d1 - 1) / d1;
+	double density = num_part_per_dim * num_part_per_dim;
+	return ((((sx + 2*ghost_depth) * (sy + 2*ghost_depth)) - (sx * sy)) * density);
+}
+
+/**
+ * @brief Estimate the ghost particles received from other nodes each step by a node, if the
+ *        grid is split over d0 x d1 ranks and every node holds an n0 x n1 block of them. A
+ *        node that spans a whole dimension fills the ghost cells in that dimension itself.
+ *
+ * @param d0 The number of ranks in x
+ * @param d1 The number of ranks in y
+ * @param n0 The number of ranks in x on each node
+ * @param n1 The number of ranks in y on each node
+ * @return double The number of ghost particles
+ */
+static double off_node_particles(int d0, int d1, int n0, int n1) {
+	long bx = n0 * ((x + d0 - 1) / d0);
+	long by = n1 * ((y + d1 - 1) / d1);
+	double density = num_part_per_dim * num_part_per_dim;
+	double cells = 0.0;
+	if (d0 > n0) cells += 2.0 * ghost_depth * by;
+	if (d1 > n1) cells += 2.0 * ghost_depth * bx;
+	if (d0 > n0 || d1 > n1) cells += 4.0 * ghost_depth * ghost_depth;
+	return cells * density;
+}
+
+/**
+ * @brief Find out how the ranks are spread over nodes
+ *
+ * @param node_size Set to the number of ranks on this node
+ * @param node_index Set to the index of this node
+ * @param node_rank Set to the index of this rank within its node
+ * @return int Whether every node has the same number of ranks
+ */
+static int node_layout(int * node_size, int * node_index, int * node_rank) {
+	int world_rank;
+	MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+
+	MPI_Comm node, leaders;
+	MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, world_rank, MPI_INFO_NULL, &node);
+	MPI_Comm_size(node, node_size);
+	MPI_Comm_rank(node, node_rank);
+
+	// number the nodes by their first rank
+	MPI_Comm_split(MPI_COMM_WORLD, (*node_rank == 0) ? 0 : MPI_UNDEFINED, world_rank, &leaders);
+	if (*node_rank == 0) {
+		MPI_Comm_rank(leaders, node_index);
+		MPI_Comm_free(&leaders);
+	}
+	MPI_Bcast(node_index, 1, MPI_INT, 0, node);
+	MPI_Comm_free(&node);
+
+	int sizes[2] = {-(*node_size), *node_size};
+	MPI_Allreduce(MPI_IN_PLACE, sizes, 2, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+	return (-sizes[0] == sizes[1]);
+}
+
+/**
+ * @brief Choose the shape of the rank grid and create cart_comm. With --decomp=plan, every
+ *        factorisation of the number of ranks is tried, and the one with the smallest ghost
+ *        region on the most loaded rank wins (so long thin grids get long thin rank grids).
+ *        If every node has the same number of ranks, ties are broken by the ghost traffic
+ *        between nodes, and the ranks are ordered so that each node holds a compact block of
+ *        the rank grid. MPI_Cart_create is then free to reorder them further.
+ *
+ */
+void create_cart_comm() {
+	int periods[2] = {1,1};
+	int world_rank;
+	MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+
+	int node_size, node_index, node_rank;
+	int uniform = node_layout(&node_size, &node_index, &node_rank);
+
+	// the block of the rank grid on each node (0 if the nodes can't be tiled)
+	int tile[2] = {0, 0};
+
+	dims[0] = 0;
+	dims[1] = 0;
+	if (decomp_mode == DECOMP_PLAN) {
+		double best_halo = 0.0, best_off = 0.0;
+		for (int d0 = 1; d0 <= size; d0++) {
+			int d1 = size / d0;
+			// every rank needs at least as many cells as its neighbours' ghost regions are deep
+			if (d0 * d1 != size || x < d0 * ghost_depth || y < d1 * ghost_depth) {
+				continue;
+			}
+
+			double halo = halo_particles(d0, d1);
+			double off = 0.0;
+			int n[2] = {0, 0};
+			for (int n0 = 1; uniform && n0 <= node_size; n0++) {
+				int n1 = node_size / n0;
+				if (n0 * n1 != node_size || d0 % n0 != 0 || d1 % n1 != 0) {
+					continue;
+				}
+				double o = off_node_particles(d0, d1, n0, n1);
+				if (n[0] == 0 || o < off) {
+					off = o;
+					n[0] = n0;
+					n[1] = n1;
+				}
+			}
+
+			if (dims[0] == 0 || halo < best_halo || (halo == best_halo && off < best_off)) {
+				best_halo = halo;
+				best_off = off;
+				dims[0] = d0;
+				dims[1] = d1;
+				tile[0] = n[0];
+				tile[1] = n[1];
+			}
+		}
+	}
+	if (dims[0] == 0) {
+		MPI_Dims_create(size, 2, dims);
+	}
+
+	// cart_comm numbers the ranks row by row (y fastest), so order them by their place in it
+	int key = world_rank;
+	if (tile[0] > 0) {
+		int tiles_y = dims[1] / tile[1];
+		int c0 = ((node_index / tiles_y) * tile[0]) + (node_rank / tile[1]);
+		int c1 = ((node_index % tiles_y) * tile[1]) + (node_rank % tile[1]);
+		key = (c0 * dims[1]) + c1;
+	}
+
+	MPI_Comm ordered;
+	MPI_Comm_split(MPI_COMM_WORLD, 0, key, &ordered);
+	MPI_Cart_create(ordered, 2, dims, periods, 1, &cart_comm);
+	MPI_Comm_free(&ordered);
+
+	if (world_rank == 0 && verbose) {
+		if (tile[0] > 0) {
+			printf("Decomposition: %d x %d ranks, %d x %d per node\n", dims[0], dims[1], tile[0], tile[1]);
+		} else {
+			printf("Decomposition: %d x %d ranks\n", dims[0], dims[1]);
+		}
+	}
+}
@@ -0,0 +1,12 @@
+#ifndef DECOMP_H
+#define DECOMP_H
+
+// ways of choosing the shape of the rank grid
+enum decomp_mode {
+	DECOMP_PLAN, // minimise the ghost region per rank, then the traffic between nodes
+	DECOMP_MPI   // MPI_Dims_create (as square as possible, whatever the grid)
+};
+
+void create_cart_comm();
+
+#endif
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "args.h"
+#include "data.h"
+#include "diagnostics.h"
+
+// the values reduced on every output step
+enum {
+	DIAG_POTENTIAL,
+	DIAG_KINETIC,
+	DIAG_MOMENTUM_X,
+	DIAG_MOMENTUM_Y,
+	DIAG_PARTICLES,
+	NUM_DIAGS
+};
+
+static double diag_local[NUM_DIAGS];
+static double diag_global[NUM_DIAGS];
+static MPI_Request diag_request = MPI_REQUEST_NULL;
+
+// the step the pending reduction belongs to
+static int diag_iters;
+static double diag_t;
+
+// the total energy (per particle) on the first output step, to measure the drift against
+static double first_energy;
+static int have_first_energy = 0;
+
+/**
+ * @brief Print the status line for a completed reduction (on rank 0)
+ *
+ */
+static void print_diagnostics() {
+	if (rank != 0) {
+		return;
+	}
+
+	double potential_energy = diag_global[DIAG_POTENTIAL] / num_particles_total;
+	double kinetic_energy = diag_global[DIAG_KINETIC] / num_particles_total;
+	double total_energy = kinetic_energy + potential_energy;
+	double temp = kinetic_energy * 2.0 / 3.0;
+	if (!have_first_energy) {
+		first_energy = total_energy;
+		have_first_energy = 1;
+	}
+
+	printf("Step %8d, Time: %14.8e (dt: %14.8e), Total energy: %14.8e (p:%14.8e,k:%14.8e), Temp: %14.8e\n", diag_iters, diag_t, dt, total_energy, potential_energy, kinetic_energy, temp);
+	if (verbose) {
+		printf("Step %8d, Momentum: (%14.8e, %14.8e)\n", diag_iters, diag_global[DIAG_MOMENTUM_X], diag_global[DIAG_MOMENTUM_Y]);
+	}
+	if ((int) diag_global[DIAG_PARTICLES] != num_particles_total) {
+		fprintf(stderr, "Warning: step %d has %d particles, expected %d\n", diag_iters, (int) diag_global[DIAG_PARTICLES], num_particles_total);
+	}
+}
+
+/**
+ * @brief Start the reduction of this step's diagnostics. The potential energy, kinetic energy,
+ *        momentum and particle count are reduced together in a single non-blocking call
+ *        (MPI_Iallreduce, or MPI_Ireduce to rank 0 with --reduce=root), and the status line is
+ *        printed once it completes, so the simulation can carry on in the meantime.
+ *
+ * @param iters The current iteration
+ * @param t The current simulation time
+ * @param potential_energy The (summed) potential energy of the local particles
+ * @param kinetic_energy The (summed) kinetic energy of the local particles
+ */
+void start_diagnostics(int iters, double t, double potential_energy, double kinetic_energy) {
+	// the buffers can only be reused once the previous reduction is done
+	finish_diagnostics();
+
+	diag_local[DIAG_POTENTIAL] = potential_energy;
+	diag_local[DIAG_KINETIC] = kinetic_energy;
+	diag_local[DIAG_MOMENTUM_X] = 0.0;
+	diag_local[DIAG_MOMENTUM_Y] = 0.0;
+	diag_local[DIAG_PARTICLES] = 0.0;
+	for (int i = 1; i < sizei+1; i++) {
+		for (int j = 1; j < sizej+1; j++) {
+			for (int k = 0; k < cells[i][j].count; k++) {
+				diag_local[DIAG_MOMENTUM_X] += particles.vx[cells[i][j].offset + k];
+				diag_local[DIAG_MOMENTUM_Y] += particles.vy[cells[i][j].offset + k];
+			}
+			diag_local[DIAG_PARTICLES] += cells[i][j].count;
+		}
+	}
+
+	diag_iters = iters;
+	diag_t = t;
+
+	if (reduce_mode == REDUCE_ROOT) {
+		MPI_Ireduce(diag_local, diag_global, NUM_DIAGS, MPI_DOUBLE, MPI_SUM, 0, cart_comm, &diag_request);
+	} else {
+		MPI_Iallreduce(diag_local, diag_global, NUM_DIAGS, MPI_DOUBLE, MPI_SUM, cart_comm, &diag_request);
+	}
+}
+
+/**
+ * @brief Progress the pending reduction (if any), and print its results if it has completed
+ *
+ */
+void test_diagnostics() {
+	if (diag_request == MPI_REQUEST_NULL) {
+		return;
+	}
+
+	int done;
+	MPI_Test(&diag_request, &done, MPI_STATUS_IGNORE);
+	if (done) {
+		print_diagnostics();
+	}
+}
+
+/**
+ * @brief Wait for the pending reduction (if any), and print its results
+ *
+ */
+void finish_diagnostics() {
+	if (diag_request == MPI_REQUEST_NULL) {
+		return;
+	}
+
+	MPI_Wait(&diag_request, MPI_STATUS_IGNORE);
+	print_diagnostics();
+}
+
+/**
+ * @brief Print how far the total energy has drifted since the first output step (on rank 0)
+ *
+ * @param final_energy The final total energy (per particle)
+ */
+void print_energy_drift(double final_energy) {
+	if (rank != 0 || !have_first_energy) {
+		return;
+	}
+	printf("Energy drift: %14.8e (%14.8e relative)\n", final_energy - first_energy, (final_energy - first_energy) / fabs(first_energy));
+}
@@ -0,0 +1,15 @@
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+// how the diagnostics are reduced
+enum reduce_mode {
+	REDUCE_ALL,
+	REDUCE_ROOT
+};
+
+void start_diagnostics(int iters, double t, double potential_energy, double kinetic_energy);
+void test_diagnostics();
+void finish_diagnostics();
+void print_energy_drift(double final_energy);
+
+#endif
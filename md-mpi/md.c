@@ -5,8 +5,11 @@
 #include <sys/time.h>
 
 #include "args.h"
+#include "balance.h"
 #include "boundary.h"
 #include "data.h"
+#include "diagnostics.h"
+#include "restart.h"
 #include "setup.h"
 #include "vtk.h"
 
@@ -17,146 +20,322 @@ double get_time() {
   return t.tv_sec + (1e-6 * t.tv_usec);
 }
 
+// the phases of a step, timed for --timings
+enum {
+	PHASE_MOVE,
+	PHASE_CELLS,
+	PHASE_MIGRATE,
+	PHASE_HALO,
+	PHASE_FORCE,
+	PHASE_VELOCITY,
+	PHASE_OUTPUT,
+	PHASE_BALANCE,
+	NUM_PHASES
+};
+static const char * phase_names[NUM_PHASES] = {"move", "cells", "migrate", "halo", "force", "velocity", "output", "balance"};
+static double phase_time[NUM_PHASES];
+static double phase_mark;
+
+/**
+ * @brief Add the time since the last call to a phase of the step. This uses get_time() rather
+ *        than MPI_Wtime(), as it is called while the --progress=thread helper is making MPI calls.
+ *
+ * @param phase The phase that has just finished
+ */
+static void lap(int phase) {
+	double now = get_time();
+	phase_time[phase] += now - phase_mark;
+	phase_mark = now;
+}
+
+/**
+ * @brief Print the time spent in each phase of the step, on the slowest rank for that phase
+ *        (on rank 0). This is collective over cart_comm.
+ *
+ */
+static void print_timings() {
+	double slowest[NUM_PHASES];
+	MPI_Reduce(phase_time, slowest, NUM_PHASES, MPI_DOUBLE, MPI_MAX, 0, cart_comm);
+	if (rank == 0) {
+		printf("Timings: ranks=%d", size);
+		for (int phase = 0; phase < NUM_PHASES; phase++) {
+			printf(" %s=%.6lf", phase_names[phase], slowest[phase]);
+		}
+		printf("\n");
+	}
+}
+
+/**
+ * @brief Calculate the acceleration of the particles in one cell, from the particles in the
+ *        same cell and the 8 cells around it
+ *
+ * @param i The cell's index in x
+ * @param j The cell's index in y
+ * @param energy The potential energy to add the cell's share to
+ */
+static void cell_accel(int i, int j, double * energy) {
+	for (int k = 0; k < cells[i][j].count; k++) {
+		int p = cells[i][j].offset + k;
+
+		// zero acceleration for every particle
+		particles.ax[p] = 0.0;
+		particles.ay[p] = 0.0;
+
+		// Compare each particle with all particles in the 9 cells
+		for (int a = -1; a <= 1; a++) {
+			for (int b = -1; b <= 1; b++) {
+				for (int l = 0; l < cells[i+a][j+b].count; l++) {
+					int q = cells[i+a][j+b].offset + l;
+					if (p == q) {
+						continue;
+					}
+
+					// since particles are stored relative to their cell, calculate the
+					// actual x and y coordinates.
+					double p_real_x = ((i-1) * cell_size) + particles.x[p];
+					double p_real_y = ((j-1) * cell_size) + particles.y[p];
+					double q_real_x = ((i+a-1) * cell_size) + particles.x[q];
+					double q_real_y = ((j+b-1) * cell_size) + particles.y[q];
+					
+					// calculate distance in x and y, then absolute distance
+					double dx = p_real_x - q_real_x;
+					double dy = p_real_y - q_real_y;
+					double r_2 = dx*dx + dy*dy;
+					
+					// if distance less than cut off, calculate force and 
+					// use this to calculate acceleration in each dimension
+					// calculate potential energy of each particle at the same time
+					if (r_2 < r_cut_off_2) {
+						double r_2_inv = 1.0 / r_2;
+						double r_6_inv = r_2_inv * r_2_inv * r_2_inv;
+						
+						double f = (48.0 * r_2_inv * r_6_inv * (r_6_inv - 0.5));
+
+						particles.ax[p] += f*dx;
+
+						particles.ay[p] += f*dy;
+
+
+						*energy += 4.0 * r_6_inv * (r_6_inv - 1.0) - Uc - Duc * (sqrt(r_2) - r_cut_off);
+					}
+				}
+			}
+		}
+	}
+}
+
 /**
  * @brief This routine calculates the acceleration felt by each particle based on evaluating the Lennard-Jones 
  *        potential with its neighbours. It only evaluates particles within a cut-off radius, and uses cells to 
  *        reduce the search space. It also calculates the potential energy of the system. 
+ *        Only local particles (and the first depth layers of ghost particles) are updated, so
+ *        pairs that straddle a rank boundary are evaluated by both ranks against the ghost
+ *        copy of the other particle.
  * 
- * @return double The potential energy
+ * @param depth The number of ghost layers to update as well
+ * @return double The potential energy of the local particles (summed, not averaged)
+ */
+double comp_accel(int depth) {
+	double pot_energy = 0.0;
+	double ghost_energy = 0.0;
+
+	for (int i = 1-depth; i < sizei+1+depth; i++) {
+		for (int j = 1-depth; j < sizej+1+depth; j++) {
+			// the energy of ghost particles belongs to their owner
+			int local = (i >= 1) && (i <= sizei) && (j >= 1) && (j <= sizej);
+			cell_accel(i, j, local ? &pot_energy : &ghost_energy);
+		}
+	}
+
+	// the sum is averaged over the global particle count once it has been reduced
+	return pot_energy;
+}
+
+/**
+ * @brief Add the force between two particles to both of them (half-shell)
+ *
+ * @param p The first particle
+ * @param q The second particle
+ * @param dx The distance from q to p in x
+ * @param dy The distance from q to p in y
+ * @param energy The potential energy to add the pair's share to
  */
-double comp_accel() {
-	// printf("starting comp_accel");
-	// zero acceleration for every particle
-	for (int p = 0; p < num_particles_per_proc; p++) {
-		particles.ax[p_offset + p] = 0.0;
-		particles.ay[p_offset + p] = 0.0;
+static void pair_accel(int p, int q, double dx, double dy, double * energy) {
+	double r_2 = dx*dx + dy*dy;
+	if (r_2 < r_cut_off_2) {
+		double r_2_inv = 1.0 / r_2;
+		double r_6_inv = r_2_inv * r_2_inv * r_2_inv;
+
+		double f = (48.0 * r_2_inv * r_6_inv * (r_6_inv - 0.5));
+
+		particles.ax[p] += f*dx;
+		particles.ay[p] += f*dy;
+		particles.ax[q] -= f*dx;
+		particles.ay[q] -= f*dy;
+
+		// the full-shell sum counts every pair once for each particle, so this does too
+		*energy += 2.0 * (4.0 * r_6_inv * (r_6_inv - 1.0) - Uc - Duc * (sqrt(r_2) - r_cut_off));
 	}
+}
 
+/**
+ * @brief Calculate the accelerations (as comp_accel(0)) using Newton's third law, so every
+ *        pair is only evaluated once. Each local cell is paired with itself and the forward
+ *        half of its neighbours, so pairs that straddle a rank boundary are only evaluated by
+ *        the owner of the lower cell; the forces on its ghost copies are then sent back to
+ *        their owners by reverse_forces().
+ *
+ * @return double The potential energy of the local pairs (summed, not averaged)
+ */
+double comp_accel_half() {
+	static const int half_shell[4][2] = {{1, -1}, {1, 0}, {1, 1}, {0, 1}};
 	double pot_energy = 0.0;
 
+	// pairs add to both particles, so the ghost particles have to start from zero too
+	for (int i = 0; i < sizei+2; i++) {
+		for (int j = 0; j < sizej+2; j++) {
+			for (int k = 0; k < cells[i][j].count; k++) {
+				particles.ax[cells[i][j].offset + k] = 0.0;
+				particles.ay[cells[i][j].offset + k] = 0.0;
+			}
+		}
+	}
+
 	for (int i = 1; i < sizei+1; i++) {
 		for (int j = 1; j < sizej+1; j++) {
 			for (int k = 0; k < cells[i][j].count; k++) {
-				int p = cells[i][j].part_ids[k];
-				// Compare each particle with all particles in the 9 cells
-				for (int a = -1; a <= 1; a++) {
-					for (int b = -1; b <= 1; b++) {
-						for (int l = 0; l < cells[i+a][j+b].count; l++) {
-							if (l > 2*num_part_per_dim*num_part_per_dim-1){
-								continue;
-							}
-							int q = cells[i+a][j+b].part_ids[l];
-							if (p == q || q > num_particles_total - 1 || q < 0) {
-								continue;
-							}
-							// printf("in comp_accel");
-
-
-							// since particles are stored relative to their cell, calculate the
-							// actual x and y coordinates.
-							// printf("k %d count %d\n", k, cells[i][j].count);
-							double p_real_x = ((i-1) * cell_size) + particles.x[p];
-							double p_real_y = ((j-1) * cell_size) + particles.y[p];
-							double q_real_x = ((i+a-1) * cell_size) + particles.x[q];
-							double q_real_y = ((j+b-1) * cell_size) + particles.y[q];
-							
-							// calculate distance in x and y, then absolute distance
-							double dx = p_real_x - q_real_x;
-							double dy = p_real_y - q_real_y;
-							double r_2 = dx*dx + dy*dy;
-							
-							// if distance less than cut off, calculate force and 
-							// use this to calculate acceleration in each dimension
-							// calculate potential energy of each particle at the same time
-							if (r_2 < r_cut_off_2) {
-								double r_2_inv = 1.0 / r_2;
-								double r_6_inv = r_2_inv * r_2_inv * r_2_inv;
-								
-								double f = (48.0 * r_2_inv * r_6_inv * (r_6_inv - 0.5));
-
-								particles.ax[p] += f*dx;
-
-								particles.ay[p] += f*dy;
-
-
-								pot_energy += 4.0 * r_6_inv * (r_6_inv - 1.0) - Uc - Duc * (sqrt(r_2) - r_cut_off);
-							}
-						}
+				int p = cells[i][j].offset + k;
+
+				// the rest of the particles in the same cell
+				for (int l = k+1; l < cells[i][j].count; l++) {
+					int q = cells[i][j].offset + l;
+					pair_accel(p, q, particles.x[p] - particles.x[q], particles.y[p] - particles.y[q], &pot_energy);
+				}
+
+				for (int n = 0; n < 4; n++) {
+					int a = half_shell[n][0];
+					int b = half_shell[n][1];
+					for (int l = 0; l < cells[i+a][j+b].count; l++) {
+						int q = cells[i+a][j+b].offset + l;
+						double dx = particles.x[p] - ((a * cell_size) + particles.x[q]);
+						double dy = particles.y[p] - ((b * cell_size) + particles.y[q]);
+						pair_accel(p, q, dx, dy, &pot_energy);
 					}
 				}
 			}
 		}
 	}
 
-	// MPI_Allreduce(MPI_IN_PLACE, &pot_energy, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+	reverse_forces();
+	return pot_energy;
+}
 
-	// return the average potential energy (i.e. sum / number)
-	return pot_energy / num_particles_per_proc;
+/**
+ * @brief Calculate the accelerations (as comp_accel(0)) while the halo exchange started by
+ *        start_boundary() is in flight. The interior cells don't need the ghost cells, so they
+ *        are done first, keeping the exchange moving between rows; then the exchange is
+ *        finished and the edge cells are done.
+ *
+ * @param wait Set to the time spent waiting for the exchange to finish
+ * @return double The potential energy of the local particles (summed, not averaged)
+ */
+double comp_accel_overlap(double * wait) {
+	double pot_energy = 0.0;
+
+	for (int i = 2; i < sizei; i++) {
+		for (int j = 2; j < sizej; j++) {
+			cell_accel(i, j, &pot_energy);
+		}
+		progress_boundary();
+	}
+
+	*wait = finish_boundary();
+
+	for (int i = 1; i < sizei+1; i++) {
+		for (int j = 1; j < sizej+1; j++) {
+			if (i == 1 || i == sizei || j == 1 || j == sizej) {
+				cell_accel(i, j, &pot_energy);
+			}
+		}
+	}
+
+	return pot_energy;
 }
 
 /**
  * @brief This routine updates the velocity of each particle for half a time step and then 
  *        moves the particle for a whole time step
  * 
+ * @param depth The number of ghost layers to move as well
+ * @return double The largest distance (in x or y) that any particle moved
  */
-void move_particles() {
+double move_particles(int depth) {
+	double drift = 0.0;
+
 	// move all particles half a time step
-	for (int p = 0; p < num_particles_per_proc; p++) {
-		// update velocity to obtain v(t + Dt/2)
-		particles.vx[p_offset + p] += dth * particles.ax[p_offset + p];
-		particles.vy[p_offset + p] += dth * particles.ay[p_offset + p];
-
-		// update particle coordinates to p(t + Dt) (scaled to the cell_size)
-		particles.x[p_offset + p] += (dt * particles.vx[p_offset + p]);
-		particles.y[p_offset + p] += (dt * particles.vy[p_offset + p]);
+	for (int i = 1-depth; i < sizei+1+depth; i++) {
+		for (int j = 1-depth; j < sizej+1+depth; j++) {
+			for (int k = 0; k < cells[i][j].count; k++) {
+				int p = cells[i][j].offset + k;
+
+				// update velocity to obtain v(t + Dt/2)
+				particles.vx[p] += dth * particles.ax[p];
+				particles.vy[p] += dth * particles.ay[p];
+
+				// update particle coordinates to p(t + Dt) (scaled to the cell_size)
+				particles.x[p] += (dt * particles.vx[p]);
+				particles.y[p] += (dt * particles.vy[p]);
+
+				drift = fmax(drift, fabs(dt * particles.vx[p]));
+				drift = fmax(drift, fabs(dt * particles.vy[p]));
+			}
+		}
 	}
+
+	return drift;
 }
 
 /**
  * @brief This routine updates the cell lists. If a particles coordinates are not within a cell
  *        any more, this function calculates the cell it should be in and performs the move.
  *        If a particle moves more than 1 cell in any direction, this indicates poor settings
- *        and therefore an error is generated.
+ *        and therefore an error is generated. Particles that leave the subdomain are moved
+ *        into the (emptied) ghost layer, from where exchange_particles() sends them on.
  * 
+ * @param depth The number of ghost layers to update as well
  */
-void update_cells() {
+void update_cells(int depth) {
 	// move particles that need to move cell lists
-	for (int i = 1; i < sizei+1; i++) {
-		for (int j = 1; j < sizej+1; j++) {
-			// we have to store the next particle here, as the remove/add at the end may be destructive
-			
-			int cell_count = cells[i][j].count;
-			int * cell_part_ids = cells[i][j].part_ids;
-			for (int k = 0; k < cell_count; k++) {
-				int p = cell_part_ids[k];
+	for (int i = 1-depth; i < sizei+1+depth; i++) {
+		for (int j = 1-depth; j < sizej+1+depth; j++) {
+			// walk backwards, as remove_particle moves the last particle into the freed slot
+			for (int k = cells[i][j].count - 1; k >= 0; k--) {
+				int p = cells[i][j].offset + k;
 
 				// if a particles x or y value is greater than the cell size or less than 0, it must have moved cell
 				// do a quick check to make sure its not moved 2 cells (since this means our time step is too large, or something else is going wrong)
 				if ((particles.x[p] < 0.0) | (particles.x[p] >= cell_size) | (particles.y[p] < 0.0) | (particles.y[p] >= cell_size)) {
 					if ((particles.x[p] < (-cell_size)) || (particles.x[p] >= (2*cell_size)) || (particles.y[p] < (-cell_size)) || (particles.y[p] >= (2*cell_size))) {
 						fprintf(stderr, "A particle has moved more than one cell!\n");
-						exit(1);
+						MPI_Abort(MPI_COMM_WORLD, 1);
 					}
 
 					// work out whether we've moved a cell in the x and the y dimension
 					int x_shift = (particles.x[p] < 0.0) ? -1 : (particles.x[p] >= cell_size) ? +1 : 0;
 					int y_shift = (particles.y[p] < 0.0) ? -1 : (particles.y[p] >= cell_size) ? +1 : 0;
 					
-					// the new i and j are +/- 1 in each dimension,
-					// but if that means we go out of simulation bounds, wrap it to x and 1
+					// the new i and j are +/- 1 in each dimension (possibly a ghost cell)
 					int new_i = i+x_shift;
-					if (new_i == 0) { new_i = x; }
-					if (new_i == x+1) { new_i = 1; }
 					int new_j = j+y_shift;
-					if (new_j == 0) { new_j = y; }
-					if (new_j == y+1) { new_j = 1; }
+
 					// update x and y coordinates (i.e. remove the additional cell size)
 					particles.x[p] = particles.x[p] + (x_shift * -cell_size);
 					particles.y[p] = particles.y[p] + (y_shift * -cell_size);
 
-					// remove the particle from its current cell list, then add it to the new cell list
+					// add the particle to the new cell list, then remove it from its current cell list
+					add_particle(&(cells[new_i][new_j]), particles.x[p], particles.y[p], particles.vx[p], particles.vy[p],
+								 particles.ax[p], particles.ay[p], particles.id[p]);
 					remove_particle(&(cells[i][j]), k);
-					add_particle(&(cells[new_i][new_j]), p);
 				}
 			}
 		}
@@ -168,22 +347,33 @@ void update_cells() {
  *        half step, since its already done half a time step in the move_particles routine). Additionally, this
  *        function calculated the kinetic energy of the system.
  * 
- * @return double The kinetic energy
+ * @param depth The number of ghost layers to update as well
+ * @return double The kinetic energy of the local particles (summed, not averaged)
  */
-double update_velocity() {
+double update_velocity(int depth) {
 	double kinetic_energy = 0.0;
+	double ghost_energy = 0.0;
+
+	for (int i = 1-depth; i < sizei+1+depth; i++) {
+		for (int j = 1-depth; j < sizej+1+depth; j++) {
+			int local = (i >= 1) && (i <= sizei) && (j >= 1) && (j <= sizej);
+			double * energy = local ? &kinetic_energy : &ghost_energy;
+
+			for (int k = 0; k < cells[i][j].count; k++) {
+				int p = cells[i][j].offset + k;
 
-	for (int p = 0; p < num_particles_per_proc; p++) {
-		// update velocity again by half time to obtain v(t + Dt)
-		particles.vx[p_offset + p] += dth * particles.ax[p_offset + p];
-		particles.vy[p_offset + p] += dth * particles.ay[p_offset + p];
+				// update velocity again by half time to obtain v(t + Dt)
+				particles.vx[p] += dth * particles.ax[p];
+				particles.vy[p] += dth * particles.ay[p];
 
-		// calculate the kinetic energy by adding up the squares of the velocities in each dim
-		kinetic_energy += (particles.vx[p_offset + p] * particles.vx[p_offset + p]) + (particles.vy[p_offset + p] * particles.vy[p_offset + p]);
+				// calculate the kinetic energy by adding up the squares of the velocities in each dim
+				*energy += (particles.vx[p] * particles.vx[p]) + (particles.vy[p] * particles.vy[p]);
+			}
+		}
 	}
 
 	// KE = (1/2)mv^2
-	kinetic_energy *= (0.5 / num_particles_per_proc);
+	kinetic_energy *= 0.5;
 	return kinetic_energy;
 }
 
@@ -196,111 +386,148 @@ double update_velocity() {
  */
 int main(int argc, char *argv[]) {
 
-	MPI_Init(&argc, &argv);
+	// the --progress=thread helper makes MPI calls, but never at the same time as the main thread
+	int thread_support;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_SERIALIZED, &thread_support);
 	MPI_Comm_size(MPI_COMM_WORLD, &size);
 	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
-	int dims[2] = {0,0};
-	int periods[2] = {1,1};
-	int my_coords[2];
-
-	MPI_Dims_create(size, 2 , dims);
-	MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 0, &cart_comm);
-	
-	MPI_Cart_coords(cart_comm, rank, 2, my_coords);
-	
-	MPI_Cart_shift(cart_comm, 0, 1, &west_rank, &east_rank);
-   	MPI_Cart_shift(cart_comm, 1, 1, &south_rank, &north_rank);
-
-
 	// Set default parameters
 	set_defaults();
 	// parse the arguments
 	parse_args(argc, argv);
+	// a restart file sets the grid, the cell size, the cut off and the time step
+	if (restart_file[0] != '\0') read_restart_header(restart_file);
 	// call set up to update defaults
 	setup();
+	// split the cell grid over the ranks
+	setup_decomposition();
 
-	if (rank == 0 && verbose) print_opts();
-	
-	// calculate the start and end indicies for parallel processors
-
-	// calculated the size of the used portion of the array on each parallel processor
-    sizej = x/dims[0];
+	if (progress_mode == PROGRESS_THREAD && thread_support < MPI_THREAD_SERIALIZED) {
+		if (rank == 0) fprintf(stderr, "Error: --progress=thread needs an MPI library with MPI_THREAD_SERIALIZED support.\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
 
-	// calculated the size of the used portion of the array on each parallel processor
-    sizei = y/dims[1];
+	if (rank == 0 && verbose) print_opts();
 	
 	double time = get_time();
 
-	// set up problem
-	problem_setup();
-	// apply boundary condition (i.e. update pointers on the boundarys to loop periodically)
-	// printf("n %d\n", num_particles_per_proc);
-	// printf("before boundary\n");
+	int iters = 0;
+	double t = 0.0;
+
+	// set up problem (or carry on from where a restart file left off)
+	if (restart_file[0] != '\0') {
+		read_restart(restart_file, &iters, &t);
+	} else {
+		problem_setup();
+	}
+	setup_halo();
+	// apply boundary condition (i.e. fill the ghost cells from the neighbouring ranks)
 	apply_boundary();
-	// printf("after boundary\n");
-	
-	comp_accel();
 
-	double potential_energy = 0.0;
-	double kinetic_energy = 0.0;
+	// with a deeper ghost region, the ghost particles are integrated too (all but the outermost
+	// layer, whose neighbours aren't known), so it only has to be refilled every ghost_interval steps
+	int ghost_work = (ghost_interval > 1) ? ghost_depth - 1 : 0;
 
-	int iters = 0;
-	double t;
-	for (t = 0.0; t < t_end; t+=dt, iters++) {
-		// move particles half a time step
-		move_particles();
+	comp_accel(ghost_work);
 
-		// update cell lists (i.e. move any particles between cell lists if required)
-		update_cells();
+	double potential_energy = 0.0;
+	double kinetic_energy = 0.0;
 
-		// update pointers (because the previous operation might break boundary cell lists)
-		apply_boundary();
+	phase_mark = get_time();
+	for (; t < t_end; t+=dt, iters++) {
+		if (ghost_refill_due()) {
+			// move particles half a time step
+			move_particles(0);
+			lap(PHASE_MOVE);
+
+			// update cell lists (i.e. move any particles between cell lists if required)
+			clear_ghosts();
+			update_cells(0);
+			lap(PHASE_CELLS);
+
+			// send particles that have left the subdomain to their new owner
+			exchange_particles();
+			lap(PHASE_MIGRATE);
+
+			// update ghost cells (because the previous operation might break boundary cell lists).
+			// With --progress this only starts the exchange, which finishes in comp_accel_overlap()
+			start_boundary();
+			lap(PHASE_HALO);
+		} else {
+			// integrate the ghost region locally, rather than refilling it
+			double drift = move_particles(ghost_work);
+			lap(PHASE_MOVE);
+			update_cells(ghost_work);
+			advance_ghost_region(drift);
+			lap(PHASE_CELLS);
+		}
 		
 		// compute acceleration for each particle and calculate potential energy
-		potential_energy = comp_accel();
+		double force_time = get_time();
+		double halo_wait = 0.0;
+		if (progress_mode != PROGRESS_OFF) {
+			potential_energy = comp_accel_overlap(&halo_wait);
+		} else if (newton) {
+			potential_energy = comp_accel_half();
+		} else {
+			potential_energy = comp_accel(ghost_work);
+		}
+		record_force_time(get_time() - force_time - halo_wait);
+		lap(PHASE_FORCE);
+		phase_time[PHASE_FORCE] -= halo_wait;
+		phase_time[PHASE_HALO] += halo_wait;
 
 		// update velocity based on the acceleration and calculate the kinetic energy
-		kinetic_energy = update_velocity();
+		kinetic_energy = update_velocity(ghost_work);
+		lap(PHASE_VELOCITY);
 	
 		if (iters % output_freq == 0) {
-			// calculate temperature and total energy
-			MPI_Allreduce(MPI_IN_PLACE, &potential_energy, 1, MPI_DOUBLE, MPI_SUM, cart_comm);
-			MPI_Allreduce(MPI_IN_PLACE, &kinetic_energy, 1, MPI_DOUBLE, MPI_SUM, cart_comm);
-
-			double total_energy = kinetic_energy + potential_energy;
-			double temp = kinetic_energy * 2.0 / 3.0;
-			
-			if(rank == 0) {
-				printf("Step %8d, Time: %14.8e (dt: %14.8e), Total energy: %14.8e (p:%14.8e,k:%14.8e), Temp: %14.8e\n", iters, t+dt, dt, total_energy, potential_energy, kinetic_energy, temp);
-			}
+			// start reducing the energies (they are printed once the reduction completes)
+			start_diagnostics(iters, t+dt, potential_energy, kinetic_energy);
  
 			// if output is enabled and checkpointing is enabled, write out
-            if ((!no_output) && (enable_checkpoints))
+            if ((!no_output) && (enable_checkpoints)) {
                 write_checkpoint(iters, t+dt);
+                write_restart_checkpoint(iters, t+dt);
+            }
+		} else {
+			test_diagnostics();
 		}
+		lap(PHASE_OUTPUT);
+
+		// move the subdomain boundaries if the force calculation has become unbalanced
+		load_balance(iters);
+		lap(PHASE_BALANCE);
 	}
 
+	stop_progress_helper();
+	finish_diagnostics();
+	if (verbose) print_halo_stats();
+
 	// calculate the final energy and write out a final status message
-	MPI_Allreduce(MPI_IN_PLACE, &potential_energy, 1, MPI_DOUBLE, MPI_SUM, cart_comm);
-	MPI_Allreduce(MPI_IN_PLACE, &kinetic_energy, 1, MPI_DOUBLE, MPI_SUM, cart_comm);
-	double final_energy = kinetic_energy + potential_energy;
+	double energy[2] = {potential_energy, kinetic_energy};
+	MPI_Allreduce(MPI_IN_PLACE, energy, 2, MPI_DOUBLE, MPI_SUM, cart_comm);
+	double final_energy = (energy[0] + energy[1]) / num_particles_total;
 	
 	if (rank == 0) {
 		printf("Step %8d, Time: %14.8e, Final energy: %14.8e\n", iters, t, final_energy);
 		printf("Simulation complete.\n");
+		if (verbose) print_energy_drift(final_energy);
 
 		time = get_time() - time;
 		printf("Total time: %14.8lf seconds\n", time);
-		// if output is enabled, write the mesh file and the final state
-		if (!no_output) {
-			write_mesh();
-			write_result(iters, t);
-		}
+	}
+	if (timings) print_timings();
+
+	// if output is enabled, write the mesh file and the final state (which every rank writes a part of)
+	if (!no_output) {
+		if (rank == 0) write_mesh();
+		write_result(iters, t);
+		if (enable_checkpoints) write_restart_result(iters, t);
 	}
 
 	MPI_Finalize();	
 
 	return 0;
 }
-
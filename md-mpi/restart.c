@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "args.h"
+#include "data.h"
+#include "restart.h"
+
+char restart_file[1024] = "";
+
+char restart_checkpoint_basename[1024];
+char restart_result_filename[1024];
+
+// the header of the file being resumed from
+static struct restart_header restart;
+
+/**
+ * @brief Set the basename for restart files (which sit alongside the VTK output)
+ *
+ * @param base Basename string
+ */
+void set_restart_basename(char * base) {
+	sprintf(restart_checkpoint_basename, "%s-%%d.rst", base);
+	sprintf(restart_result_filename, "%s.rst", base);
+}
+
+/**
+ * @brief Set a file view made of count blocks of etype, so that a rank can read or write all of
+ *        its (non-contiguous) rows with a single collective call
+ *
+ * @param fh The file
+ * @param start The offset the blocks are relative to
+ * @param etype The type of each element
+ * @param count The number of blocks
+ * @param lengths The number of elements in each block
+ * @param displs The offset of each block in bytes (in increasing order)
+ */
+static void set_blocks_view(MPI_File fh, MPI_Offset start, MPI_Datatype etype, int count, int * lengths, MPI_Aint * displs) {
+	MPI_Datatype filetype;
+	MPI_Type_create_hindexed(count, lengths, displs, etype, &filetype);
+	MPI_Type_commit(&filetype);
+	MPI_File_set_view(fh, start, etype, filetype, "native", MPI_INFO_NULL);
+	MPI_Type_free(&filetype);
+}
+
+/**
+ * @brief Write a restart checkpoint (with the iteration number in the filename)
+ *
+ * @param iters The iteration that has just been completed
+ * @param t The simulation time at the end of it
+ * @return int Return whether the write was successful
+ */
+int write_restart_checkpoint(int iters, double t) {
+	char filename[1024];
+	sprintf(filename, restart_checkpoint_basename, iters);
+
+	double write_time = MPI_Wtime();
+	// a resumed run carries on from the next step
+	int err = write_restart(filename, iters + 1, t);
+	write_time = MPI_Wtime() - write_time;
+	if (rank == 0 && verbose && err == 0) {
+		printf("Step %8d, wrote %s in %.4f seconds\n", iters, filename, write_time);
+	}
+	return err;
+}
+
+/**
+ * @brief Write the final state to a restart file
+ *
+ * @param iters The number of iterations taken
+ * @param t The simulation time
+ * @return int Return whether the write was successful
+ */
+int write_restart_result(int iters, double t) {
+	return write_restart(restart_result_filename, iters, t);
+}
+
+/**
+ * @brief Write out a restart file in parallel. The particles are sorted by global cell, so
+ *        each local row of cells is one contiguous block of the file. The start of each row
+ *        comes from an MPI_Allreduce of the per-row totals and an MPI_Exscan over the ranks
+ *        sharing those rows, and every rank then writes its part of the index and its
+ *        particles with one collective call each. This is collective over cart_comm.
+ *
+ * @param filename The filename to use for output
+ * @param iters The number of iterations taken
+ * @param t The simulation time
+ * @return int Return whether the write was successful
+ */
+int write_restart(char * filename, int iters, double t) {
+	long long * row_count = calloc(sizei, sizeof(long long));
+	long long * row_before = calloc(sizei, sizeof(long long));
+	long long * row_start = calloc(x, sizeof(long long));
+
+	long long num_local = 0;
+	for (int i = 1; i < sizei+1; i++) {
+		for (int j = 1; j < sizej+1; j++) {
+			row_count[i-1] += cells[i][j].count;
+		}
+		row_start[starti+i-1] = row_count[i-1];
+		num_local += row_count[i-1];
+	}
+
+	// the particles in the same rows on the ranks before this one in y
+	int remain[2] = {0, 1};
+	MPI_Comm row_comm;
+	MPI_Cart_sub(cart_comm, remain, &row_comm);
+	MPI_Exscan(row_count, row_before, sizei, MPI_LONG_LONG, MPI_SUM, row_comm);
+	MPI_Comm_free(&row_comm);
+	if (coords[1] == 0) {
+		// MPI_Exscan leaves the first rank's result undefined
+		memset(row_before, 0, sizeof(long long) * sizei);
+	}
+
+	// the particles in every global row, turned into the first particle of every row
+	MPI_Allreduce(MPI_IN_PLACE, row_start, x, MPI_LONG_LONG, MPI_SUM, cart_comm);
+	long long num_total = 0;
+	for (int gi = 0; gi < x; gi++) {
+		long long count = row_start[gi];
+		row_start[gi] = num_total;
+		num_total += count;
+	}
+
+	int64_t * index = malloc(sizeof(int64_t) * sizei * sizej);
+	struct restart_particle * records = malloc(sizeof(struct restart_particle) * (num_local > 0 ? num_local : 1));
+	int * index_lengths = malloc(sizeof(int) * sizei);
+	int * record_lengths = malloc(sizeof(int) * sizei);
+	MPI_Aint * index_displs = malloc(sizeof(MPI_Aint) * sizei);
+	MPI_Aint * record_displs = malloc(sizeof(MPI_Aint) * sizei);
+
+	struct restart_particle * record = records;
+	for (int i = 1; i < sizei+1; i++) {
+		int gi = starti + i - 1;
+		int64_t next = row_start[gi] + row_before[i-1];
+
+		index_lengths[i-1] = sizej;
+		index_displs[i-1] = (((MPI_Aint) gi * y) + startj) * sizeof(int64_t);
+		record_lengths[i-1] = row_count[i-1];
+		record_displs[i-1] = next * sizeof(struct restart_particle);
+
+		for (int j = 1; j < sizej+1; j++) {
+			int gj = startj + j - 1;
+			index[((i-1) * sizej) + (j-1)] = next;
+			next += cells[i][j].count;
+
+			for (int k = 0; k < cells[i][j].count; k++) {
+				int p = cells[i][j].offset + k;
+				record->id = particles.id[p];
+				record->x = (gi * cell_size) + particles.x[p];
+				record->y = (gj * cell_size) + particles.y[p];
+				record->vx = particles.vx[p];
+				record->vy = particles.vy[p];
+				record->ax = particles.ax[p];
+				record->ay = particles.ay[p];
+				record++;
+			}
+		}
+	}
+
+	struct restart_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RESTART_MAGIC, sizeof(header.magic));
+	header.version = RESTART_VERSION;
+	header.x = x;
+	header.y = y;
+	header.num_part_per_dim = num_part_per_dim;
+	header.step = iters;
+	header.seed = seed;
+	header.num_particles = num_total;
+	header.cell_size = cell_size;
+	header.r_cut_off = r_cut_off;
+	header.dt = dt;
+	header.t = t;
+
+	MPI_Offset index_start = sizeof(header);
+	MPI_Offset records_start = index_start + ((((MPI_Offset) x * y) + 1) * sizeof(int64_t));
+
+	int err = 0;
+	MPI_File fh;
+	if (MPI_File_open(cart_comm, filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+		if (rank == 0) fprintf(stderr, "Error: could not open %s for writing\n", filename);
+		err = -1;
+	} else {
+		MPI_File_set_size(fh, 0);
+
+		// rank 0 writes the header and the end of the index (i.e. the total)
+		if (rank == 0) {
+			int64_t index_end = num_total;
+			MPI_File_write_at(fh, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE);
+			MPI_File_write_at(fh, records_start - sizeof(int64_t), &index_end, 1, MPI_INT64_T, MPI_STATUS_IGNORE);
+		}
+
+		MPI_Datatype record_type;
+		MPI_Type_contiguous(sizeof(struct restart_particle), MPI_BYTE, &record_type);
+		MPI_Type_commit(&record_type);
+
+		set_blocks_view(fh, index_start, MPI_INT64_T, sizei, index_lengths, index_displs);
+		MPI_File_write_all(fh, index, sizei * sizej, MPI_INT64_T, MPI_STATUS_IGNORE);
+		set_blocks_view(fh, records_start, record_type, sizei, record_lengths, record_displs);
+		MPI_File_write_all(fh, records, num_local, record_type, MPI_STATUS_IGNORE);
+
+		MPI_Type_free(&record_type);
+		MPI_File_close(&fh);
+	}
+
+	free(row_count);
+	free(row_before);
+	free(row_start);
+	free(index);
+	free(records);
+	free(index_lengths);
+	free(record_lengths);
+	free(index_displs);
+	free(record_displs);
+	return err;
+}
+
+/**
+ * @brief Read the header of a restart file, and take the grid, the cell size, the cut off and
+ *        the time step from it. This has to be called before setup(), and is collective over
+ *        MPI_COMM_WORLD.
+ *
+ * @param filename The restart file
+ */
+void read_restart_header(char * filename) {
+	MPI_File fh;
+	if (MPI_File_open(MPI_COMM_WORLD, filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+		if (rank == 0) fprintf(stderr, "Error: could not open %s for reading\n", filename);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	MPI_File_read_at_all(fh, 0, &restart, sizeof(restart), MPI_BYTE, MPI_STATUS_IGNORE);
+	MPI_File_close(&fh);
+
+	if (memcmp(restart.magic, RESTART_MAGIC, sizeof(restart.magic)) != 0 || restart.version != RESTART_VERSION) {
+		if (rank == 0) fprintf(stderr, "Error: %s is not a version %d restart file\n", filename, RESTART_VERSION);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	if (restart.t >= t_end) {
+		if (rank == 0) fprintf(stderr, "Error: %s is already at time %lf, increase --endtime\n", filename, restart.t);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	x = restart.x;
+	y = restart.y;
+	num_part_per_dim = restart.num_part_per_dim;
+	seed = restart.seed;
+	cell_size = restart.cell_size;
+	r_cut_off = restart.r_cut_off;
+	dt = restart.dt;
+}
+
+/**
+ * @brief Fill the local cells from a restart file, which can have been written by any number
+ *        of ranks. Each rank reads the index entries of its own rows, and then the particles
+ *        of its own cells (one contiguous block per row) with a single collective read, so
+ *        nothing outside the subdomain is read. This is collective over cart_comm.
+ *
+ * @param filename The restart file
+ * @param iters Set to the number of iterations already taken
+ * @param t Set to the simulation time
+ */
+void read_restart(char * filename, int * iters, double * t) {
+	alloc_cells();
+	num_particles_total = restart.num_particles;
+
+	MPI_File fh;
+	if (MPI_File_open(cart_comm, filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+		if (rank == 0) fprintf(stderr, "Error: could not open %s for reading\n", filename);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	MPI_Offset index_start = sizeof(restart);
+	MPI_Offset records_start = index_start + ((((MPI_Offset) x * y) + 1) * sizeof(int64_t));
+
+	// the index entries of each local row, and then the entry after each row (where it ends).
+	// These are read separately, as a row's end is the next row's start if it spans the grid
+	int width = sizej + 1;
+	int64_t * index = malloc(sizeof(int64_t) * sizei * width);
+	int64_t * row_end = malloc(sizeof(int64_t) * sizei);
+	int * lengths = malloc(sizeof(int) * sizei);
+	MPI_Aint * displs = malloc(sizeof(MPI_Aint) * sizei);
+	for (int i = 1; i < sizei+1; i++) {
+		int gi = starti + i - 1;
+		lengths[i-1] = sizej;
+		displs[i-1] = (((MPI_Aint) gi * y) + startj) * sizeof(int64_t);
+	}
+	set_blocks_view(fh, index_start, MPI_INT64_T, sizei, lengths, displs);
+	MPI_File_read_all(fh, index, sizei * sizej, MPI_INT64_T, MPI_STATUS_IGNORE);
+	for (int i = 1; i < sizei+1; i++) {
+		lengths[i-1] = 1;
+		displs[i-1] += sizej * sizeof(int64_t);
+	}
+	set_blocks_view(fh, index_start, MPI_INT64_T, sizei, lengths, displs);
+	MPI_File_read_all(fh, row_end, sizei, MPI_INT64_T, MPI_STATUS_IGNORE);
+
+	// spread the rows out, so every row has its end after it
+	for (int i = sizei; i >= 1; i--) {
+		memmove(&index[(i-1) * width], &index[(i-1) * sizej], sizeof(int64_t) * sizej);
+		index[((i-1) * width) + sizej] = row_end[i-1];
+	}
+
+	long long num_local = 0;
+	for (int i = 1; i < sizei+1; i++) {
+		int64_t * row = &index[(i-1) * width];
+		lengths[i-1] = row[sizej] - row[0];
+		displs[i-1] = row[0] * sizeof(struct restart_particle);
+		num_local += lengths[i-1];
+	}
+
+	MPI_Datatype record_type;
+	MPI_Type_contiguous(sizeof(struct restart_particle), MPI_BYTE, &record_type);
+	MPI_Type_commit(&record_type);
+
+	struct restart_particle * records = malloc(sizeof(struct restart_particle) * (num_local > 0 ? num_local : 1));
+	set_blocks_view(fh, records_start, record_type, sizei, lengths, displs);
+	MPI_File_read_all(fh, records, num_local, record_type, MPI_STATUS_IGNORE);
+
+	MPI_Type_free(&record_type);
+	MPI_File_close(&fh);
+
+	// positions are stored in absolute terms, so make them relative to their cell again
+	struct restart_particle * record = records;
+	for (int i = 1; i < sizei+1; i++) {
+		int gi = starti + i - 1;
+		int64_t * row = &index[(i-1) * width];
+		for (int j = 1; j < sizej+1; j++) {
+			int gj = startj + j - 1;
+			for (int64_t k = row[j-1]; k < row[j]; k++) {
+				add_particle(&(cells[i][j]), record->x - (gi * cell_size), record->y - (gj * cell_size),
+							 record->vx, record->vy, record->ax, record->ay, (int) record->id);
+				record++;
+			}
+		}
+	}
+
+	*iters = restart.step;
+	*t = restart.t;
+
+	free(index);
+	free(row_end);
+	free(lengths);
+	free(displs);
+	free(records);
+}
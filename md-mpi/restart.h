@@ -0,0 +1,40 @@
+#ifndef RESTART_H
+#define RESTART_H
+#include <stdint.h>
+
+// a restart file is a header, then an index holding the first particle of every global cell
+// (in global cell order, plus the total at the end), then the particles sorted by global cell.
+// Everything is stored in the byte order of the machine that wrote it.
+#define RESTART_MAGIC "MDMPIRST"
+#define RESTART_VERSION 1
+
+struct restart_header {
+	char magic[8];
+	int32_t version;
+	int32_t x, y;
+	int32_t num_part_per_dim;
+	int64_t step; // the number of steps taken
+	int64_t seed;
+	int64_t num_particles;
+	double cell_size, r_cut_off, dt, t;
+};
+
+// a particle, with its absolute position
+struct restart_particle {
+	int64_t id;
+	double x, y;
+	double vx, vy;
+	double ax, ay;
+};
+
+// the restart file to resume from (empty to start from scratch)
+extern char restart_file[1024];
+
+void set_restart_basename(char * base);
+int write_restart_checkpoint(int iters, double t);
+int write_restart_result(int iters, double t);
+int write_restart(char * filename, int iters, double t);
+void read_restart_header(char * filename);
+void read_restart(char * filename, int * iters, double * t);
+
+#endif
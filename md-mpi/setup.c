@@ -3,8 +3,13 @@
 #include <math.h>
 #include <stdio.h> 
 
+#include "args.h"
+#include "boundary.h"
+#include "decomp.h"
 #include "setup.h"
 #include "data.h"
+#include "restart.h"
+#include "rng.h"
 #include "vtk.h"
 
 /**
@@ -22,8 +27,6 @@ void set_defaults() {
  * 
  */
 void setup() {
-	srand(seed);
-
 	r_cut_off_2 = r_cut_off * r_cut_off;
 	r_cut_off_2_inv = 1.0 / r_cut_off_2;
 	r_cut_off_6_inv = r_cut_off_2_inv * r_cut_off_2_inv * r_cut_off_2_inv;
@@ -31,104 +34,149 @@ void setup() {
 	Uc = 4.0 * r_cut_off_6_inv * (r_cut_off_6_inv - 1.0);
 	Duc = -48 * r_cut_off_6_inv * (r_cut_off_6_inv - 0.5) / r_cut_off;
 
-	dt = t_end / niters;
+	// a restart carries on with the time step it was written with
+	if (restart_file[0] == '\0') {
+		dt = t_end / niters;
+	}
 	dth = dt / 2.0;
+
+	if (cell_capacity <= 0) {
+		cell_capacity = 4 * num_part_per_dim * num_part_per_dim;
+	}
+
+	// these depend on the cell size and cut off, which a restart file may have replaced
+	if (r_cut_off > cell_size) {
+		if (rank == 0) fprintf(stderr, "Error: The cell size must be greater than or equal to the cut off distance.\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	if (ghost_depth > 0 && ghost_depth < min_ghost_depth()) {
+		if (rank == 0) fprintf(stderr, "Error: A ghost interval of %d needs at least %d ghost layers (enough for %d cut offs, plus one for the distance the particles move).\n",
+				ghost_interval, min_ghost_depth(), ghost_interval);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	if (ghost_depth <= 0) {
+		ghost_depth = min_ghost_depth();
+	}
+}
+
+/**
+ * @brief Get the shallowest ghost region that works with the ghost interval: enough layers for
+ *        the forces to stay exact for ghost_interval steps, plus one for the distance the
+ *        particles drift in that time (see advance_ghost_region())
+ *
+ * @return int The number of ghost layers
+ */
+int min_ghost_depth() {
+	return (int) ceil((ghost_interval * r_cut_off) / cell_size) + ((ghost_interval > 1) ? 1 : 0);
+}
+
+/**
+ * @brief Set up the Cartesian decomposition of the cell grid. The ranks are arranged on a
+ *        periodic 2D grid (shaped to suit the cell grid, see create_cart_comm()) and each
+ *        rank gets an (initially even) block of cells.
+ *
+ */
+void setup_decomposition() {
+	create_cart_comm();
+
+	MPI_Comm_rank(cart_comm, &rank);
+	MPI_Cart_coords(cart_comm, rank, 2, coords);
+
+	MPI_Cart_shift(cart_comm, 0, 1, &west_rank, &east_rank);
+	MPI_Cart_shift(cart_comm, 1, 1, &south_rank, &north_rank);
+
+	// group the ranks that can share memory, for halos between on-node neighbours
+	if (halo_mode == HALO_SHM) {
+		MPI_Comm_split_type(cart_comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node_comm);
+		cells_window = CELLS_SHARED;
+	} else if (halo_mode == HALO_RMA) {
+		cells_window = CELLS_RMA;
+	}
+
+	// every rank needs at least as many cells as its neighbours' ghost regions are deep
+	if (x < dims[0] * ghost_depth || y < dims[1] * ghost_depth) {
+		if (rank == 0) fprintf(stderr, "Error: a %d x %d grid cannot be split over %d x %d ranks with %d ghost layers.\n", x, y, dims[0], dims[1], ghost_depth);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	bounds_x = malloc(sizeof(int) * (dims[0]+1));
+	bounds_y = malloc(sizeof(int) * (dims[1]+1));
+	for (int c = 0; c <= dims[0]; c++) {
+		bounds_x[c] = (int) (((long) c * x) / dims[0]);
+	}
+	for (int c = 0; c <= dims[1]; c++) {
+		bounds_y[c] = (int) (((long) c * y) / dims[1]);
+	}
+
+	starti = bounds_x[coords[0]];
+	sizei = bounds_x[coords[0]+1] - starti;
+	startj = bounds_y[coords[1]];
+	sizej = bounds_y[coords[1]+1] - startj;
 }
 
 /**
  * @brief Set up the problem space, initialise the cells to contain particles,
  *        set the particles to exist on a regular lattice, set their velocities
  *        to be consistent with the initial temperature, but in random orientation.
+ *        Each rank only creates the particles in its own cells; particle ids are
+ *        global, and numbered in the same order as the serial application.
  * 
  */
 void problem_setup() {
-	
 	// Create a grid of cell lists
-	cells = alloc_2d_cell_list_array(sizei+2, sizej+2);
+	alloc_cells();
 
 	num_particles_total = x * y * num_part_per_dim * num_part_per_dim;
-	num_particles_per_proc = num_particles_total / size;
-	
-	particles.x = malloc(sizeof(double) * num_particles_total);
-	particles.y = malloc(sizeof(double) * num_particles_total);
-	particles.ax = malloc(sizeof(double) * num_particles_total);
-	particles.ay = malloc(sizeof(double) * num_particles_total);
-	particles.vx = malloc(sizeof(double) * num_particles_total);
-	particles.vy = malloc(sizeof(double) * num_particles_total);
-	
-	temp_part_x = malloc(sizeof(double) * num_particles_total);
-	temp_part_y = malloc(sizeof(double) * num_particles_total);
-	temp_part_ax = malloc(sizeof(double) * num_particles_total);
-	temp_part_ay = malloc(sizeof(double) * num_particles_total);
-	temp_part_vx = malloc(sizeof(double) * num_particles_total);
-	temp_part_vy = malloc(sizeof(double) * num_particles_total);
-
-	east_part_ids = malloc(sizeof(int)*sizei*2*num_part_per_dim*num_part_per_dim);
-	west_part_ids = malloc(sizeof(int)*sizei*2*num_part_per_dim*num_part_per_dim);
-	north_part_ids = malloc(sizeof(int)*(sizej+2)*2*num_part_per_dim*num_part_per_dim);
-	south_part_ids = malloc(sizeof(int)*(sizej+2)*2*num_part_per_dim*num_part_per_dim);
-
-	east_counts = malloc(sizeof(int)*sizei);
-	west_counts = malloc(sizeof(int)*sizei);
-	north_counts = malloc(sizeof(int)*(sizej+2));
-	south_counts = malloc(sizeof(int)*(sizej+2));
-
-	
-	for (int i = 0; i < sizei+2; i++) {
-		for (int j = 0; j < sizej+2; j++) {
-			cells[i][j].count = 0;
-			cells[i][j].size = 2 * num_part_per_dim * num_part_per_dim;
-			cells[i][j].part_ids = malloc(sizeof(int) * 2 * num_part_per_dim * num_part_per_dim);
-		}
-	}
+	int num_part_per_dim_2 = num_part_per_dim * num_part_per_dim;
 
-	double v_sum_x = 0.0;
-	double v_sum_y = 0.0;
+	// the momentum is summed in fixed point, so the total is the same on any number of ranks
+	long long v_sum[2*FIXED_SUM_WORDS] = {0};
 
 	// set the normalisation magnitude using the ideal gas law (T = mv^2 / 3)
 	double v_magnitude = sqrt(3.0 * init_temp);
 
-	int p_count = 0;
-	p_offset = rank * num_particles_per_proc;
-
 	for (int i = 1; i < sizei+1; i++) {
 		for (int j = 1; j < sizej+1; j++) {
+			int gi = starti + i - 1;
+			int gj = startj + j - 1;
 			for (int a = 0; a < num_part_per_dim; a++) {
 				for (int b = 0; b < num_part_per_dim; b++) {
+					int p_id = (gi*y*num_part_per_dim_2) + (gj*num_part_per_dim_2) + (a*num_part_per_dim) + b;
 					// set the particles x and y values within the current cell (on a lattice based on number of particles per cell, per dimension)
 					double part_x = 0.5 * (1.0 / num_part_per_dim) + ((double) a / num_part_per_dim);
 					double part_y = 0.5 * (1.0 / num_part_per_dim) + ((double) b / num_part_per_dim);
 
 					// generate random velocities for the particles, but make sure the overall magnitude is 1.0
-					// i.e. generate an angle between 0 and 2*PI then use cos and sin
-					double phi = (double) rand() * 2.0 * M_PI / RAND_MAX;
+					// i.e. generate an angle between 0 and 2*PI then use cos and sin. The angle only
+					// depends on the seed and the particle id, so it is the same however the work is split
+					double phi = rng_uniform(seed, p_id, 0) * 2.0 * M_PI;
 					double rand_vx = cos(phi);
 					double rand_vy = sin(phi);
 
-					// create the particle and add it to the current cell list.			
-					particles.x[p_offset + p_count] = part_x * cell_size;
-					particles.y[p_offset + p_count] = part_y * cell_size;
-					particles.vx[p_offset + p_count] = rand_vx * v_magnitude;
-					particles.vy[p_offset + p_count] = rand_vy * v_magnitude;
-					add_particle(&(cells[i][j]), p_count);
+					// create the particle and add it to the current cell list.
+					add_particle(&(cells[i][j]), part_x * cell_size, part_y * cell_size,
+								 rand_vx * v_magnitude, rand_vy * v_magnitude, 0.0, 0.0, p_id);
 
-					v_sum_x += particles.vx[p_offset + p_count];
-					v_sum_y += particles.vy[p_offset + p_count];
-
-					p_count++;
+					fixed_sum_add(&v_sum[0], rand_vx * v_magnitude);
+					fixed_sum_add(&v_sum[FIXED_SUM_WORDS], rand_vy * v_magnitude);
 				}
 			}	
 		}
 	}
 
-	MPI_Allreduce(MPI_IN_PLACE, &v_sum_x, 1, MPI_DOUBLE, MPI_SUM, cart_comm);
+	MPI_Allreduce(MPI_IN_PLACE, v_sum, 2*FIXED_SUM_WORDS, MPI_LONG_LONG, MPI_SUM, cart_comm);
 
 	// Normalise data to make sure that the total momentum is 0.0 at the start
-	double v_avg_x = v_sum_x / num_particles_total;
-	double v_avg_y = v_sum_y / num_particles_total;
+	double v_avg_x = fixed_sum_value(&v_sum[0]) / num_particles_total;
+	double v_avg_y = fixed_sum_value(&v_sum[FIXED_SUM_WORDS]) / num_particles_total;
 
-	for (int i = 0; i < num_particles_per_proc; i++) {
-		particles.vx[p_offset + i] -= v_avg_x;
-		particles.vy[p_offset + i] -= v_avg_y;
+	for (int i = 1; i < sizei+1; i++) {
+		for (int j = 1; j < sizej+1; j++) {
+			for (int k = 0; k < cells[i][j].count; k++) {
+				particles.vx[cells[i][j].offset + k] -= v_avg_x;
+				particles.vy[cells[i][j].offset + k] -= v_avg_y;
+			}
+		}
 	}
 }
@@ -5,6 +5,8 @@
 
 void set_defaults();
 void setup();
+int min_ghost_depth();
+void setup_decomposition();
 void problem_setup();
 
 #endif
\ No newline at end of file
@@ -1,17 +1,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <sys/un.h>
 
 #include "args.h"
 #include "data.h"
 #include "vtk.h"
+#include "checkpoint.h"
+#include "restart.h"
+#include "stream.h"
 
 int verbose = 0;
 int no_output = 0;
 int output_freq = 100;
 int enable_checkpoints = 0;
+int timings = 0;
+int vtk_format = VTK_BINARY;
+int zlib_level = 0;
+int static_fields = 0;
+int extended_output = 0;
+int async_checkpoints = CHECKPOINT_SYNC;
+int max_forks = 2;
 
 static struct option long_options[] = {
 	{"cellx",         required_argument, 0, 'x'},
@@ -27,11 +39,21 @@ static struct option long_options[] = {
 	{"noio",          no_argument,       0, 'n'},
 	{"output",        required_argument, 0, 'o'},
 	{"checkpoint",    no_argument,       0, 'c'},	
+	{"timings",       no_argument,       0, 'T'},
+	{"vtk-format",    required_argument, 0, 'F'},
+	{"zlib",          required_argument, 0, 'z'},
+	{"static-fields", no_argument,       0, 'S'},
+	{"extended",      no_argument,       0, 'E'},
+	{"async",         required_argument, 0, 'a'},
+	{"restart",       required_argument, 0, 'l'},
+	{"restart-freq",  required_argument, 0, 'R'},
+	{"stream",        required_argument, 0, 'W'},
+	{"forks",         required_argument, 0, 'k'},
     {"verbose",       no_argument,       0, 'v'},
     {"help",          no_argument,       0, 'h'},
 	{0, 0, 0, 0}
 };
-#define GETOPTS "x:y:p:s:r:t:i:d:f:e:no:cvh"
+#define GETOPTS "x:y:p:s:r:t:i:d:f:e:no:cTF:z:SEa:k:l:R:W:vh"
 
 /**
  * @brief Print a help message
@@ -55,6 +77,22 @@ void print_help(char *progname) {
 	fprintf(stderr, "  -n, --noio              Disable file I/O\n");
 	fprintf(stderr, "  -o FILE, --output=FILE  Set base filename for particle output (final output will be in BASENAME.vtp)\n");
 	fprintf(stderr, "  -c, --checkpoint        Enable checkpointing, checkpoints will be in BASENAME-ITERATION.vtp\n");
+	fprintf(stderr, "                          (with restart files in BASENAME-ITERATION.rst and BASENAME.rst)\n");
+	fprintf(stderr, "  -T, --timings           Print the time spent in each phase of the step (on one line, for scripts)\n");
+	fprintf(stderr, "  -F FMT, --vtk-format=FMT Set the encoding of particle output: binary (default, raw Float64),\n");
+	fprintf(stderr, "                          binary32 (raw Float32) or ascii (for debugging)\n");
+	fprintf(stderr, "  -z N, --zlib=N          Compress binary particle output with zlib at level N (1-9, 0 for none)\n");
+	fprintf(stderr, "  -S, --static-fields     Write the fields that don't change (the particle ids) once, to BASENAME-static.vtp,\n");
+	fprintf(stderr, "                          and write the particles of every other file in id order\n");
+	fprintf(stderr, "  -E, --extended          Add the velocity, acceleration, potential energy, virial and id of every\n");
+	fprintf(stderr, "                          particle to the particle output\n");
+	fprintf(stderr, "  -a MODE, --async=MODE   Write checkpoints while the simulation continues: thread (copy the state for\n");
+	fprintf(stderr, "                          a writer thread) or fork (write from a forked copy-on-write child process)\n");
+	fprintf(stderr, "  -k N, --forks=N         Set the most checkpoint processes that can run at once with --async=fork\n");
+	fprintf(stderr, "  -l FILE, --restart=FILE Resume from a restart file, up to --endtime\n");
+	fprintf(stderr, "  -R N, --restart-freq=N  Write a restart file with every N-th checkpoint (default 1, 0 for only the final state)\n");
+	fprintf(stderr, "  -W ADDR, --stream=ADDR  Stream a frame every output step to subscribers on unix:PATH or tcp:PORT (on\n");
+	fprintf(stderr, "                          localhost), dropping the oldest frames for subscribers that fall behind\n");
 	fprintf(stderr, "  -v, --verbose           Set verbose output\n");
 	fprintf(stderr, "  -h, --help              Print this message and exit\n");
 	fprintf(stderr, "\n");
@@ -112,6 +150,63 @@ void parse_args(int argc, char *argv[]) {
 			case 'c':
 				enable_checkpoints = 1;
 				break;
+			case 'T':
+				timings = 1;
+				break;
+			case 'F':
+				if (strcmp(optarg, "binary") == 0) {
+					vtk_format = VTK_BINARY;
+				} else if (strcmp(optarg, "binary32") == 0) {
+					vtk_format = VTK_BINARY32;
+				} else if (strcmp(optarg, "ascii") == 0) {
+					vtk_format = VTK_ASCII;
+				} else {
+					fprintf(stderr, "Error: Unknown VTK format '%s'.\n", optarg);
+					print_help(argv[0]);
+					exit(1);
+				}
+				break;
+			case 'z':
+				zlib_level = atoi(optarg);
+				break;
+			case 'S':
+				static_fields = 1;
+				break;
+			case 'E':
+				extended_output = 1;
+				break;
+			case 'a':
+				if (strcmp(optarg, "thread") == 0) {
+					async_checkpoints = CHECKPOINT_THREAD;
+				} else if (strcmp(optarg, "fork") == 0) {
+					async_checkpoints = CHECKPOINT_FORK;
+				} else {
+					fprintf(stderr, "Error: Unknown checkpoint mode '%s'.\n", optarg);
+					print_help(argv[0]);
+					exit(1);
+				}
+				break;
+			case 'k':
+				max_forks = atoi(optarg);
+				break;
+			case 'l':
+				strncpy(restart_file, optarg, sizeof(restart_file) - 1);
+				break;
+			case 'R':
+				restart_freq = atoi(optarg);
+				break;
+			case 'W':
+				if (strncmp(optarg, "unix:", 5) != 0 && strncmp(optarg, "tcp:", 4) != 0) {
+					fprintf(stderr, "Error: The stream address must be unix:PATH or tcp:PORT.\n");
+					print_help(argv[0]);
+					exit(1);
+				}
+				if (strlen(optarg) >= sizeof(stream_address) || (strncmp(optarg, "unix:", 5) == 0 && strlen(optarg + 5) >= sizeof(((struct sockaddr_un *) 0)->sun_path))) {
+					fprintf(stderr, "Error: The stream address is too long (a socket path can be at most %zu characters).\n", sizeof(((struct sockaddr_un *) 0)->sun_path) - 1);
+					exit(1);
+				}
+				strcpy(stream_address, optarg);
+				break;
 			case 'v':
 				verbose = 1;
 				break;
@@ -122,6 +217,30 @@ void parse_args(int argc, char *argv[]) {
         }
     }
 
+	if ((zlib_level < 0) || (zlib_level > 9)) {
+		fprintf(stderr, "Error: The zlib compression level must be between 0 and 9.\n");
+		print_help(argv[0]);
+		exit(1);
+	}
+
+	if ((zlib_level > 0) && (vtk_format == VTK_ASCII)) {
+		fprintf(stderr, "Error: Only binary particle output can be compressed.\n");
+		print_help(argv[0]);
+		exit(1);
+	}
+
+	if (restart_freq < 0) {
+		fprintf(stderr, "Error: The restart frequency can't be negative.\n");
+		print_help(argv[0]);
+		exit(1);
+	}
+
+	if (max_forks < 1) {
+		fprintf(stderr, "Error: At least one checkpoint process is needed.\n");
+		print_help(argv[0]);
+		exit(1);
+	}
+
 	if (r_cut_off > cell_size) {
 		fprintf(stderr, "Error: The cell size must be greater than or equal to the cut off distance.\n");
 		print_help(argv[0]);
@@ -148,5 +267,15 @@ void print_opts() {
 	printf("  noio             = %14d\n", no_output);
 	printf("  output           = %s\n", get_basename());
 	printf("  checkpoint       = %14d\n", enable_checkpoints);	
+	printf("  restart          = %s\n", restart_file);
+	printf("  restart-freq     = %14d\n", restart_freq);
+	printf("  stream           = %s\n", stream_address);
+	printf("  timings          = %14d\n", timings);
+	printf("  zlib             = %14d\n", zlib_level);
+	printf("  static-fields    = %14d\n", static_fields);
+	printf("  extended         = %14d\n", extended_output);
+	printf("  async            = %14s\n", (async_checkpoints == CHECKPOINT_THREAD) ? "thread" : (async_checkpoints == CHECKPOINT_FORK) ? "fork" : "off");
+	printf("  forks            = %14d\n", max_forks);
+	printf("  vtk-format       = %14s\n", (vtk_format == VTK_ASCII) ? "ascii" : (vtk_format == VTK_BINARY32) ? "binary32" : "binary");
     printf("=======================================\n");
 }
\ No newline at end of file
@@ -6,6 +6,13 @@ extern int no_output;
 extern int output_freq;
 extern int enable_checkpoints;
 extern int fixed_dt;
+extern int timings;
+extern int vtk_format;
+extern int zlib_level;
+extern int static_fields;
+extern int extended_output;
+extern int async_checkpoints;
+extern int max_forks;
 
 void parse_args(int argc, char *argv[]);
 void print_opts();
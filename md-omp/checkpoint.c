@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <omp.h>
+
+#include "checkpoint.h"
+#include "args.h"
+#include "data.h"
+#include "restart.h"
+#include "vtk.h"
+
+// a copy of the particle state at a checkpoint step (the fields that are written out, plus the velocities and
+// accelerations if a restart file is due). The cell lists point into part_ids, which holds the particle ids of every
+// cell back to back.
+struct snapshot {
+	int iters;
+	double t;
+	int restart;
+	char filename[1024];
+	struct cell_list ** cells;
+	int * part_ids;
+	struct particle_t particles;
+};
+
+static struct snapshot buffers[CHECKPOINT_BUFFERS];
+
+// snapshots are filled and written in turn, so the checkpoints are written in order.
+// queued is the number filled so far and written the number finished.
+static long queued, written;
+static int stopping;
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+
+// how long the simulation spent copying snapshots and waiting for a free buffer, and how
+// long the writer spent writing
+static double copy_time, stall_time, write_time;
+
+// the checkpoint processes still running with --async=fork (and what they are writing), and
+// the number that failed
+struct child {
+	pid_t pid;
+	int iters;
+	double t;
+};
+static struct child * running;
+static int children, failed_children;
+static long forked;
+
+/**
+ * @brief Reap finished checkpoint processes, waiting until no more than a given number are
+ *        still running
+ *
+ * @param most The most checkpoint processes that may still be running on return
+ */
+static void reap_children(int most) {
+	int status;
+	pid_t pid;
+	while (children > 0 && (pid = waitpid(-1, &status, (children > most) ? 0 : WNOHANG)) > 0) {
+		int c = 0;
+		while (c < children - 1 && running[c].pid != pid) {
+			c++;
+		}
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+			// the checkpoint is only added to the collection once it is complete
+			add_to_collection(running[c].iters, running[c].t);
+		} else {
+			failed_children++;
+		}
+		running[c] = running[--children];
+	}
+}
+
+/**
+ * @brief Fork a child process to write a checkpoint (and a restart file, if one is due). The
+ *        child writes the files from its copy-on-write view of the particles and cells and exits,
+ *        so the parent can carry on straight away without copying anything. If max_forks children are already running,
+ *        this waits for one of them to finish first.
+ *
+ * @param iters The current iteration number
+ * @param t The simulation time
+ */
+static void fork_checkpoint(int iters, double t) {
+	double start = omp_get_wtime();
+	reap_children(max_forks - 1);
+	double fork_start = omp_get_wtime();
+
+	// don't let the child inherit anything still waiting in the stdio buffers
+	fflush(NULL);
+	pid_t pid = fork();
+	if (pid == 0) {
+		char filename[1024];
+		sprintf(filename, get_basename(), iters);
+		// the child only has this thread (not the OpenMP thread pool), so it writes serially
+		int err = write_vtk_cells(filename, iters, t, cells, &particles, 1);
+		if (restart_due(iters) && write_restart_checkpoint(iters, t, cells, &particles) != 0) {
+			err = 1;
+		}
+		fflush(stdout);
+		_exit(err == 0 ? 0 : 1);
+	}
+
+	double end = omp_get_wtime();
+	if (pid < 0) {
+		perror("Error: could not fork a checkpoint process, writing it directly");
+		write_checkpoint(iters, t);
+		if (restart_due(iters)) write_restart_checkpoint(iters, t, cells, &particles);
+	} else {
+		running[children].pid = pid;
+		running[children].iters = iters;
+		running[children].t = t;
+		children++;
+		forked++;
+	}
+	stall_time += fork_start - start;
+	copy_time += end - fork_start;
+}
+
+/**
+ * @brief Get the particle fields that are written out (the positions, and everything else
+ *        written with --extended)
+ *
+ * @param parts The particles
+ * @param fields Set to the address of each field
+ * @return int The number of fields
+ */
+static int output_fields(struct particle_t * parts, double ** fields[8]) {
+	int n = 0;
+	fields[n++] = &parts->x;
+	fields[n++] = &parts->y;
+	if (extended_output) {
+		fields[n++] = &parts->vx;
+		fields[n++] = &parts->vy;
+		fields[n++] = &parts->ax;
+		fields[n++] = &parts->ay;
+		fields[n++] = &parts->energy;
+		fields[n++] = &parts->virial;
+	}
+	return n;
+}
+
+/**
+ * @brief Get the particle fields that are copied into a snapshot (the output fields, and the
+ *        velocities and accelerations as well if it is written to a restart file)
+ *
+ * @param parts The particles
+ * @param restart Whether the snapshot is written to a restart file
+ * @param fields Set to the address of each field
+ * @return int The number of fields
+ */
+static int snapshot_fields(struct particle_t * parts, int restart, double ** fields[8]) {
+	int n = output_fields(parts, fields);
+	if (restart && !extended_output) {
+		fields[n++] = &parts->vx;
+		fields[n++] = &parts->vy;
+		fields[n++] = &parts->ax;
+		fields[n++] = &parts->ay;
+	}
+	return n;
+}
+
+/**
+ * @brief The writer thread. Writes out each snapshot as it is queued, until stopped.
+ *
+ * @param arg Unused
+ * @return void* NULL
+ */
+static void * write_snapshots(void * arg) {
+	(void) arg;
+	pthread_mutex_lock(&lock);
+	while (1) {
+		while (written == queued && !stopping) {
+			pthread_cond_wait(&changed, &lock);
+		}
+		if (written == queued) {
+			break;
+		}
+		struct snapshot * snap = &buffers[written % CHECKPOINT_BUFFERS];
+		pthread_mutex_unlock(&lock);
+
+		// the simulation's threads are busy with the next steps, so the writer keeps to its own core
+		double start = omp_get_wtime();
+		if (write_vtk_cells(snap->filename, snap->iters, snap->t, snap->cells, &snap->particles, 1) == 0) {
+			add_to_collection(snap->iters, snap->t);
+		}
+		if (snap->restart) {
+			write_restart_checkpoint(snap->iters, snap->t, snap->cells, &snap->particles);
+		}
+		double end = omp_get_wtime();
+
+		pthread_mutex_lock(&lock);
+		write_time += end - start;
+		written++;
+		pthread_cond_broadcast(&changed);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/**
+ * @brief Allocate the snapshot buffers and start the writer thread (if checkpoints are
+ *        written by a thread). This must be called after problem_setup (as the buffers are
+ *        sized by the number of particles).
+ *
+ */
+void start_checkpoint_writer() {
+	if (async_checkpoints == CHECKPOINT_FORK) {
+		running = malloc(sizeof(struct child) * max_forks);
+		children = failed_children = 0;
+		forked = 0;
+		return;
+	}
+	for (int b = 0; b < CHECKPOINT_BUFFERS; b++) {
+		buffers[b].cells = alloc_2d_cell_list_array(x+2, y+2);
+		buffers[b].part_ids = malloc(sizeof(int) * num_particles);
+		double ** fields[8];
+		int num_fields = snapshot_fields(&buffers[b].particles, restart_freq > 0, fields);
+		for (int field = 0; field < num_fields; field++) {
+			*fields[field] = malloc(sizeof(double) * num_particles);
+		}
+	}
+	queued = written = 0;
+	stopping = 0;
+	if (pthread_create(&writer, NULL, write_snapshots, NULL) != 0) {
+		fprintf(stderr, "Error: could not start the checkpoint writer thread\n");
+		exit(1);
+	}
+}
+
+/**
+ * @brief Take a snapshot of the particle output fields and cell lists, and queue it to be written
+ *        to a checkpoint file (and a restart file, if one is due) by the writer thread. If every buffer is still waiting to be
+ *        written, this waits for the oldest one to finish first. With --async=fork the
+ *        checkpoint is written by a child process instead.
+ *
+ * @param iters The current iteration number
+ * @param t The simulation time
+ */
+void queue_checkpoint(int iters, double t) {
+	if (async_checkpoints == CHECKPOINT_FORK) {
+		fork_checkpoint(iters, t);
+		return;
+	}
+
+	double start = omp_get_wtime();
+	pthread_mutex_lock(&lock);
+	while (queued - written == CHECKPOINT_BUFFERS) {
+		pthread_cond_wait(&changed, &lock);
+	}
+	struct snapshot * snap = &buffers[queued % CHECKPOINT_BUFFERS];
+	pthread_mutex_unlock(&lock);
+	double copy_start = omp_get_wtime();
+
+	snap->iters = iters;
+	snap->t = t;
+	snap->restart = restart_due(iters);
+	sprintf(snap->filename, get_basename(), iters);
+	double ** from[8], ** to[8];
+	int num_fields = snapshot_fields(&particles, snap->restart, from);
+	snapshot_fields(&snap->particles, snap->restart, to);
+	for (int field = 0; field < num_fields; field++) {
+		memcpy(*to[field], *from[field], sizeof(double) * num_particles);
+	}
+	int offset = 0;
+	for (int i = 1; i < x+1; i++) {
+		for (int j = 1; j < y+1; j++) {
+			snap->cells[i][j].count = cells[i][j].count;
+			snap->cells[i][j].size = cells[i][j].count;
+			snap->cells[i][j].part_ids = snap->part_ids + offset;
+			memcpy(snap->cells[i][j].part_ids, cells[i][j].part_ids, sizeof(int) * cells[i][j].count);
+			offset += cells[i][j].count;
+		}
+	}
+
+	double end = omp_get_wtime();
+	pthread_mutex_lock(&lock);
+	stall_time += copy_start - start;
+	copy_time += end - copy_start;
+	queued++;
+	pthread_cond_broadcast(&changed);
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Wait for the writer thread to write out every queued snapshot, then stop it and
+ *        free the snapshot buffers (or wait for every checkpoint process to finish).
+ *
+ */
+void stop_checkpoint_writer() {
+	if (async_checkpoints == CHECKPOINT_FORK) {
+		double start = omp_get_wtime();
+		reap_children(0);
+		free(running);
+		double drain_time = omp_get_wtime() - start;
+		if (failed_children > 0) {
+			fprintf(stderr, "Error: %d of %ld checkpoint processes failed\n", failed_children, forked);
+		}
+		if (verbose) {
+			printf("Checkpoints: %ld written by child processes, forking %.6lf seconds, waiting for a process %.6lf seconds, waiting at the end %.6lf seconds\n", forked, copy_time, stall_time, drain_time);
+		}
+		return;
+	}
+
+	double start = omp_get_wtime();
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_cond_broadcast(&changed);
+	pthread_mutex_unlock(&lock);
+	pthread_join(writer, NULL);
+	double drain_time = omp_get_wtime() - start;
+
+	for (int b = 0; b < CHECKPOINT_BUFFERS; b++) {
+		free_2d_array((void **) buffers[b].cells);
+		free(buffers[b].part_ids);
+		double ** fields[8];
+		int num_fields = snapshot_fields(&buffers[b].particles, restart_freq > 0, fields);
+		for (int field = 0; field < num_fields; field++) {
+			free(*fields[field]);
+		}
+	}
+
+	if (verbose) {
+		printf("Checkpoints: %ld written in the background (%.6lf seconds), copying %.6lf seconds, waiting for a buffer %.6lf seconds, waiting at the end %.6lf seconds\n", written, write_time, copy_time, stall_time, drain_time);
+	}
+}
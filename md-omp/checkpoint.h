@@ -0,0 +1,18 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+// how checkpoints are written
+enum checkpoint_mode {
+	CHECKPOINT_SYNC,   // by the main thread, stopping the simulation
+	CHECKPOINT_THREAD, // from a snapshot, by a writer thread
+	CHECKPOINT_FORK    // by a forked child process, from its copy-on-write view of memory
+};
+
+// the number of snapshots that can be waiting for (or being written by) the writer thread
+#define CHECKPOINT_BUFFERS 2
+
+void start_checkpoint_writer();
+void queue_checkpoint(int iters, double t);
+void stop_checkpoint_writer();
+
+#endif
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "stream.h"
+
+/**
+ * @brief Print a help message
+ *
+ * @param progname The name of the current application
+ */
+void print_help(char *progname) {
+	fprintf(stderr, "A reference consumer for the frames streamed by md --stream.\n\n");
+	fprintf(stderr, "Usage: %s [options] ADDR\n", progname);
+	fprintf(stderr, "Options and arguments:\n");
+	fprintf(stderr, "  ADDR                    The stream address, unix:PATH or tcp:PORT\n");
+	fprintf(stderr, "  -e N                    Only receive every N-th frame\n");
+	fprintf(stderr, "  -f FIELDS               Receive these fields as well as the positions (a comma separated list of\n");
+	fprintf(stderr, "                          velocity, acceleration, energy and id)\n");
+	fprintf(stderr, "  -n N                    Stop after N frames\n");
+	fprintf(stderr, "  -s MS                   Wait MS milliseconds after each frame (to act as a slow consumer)\n");
+	fprintf(stderr, "  -h                      Print this message and exit\n");
+}
+
+/**
+ * @brief Connect to the stream
+ *
+ * @param address The stream address
+ * @return int The socket (or -1 if the connection failed)
+ */
+static int connect_stream(char * address) {
+	int fd;
+	if (strncmp(address, "unix:", 5) == 0) {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strlen(address + 5) >= sizeof(addr.sun_path)) {
+			fprintf(stderr, "Error: The socket path is too long (it can be at most %zu characters).\n", sizeof(addr.sun_path) - 1);
+			exit(1);
+		}
+		memcpy(addr.sun_path, address + 5, strlen(address + 5) + 1);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+			close(fd);
+			return -1;
+		}
+	} else {
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = htons(atoi(address + 4));
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+			close(fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+/**
+ * @brief Read exactly size bytes from a socket
+ *
+ * @param fd The socket
+ * @param buffer Where to put the data
+ * @param size The number of bytes to read
+ * @return int Return whether the read was successful (it fails at the end of the stream)
+ */
+static int read_all(int fd, void * buffer, size_t size) {
+	char * data = buffer;
+	while (size > 0) {
+		ssize_t n = read(fd, data, size);
+		if (n <= 0) {
+			return -1;
+		}
+		data += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/**
+ * @brief Subscribe to the stream of a simulation and print a summary of every frame received
+ *
+ * @param argc The number of arguments passed to the program
+ * @param argv An array of the arguments passed to the program
+ * @return int The exit code of the application
+ */
+int main(int argc, char *argv[]) {
+	struct stream_subscription request;
+	memcpy(request.magic, STREAM_SUBSCRIBE_MAGIC, 4);
+	request.every = 1;
+	request.fields = 0;
+	long max_frames = -1;
+	int wait_ms = 0;
+
+	int c;
+	while ((c = getopt(argc, argv, "e:f:n:s:h")) != -1) {
+		switch (c) {
+			case 'e':
+				request.every = atoi(optarg);
+				break;
+			case 'f':
+				for (char * field = strtok(optarg, ","); field != NULL; field = strtok(NULL, ",")) {
+					if (strcmp(field, "velocity") == 0) request.fields |= STREAM_VELOCITY;
+					else if (strcmp(field, "acceleration") == 0) request.fields |= STREAM_ACCELERATION;
+					else if (strcmp(field, "energy") == 0) request.fields |= STREAM_ENERGY;
+					else if (strcmp(field, "id") == 0) request.fields |= STREAM_ID;
+					else {
+						fprintf(stderr, "Error: Unknown field '%s'.\n", field);
+						exit(1);
+					}
+				}
+				break;
+			case 'n':
+				max_frames = atol(optarg);
+				break;
+			case 's':
+				wait_ms = atoi(optarg);
+				break;
+			default:
+				print_help(argv[0]);
+				exit(1);
+		}
+	}
+	if (optind != argc - 1) {
+		print_help(argv[0]);
+		exit(1);
+	}
+
+	int fd = connect_stream(argv[optind]);
+	if (fd < 0) {
+		perror("Error: could not connect to the stream");
+		exit(1);
+	}
+	if (write(fd, &request, sizeof(request)) != sizeof(request)) {
+		perror("Error: could not subscribe to the stream");
+		exit(1);
+	}
+
+	long frames = 0;
+	char * frame = NULL;
+	while (max_frames < 0 || frames < max_frames) {
+		struct stream_frame_header header;
+		if (read_all(fd, &header, sizeof(header)) != 0) {
+			break;
+		}
+		if (memcmp(header.magic, STREAM_FRAME_MAGIC, 4) != 0) {
+			fprintf(stderr, "Error: Not a frame\n");
+			exit(1);
+		}
+		size_t size = header.length - (sizeof(header) - sizeof(header.length));
+		frame = realloc(frame, size > 0 ? size : 1);
+		if (read_all(fd, frame, size) != 0) {
+			break;
+		}
+
+		// the positions come first, then the other fields in order
+		long n = header.num_particles;
+		double * pos = (double *) frame;
+		double * next = pos + (2 * n);
+		double cx = 0.0, cy = 0.0;
+		for (long p = 0; p < n; p++) {
+			cx += pos[2*p];
+			cy += pos[2*p+1];
+		}
+		printf("Frame %6ld: step %8ld, time %14.8e, %ld particles, centre (%.6e, %.6e), %lu dropped", frames, (long) header.step, header.t, n, cx / n, cy / n, (unsigned long) header.dropped);
+		if (header.fields & STREAM_VELOCITY) {
+			double kinetic_energy = 0.0;
+			for (long p = 0; p < n; p++) {
+				kinetic_energy += 0.5 * ((next[2*p] * next[2*p]) + (next[2*p+1] * next[2*p+1]));
+			}
+			printf(", kinetic energy %14.8e", kinetic_energy / n);
+			next += 2 * n;
+		}
+		if (header.fields & STREAM_ACCELERATION) {
+			next += 2 * n;
+		}
+		if (header.fields & STREAM_ENERGY) {
+			double potential_energy = 0.0;
+			for (long p = 0; p < n; p++) {
+				potential_energy += next[2*p];
+			}
+			printf(", potential energy %14.8e", potential_energy / n);
+			next += 2 * n;
+		}
+		if (header.fields & STREAM_ID) {
+			printf(", first id %d", ((int32_t *) next)[0]);
+		}
+		printf("\n");
+		fflush(stdout);
+
+		frames++;
+		if (wait_ms > 0) {
+			usleep(wait_ms * 1000);
+		}
+	}
+
+	free(frame);
+	close(fd);
+	return 0;
+}
@@ -6,6 +6,7 @@ struct particle_t {
 	double * x, * y; // position within cell
 	double * ax, * ay; // acceleration
 	double * vx, * vy; // velocity
+	double * energy, * virial; // potential energy and virial (only with --extended, on output steps)
 };
 
 // list for a cell, with a head
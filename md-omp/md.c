@@ -7,6 +7,9 @@
 
 #include "args.h"
 #include "boundary.h"
+#include "checkpoint.h"
+#include "restart.h"
+#include "stream.h"
 #include "data.h"
 #include "setup.h"
 #include "vtk.h"
@@ -18,21 +21,53 @@ double get_time() {
   return t.tv_sec + (1e-6 * t.tv_usec);
 }
 
+// the phases of a step, timed for --timings
+enum {
+	PHASE_MOVE,
+	PHASE_CELLS,
+	PHASE_BOUNDARY,
+	PHASE_FORCE,
+	PHASE_VELOCITY,
+	PHASE_OUTPUT,
+	NUM_PHASES
+};
+static const char * phase_names[NUM_PHASES] = {"move", "cells", "boundary", "force", "velocity", "output"};
+static double phase_time[NUM_PHASES];
+static double phase_mark;
+
+/**
+ * @brief Add the time since the last call to a phase of the step
+ *
+ * @param phase The phase that has just finished
+ */
+static void lap(int phase) {
+	double now = get_time();
+	phase_time[phase] += now - phase_mark;
+	phase_mark = now;
+}
+
 
 
 /**
  * @brief This routine calculates the acceleration felt by each particle based on evaluating the Lennard-Jones 
  *        potential with its neighbours. It only evaluates particles within a cut-off radius, and uses cells to 
  *        reduce the search space. It also calculates the potential energy of the system. 
+ *        On output steps with --extended it also records the potential energy and virial
+ *        (r.F) of each particle, with each pair's share split evenly between the two.
  * 
+ * @param record Whether to record the potential energy and virial of each particle
  * @return double The potential energy
  */
-double comp_accel() {
+double comp_accel(int record) {
 	// zero acceleration for every particle
 	#pragma omp parallel for
 	for (int p = 0; p < num_particles; p++) {
 		particles.ax[p] = 0.0;
 		particles.ay[p] = 0.0;
+		if (record) {
+			particles.energy[p] = 0.0;
+			particles.virial[p] = 0.0;
+		}
 	}
 
 	double pot_energy = 0.0;
@@ -79,7 +114,22 @@ double comp_accel() {
 								particles.ay[q] -= f*dy;
 
 
-								pot_energy += 2.0 * (4.0 * r_6_inv * (r_6_inv - 1.0) - Uc - Duc * (sqrt(r_2) - r_cut_off));
+								double pair_energy = 4.0 * r_6_inv * (r_6_inv - 1.0) - Uc - Duc * (sqrt(r_2) - r_cut_off);
+								pot_energy += 2.0 * pair_energy;
+
+								// each pair is only visited once, and either particle can also
+								// be in a cell handled by another thread, so both are atomic
+								if (record) {
+									double pair_virial = 0.5 * f * r_2;
+									#pragma omp atomic
+									particles.energy[p] += pair_energy;
+									#pragma omp atomic
+									particles.energy[q] += pair_energy;
+									#pragma omp atomic
+									particles.virial[p] += pair_virial;
+									#pragma omp atomic
+									particles.virial[q] += pair_virial;
+								}
 							}
 						}
 					}
@@ -121,12 +171,9 @@ void update_cells() {
 	// move particles that need to move cell lists
 	for (int i = 1; i < x+1; i++) {
 		for (int j = 1; j < y+1; j++) {
-			// we have to store the next particle here, as the remove/add at the end may be destructive
-			
-			int cell_count = cells[i][j].count;
-			int * cell_part_ids = cells[i][j].part_ids;
-			for (int k = 0; k < cell_count; k++) {
-				int p = cell_part_ids[k];
+			// removing a particle shifts the rest of the list down, so the count has to be re-read
+			for (int k = 0; k < cells[i][j].count; k++) {
+				int p = cells[i][j].part_ids[k];
 
 				// if a particles x or y value is greater than the cell size or less than 0, it must have moved cell
 				// do a quick check to make sure its not moved 2 cells (since this means our time step is too large, or something else is going wrong)
@@ -155,6 +202,8 @@ void update_cells() {
 					// remove the particle from its current cell list, then add it to the new cell list
 					remove_particle(&(cells[i][j]), k);
 					add_particle(&(cells[new_i][new_j]), p);
+					// the next particle has been shifted into this slot
+					k--;
 				}
 			}
 		}
@@ -198,6 +247,8 @@ int main(int argc, char *argv[]) {
 	set_defaults();
 	// parse the arguments
 	parse_args(argc, argv);
+	// a restart file sets the grid, the cell size, the cut off and the time step
+	if (restart_file[0] != '\0') read_restart_header(restart_file);
 
 	// call set up to update defaults
 	setup();
@@ -206,34 +257,62 @@ int main(int argc, char *argv[]) {
 	
 	double time = get_time();
 	
-	// set up problem
-	problem_setup();
+	int iters = 0;
+	double t = 0.0;
+
+	// set up problem (or carry on from where a restart file left off)
+	if (restart_file[0] != '\0') {
+		read_restart(restart_file, &iters, &t);
+	} else {
+		problem_setup();
+	}
 
 	// apply boundary condition (i.e. update pointers on the boundarys to loop periodically)
 	apply_boundary();
 	
-	comp_accel();
+	// the per particle energy and virial are only written out (or streamed) with --extended
+	int streaming = (stream_address[0] != '\0');
+	int record = ((!no_output) || streaming) && extended_output;
+	if (record) {
+		particles.energy = calloc(num_particles, sizeof(double));
+		particles.virial = calloc(num_particles, sizeof(double));
+	}
+
+	// the accelerations are already in a restart file
+	if (restart_file[0] == '\0') comp_accel(0);
 
 	double potential_energy = 0.0;
 	double kinetic_energy = 0.0;
 
-	int iters = 0;
-	double t;
-	for (t = 0.0; t < t_end; t+=dt, iters++) {
+	// the fields that don't change are only written once
+	if ((!no_output) && (enable_checkpoints) && (static_fields)) write_static(iters, t);
+
+	int async = (!no_output) && enable_checkpoints && (async_checkpoints != CHECKPOINT_SYNC);
+	if (async) start_checkpoint_writer();
+	if (streaming) start_stream();
+	phase_mark = get_time();
+	for (; t < t_end; t+=dt, iters++) {
 		// move particles half a time step
 		move_particles();
+		lap(PHASE_MOVE);
 
 		// update cell lists (i.e. move any particles between cell lists if required)
 		update_cells();
+		lap(PHASE_CELLS);
 
 		// update pointers (because the previous operation might break boundary cell lists)
 		apply_boundary();
+		lap(PHASE_BOUNDARY);
 		
 		// compute acceleration for each particle and calculate potential energy
-		potential_energy = comp_accel();
+		// (recording the energy and virial of each particle if they are about to be written out)
+		int output_step = ((iters % output_freq == 0) && (enable_checkpoints || streaming)) || (t + dt >= t_end);
+		potential_energy = comp_accel(record && output_step);
+		lap(PHASE_FORCE);
 
 		// update velocity based on the acceleration and calculate the kinetic energy
 		kinetic_energy = update_velocity();
+		lap(PHASE_VELOCITY);
 	
 		if (iters % output_freq == 0) {
 			// calculate temperature and total energy
@@ -243,10 +322,28 @@ int main(int argc, char *argv[]) {
 			printf("Step %8d, Time: %14.8e (dt: %14.8e), Total energy: %14.8e (p:%14.8e,k:%14.8e), Temp: %14.8e\n", iters, t+dt, dt, total_energy, potential_energy, kinetic_energy, temp);
  
 			// if output is enabled and checkpointing is enabled, write out
-            if ((!no_output) && (enable_checkpoints))
-                write_checkpoint(iters, t+dt);
+            if ((!no_output) && (enable_checkpoints)) {
+                if (async) {
+                    queue_checkpoint(iters, t+dt);
+                } else {
+                    write_checkpoint(iters, t+dt);
+                    if (restart_due(iters)) write_restart_checkpoint(iters, t+dt, cells, &particles);
+                }
+            }
+
+			// publish a frame to anything watching the stream
+			if (streaming) publish_frame(iters, t+dt);
+		} else if (streaming) {
+			// keep sending frames to slow subscribers
+			progress_stream();
 		}
+		lap(PHASE_OUTPUT);
+	}
+	if (async) {
+		stop_checkpoint_writer();
+		lap(PHASE_OUTPUT);
 	}
+	if (streaming) stop_stream();
 
 	// calculate the final energy and write out a final status message
 	double final_energy = kinetic_energy + potential_energy;
@@ -255,11 +352,19 @@ int main(int argc, char *argv[]) {
 
 	time = get_time() - time;
 	printf("Total time: %14.8lf seconds\n", time);
+	if (timings) {
+		printf("Timings: threads=%d", omp_get_max_threads());
+		for (int phase = 0; phase < NUM_PHASES; phase++) {
+			printf(" %s=%.6lf", phase_names[phase], phase_time[phase]);
+		}
+		printf("\n");
+	}
 
 	// if output is enabled, write the mesh file and the final state
 	if (!no_output) {
 		write_mesh();
 		write_result(iters, t);
+		if (enable_checkpoints) write_restart_result(iters, t);
 	}
 
 	return 0;
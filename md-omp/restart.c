@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+#include "args.h"
+#include "data.h"
+#include "restart.h"
+
+char restart_file[1024] = "";
+int restart_freq = 1;
+
+char restart_checkpoint_basename[1024];
+char restart_result_filename[1024];
+
+// the header of the file being resumed from
+static struct restart_header restart;
+
+/**
+ * @brief Set the basename for restart files (which sit alongside the VTK output)
+ *
+ * @param base Basename string
+ */
+void set_restart_basename(char * base) {
+	sprintf(restart_checkpoint_basename, "%s-%%d.rst", base);
+	sprintf(restart_result_filename, "%s.rst", base);
+}
+
+/**
+ * @brief Check whether the checkpoint at an iteration should come with a restart file
+ *
+ * @param iters The iteration of the checkpoint
+ * @return int Return whether a restart file is written
+ */
+int restart_due(int iters) {
+	return (restart_freq > 0) && ((iters / output_freq) % restart_freq == 0);
+}
+
+/**
+ * @brief Write a restart checkpoint (with the iteration number in the filename)
+ *
+ * @param iters The iteration that has just been completed
+ * @param t The simulation time at the end of it
+ * @param c The cell lists to write (the live ones, or a snapshot of them)
+ * @param parts The particles to write (only the positions, velocities and accelerations are used)
+ * @return int Return whether the write was successful
+ */
+int write_restart_checkpoint(int iters, double t, struct cell_list ** c, struct particle_t * parts) {
+	char filename[1024];
+	sprintf(filename, restart_checkpoint_basename, iters);
+
+	double write_time = omp_get_wtime();
+	// a resumed run carries on from the next step
+	int err = write_restart(filename, iters + 1, t, c, parts);
+	write_time = omp_get_wtime() - write_time;
+	if (verbose && err == 0) {
+		printf("Step %8d, wrote %s in %.4f seconds\n", iters, filename, write_time);
+	}
+	return err;
+}
+
+/**
+ * @brief Write the final state to a restart file
+ *
+ * @param iters The number of iterations taken
+ * @param t The simulation time
+ * @return int Return whether the write was successful
+ */
+int write_restart_result(int iters, double t) {
+	return write_restart(restart_result_filename, iters, t, cells, &particles);
+}
+
+/**
+ * @brief Write a whole buffer to a file at a given offset
+ *
+ * @param fd The file
+ * @param buffer The data to write
+ * @param size The number of bytes to write
+ * @param offset Where to write it
+ * @return int Return whether the write was successful
+ */
+int write_at(int fd, const void * buffer, size_t size, off_t offset) {
+	const char * data = buffer;
+	while (size > 0) {
+		ssize_t written = pwrite(fd, data, size, offset);
+		if (written < 0) {
+			return -1;
+		}
+		data += written;
+		size -= written;
+		offset += written;
+	}
+	return 0;
+}
+
+/**
+ * @brief Write out a restart file. The particle arrays are written as they are in memory, and
+ *        the cell lists are flattened into an array of particle ids and the start of each cell.
+ *
+ * @param filename The filename to use for output
+ * @param iters The number of iterations taken
+ * @param t The simulation time
+ * @param c The cell lists to write
+ * @param parts The particles to write
+ * @return int Return whether the write was successful
+ */
+int write_restart(char * filename, int iters, double t, struct cell_list ** c, struct particle_t * parts) {
+	int fd = open(filename, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("Error");
+		return -1;
+	}
+
+	int64_t * cell_start = malloc(sizeof(int64_t) * ((x*y) + 1));
+	int32_t * part_ids = malloc(sizeof(int32_t) * (num_particles > 0 ? num_particles : 1));
+	cell_start[0] = 0;
+	for (int i = 1; i < x+1; i++) {
+		for (int j = 1; j < y+1; j++) {
+			int cell = ((i-1)*y) + (j-1);
+			memcpy(part_ids + cell_start[cell], c[i][j].part_ids, sizeof(int32_t) * c[i][j].count);
+			cell_start[cell+1] = cell_start[cell] + c[i][j].count;
+		}
+	}
+
+	struct restart_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RESTART_MAGIC, sizeof(header.magic));
+	header.version = RESTART_VERSION;
+	header.x = x;
+	header.y = y;
+	header.num_part_per_dim = num_part_per_dim;
+	header.step = iters;
+	header.seed = seed;
+	header.num_particles = num_particles;
+	header.cell_size = cell_size;
+	header.r_cut_off = r_cut_off;
+	header.dt = dt;
+	header.t = t;
+
+	const void * arrays[RESTART_NUM_ARRAYS] = {parts->x, parts->y, parts->vx, parts->vy, parts->ax, parts->ay, cell_start, part_ids};
+	size_t sizes[RESTART_NUM_ARRAYS];
+	for (int a = RESTART_X; a <= RESTART_AY; a++) {
+		sizes[a] = sizeof(double) * num_particles;
+	}
+	sizes[RESTART_CELL_START] = sizeof(int64_t) * ((x*y) + 1);
+	sizes[RESTART_PART_IDS] = sizeof(int32_t) * num_particles;
+
+	int64_t offset = sizeof(header);
+	for (int a = 0; a < RESTART_NUM_ARRAYS; a++) {
+		offset = ((offset + RESTART_ALIGN - 1) / RESTART_ALIGN) * RESTART_ALIGN;
+		header.offsets[a] = offset;
+		offset += sizes[a];
+	}
+
+	int err = write_at(fd, &header, sizeof(header), 0);
+	for (int a = 0; a < RESTART_NUM_ARRAYS && err == 0; a++) {
+		err = write_at(fd, arrays[a], sizes[a], header.offsets[a]);
+	}
+	if (err != 0) {
+		perror("Error");
+	}
+
+	close(fd);
+	free(cell_start);
+	free(part_ids);
+	return err;
+}
+
+/**
+ * @brief Read the header of a restart file, and take the grid, the cell size, the cut off and
+ *        the time step from it. This has to be called before setup().
+ *
+ * @param filename The restart file
+ */
+void read_restart_header(char * filename) {
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0 || pread(fd, &restart, sizeof(restart), 0) != sizeof(restart)) {
+		fprintf(stderr, "Error: could not read %s\n", filename);
+		exit(1);
+	}
+	close(fd);
+
+	if (memcmp(restart.magic, RESTART_MAGIC, sizeof(restart.magic)) != 0 || restart.version != RESTART_VERSION) {
+		fprintf(stderr, "Error: %s is not a version %d restart file\n", filename, RESTART_VERSION);
+		exit(1);
+	}
+	if (restart.t >= t_end) {
+		fprintf(stderr, "Error: %s is already at time %lf, increase --endtime\n", filename, restart.t);
+		exit(1);
+	}
+
+	x = restart.x;
+	y = restart.y;
+	num_part_per_dim = restart.num_part_per_dim;
+	seed = restart.seed;
+	cell_size = restart.cell_size;
+	r_cut_off = restart.r_cut_off;
+	dt = restart.dt;
+}
+
+/**
+ * @brief Carry on from a restart file. The file is mapped into memory (privately, so changes
+ *        aren't written back), and the particle arrays point straight into the mapping, so
+ *        nothing is read until it is used. Only the cell lists are copied, since they grow and
+ *        shrink as particles move.
+ *
+ * @param filename The restart file
+ * @param iters Set to the number of iterations already taken
+ * @param t Set to the simulation time
+ */
+void read_restart(char * filename, int * iters, double * t) {
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "Error: could not open %s\n", filename);
+		exit(1);
+	}
+	char * map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("Error: could not map the restart file");
+		exit(1);
+	}
+
+	num_particles = restart.num_particles;
+	particles.x = (double *) (map + restart.offsets[RESTART_X]);
+	particles.y = (double *) (map + restart.offsets[RESTART_Y]);
+	particles.vx = (double *) (map + restart.offsets[RESTART_VX]);
+	particles.vy = (double *) (map + restart.offsets[RESTART_VY]);
+	particles.ax = (double *) (map + restart.offsets[RESTART_AX]);
+	particles.ay = (double *) (map + restart.offsets[RESTART_AY]);
+	int64_t * cell_start = (int64_t *) (map + restart.offsets[RESTART_CELL_START]);
+	int32_t * part_ids = (int32_t *) (map + restart.offsets[RESTART_PART_IDS]);
+
+	// give every cell at least the room problem_setup would
+	int min_size = 2 * num_part_per_dim * num_part_per_dim;
+	cells = alloc_2d_cell_list_array(x+2, y+2);
+	#pragma omp parallel for
+	for (int i = 1; i < x+1; i++) {
+		for (int j = 1; j < y+1; j++) {
+			int cell = ((i-1)*y) + (j-1);
+			int count = cell_start[cell+1] - cell_start[cell];
+			cells[i][j].count = count;
+			cells[i][j].size = (count > min_size) ? count : min_size;
+			cells[i][j].part_ids = malloc(sizeof(int) * cells[i][j].size);
+			memcpy(cells[i][j].part_ids, part_ids + cell_start[cell], sizeof(int) * count);
+		}
+	}
+
+	*iters = restart.step;
+	*t = restart.t;
+}
@@ -0,0 +1,57 @@
+#ifndef RESTART_H
+#define RESTART_H
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "data.h"
+
+// a restart file is a header followed by the particle arrays (indexed by particle id), the
+// first entry of each cell in the cell list array (in cell order, plus the total at the end)
+// and the cell list array itself (the particle ids of every cell back to back). Each array
+// starts on a RESTART_ALIGN byte boundary, so the file can be mapped into memory and the
+// particle arrays used where they are. Everything is stored in the byte order of the machine
+// that wrote it.
+#define RESTART_MAGIC "MDOMPRST"
+#define RESTART_VERSION 1
+#define RESTART_ALIGN 4096
+
+// the arrays in a restart file
+enum restart_array {
+	RESTART_X,          // double, position within the cell
+	RESTART_Y,
+	RESTART_VX,         // double, velocity
+	RESTART_VY,
+	RESTART_AX,         // double, acceleration
+	RESTART_AY,
+	RESTART_CELL_START, // int64_t, x*y+1 entries, cell (i, j) is entry ((i-1)*y)+(j-1)
+	RESTART_PART_IDS,   // int32_t
+	RESTART_NUM_ARRAYS
+};
+
+struct restart_header {
+	char magic[8];
+	int32_t version;
+	int32_t x, y;
+	int32_t num_part_per_dim;
+	int64_t step; // the number of steps taken
+	int64_t seed;
+	int64_t num_particles;
+	double cell_size, r_cut_off, dt, t;
+	int64_t offsets[RESTART_NUM_ARRAYS]; // where each array starts, in bytes
+};
+
+// the restart file to resume from (empty to start from scratch)
+extern char restart_file[1024];
+// write a restart file with every restart_freq-th checkpoint (0 for only the final state)
+extern int restart_freq;
+
+void set_restart_basename(char * base);
+int restart_due(int iters);
+int write_restart_checkpoint(int iters, double t, struct cell_list ** c, struct particle_t * parts);
+int write_restart_result(int iters, double t);
+int write_restart(char * filename, int iters, double t, struct cell_list ** c, struct particle_t * parts);
+int write_at(int fd, const void * buffer, size_t size, off_t offset);
+void read_restart_header(char * filename);
+void read_restart(char * filename, int * iters, double * t);
+
+#endif
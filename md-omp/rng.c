@@ -0,0 +1,91 @@
+#include <math.h>
+
+#include "rng.h"
+
+// Philox4x32 multipliers and Weyl sequence constants (Salmon et al., SC'11)
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+// fixed point scale of each word of a fixed_sum
+#define FIXED_SCALE 1073741824.0
+
+/**
+ * @brief Apply one Philox round to a counter
+ *
+ * @param ctr The counter (updated in place)
+ * @param key The round key
+ */
+static void philox_round(uint32_t ctr[4], const uint32_t key[2]) {
+	uint64_t p0 = (uint64_t) PHILOX_M0 * ctr[0];
+	uint64_t p1 = (uint64_t) PHILOX_M1 * ctr[2];
+	uint32_t c0 = (uint32_t) (p1 >> 32) ^ ctr[1] ^ key[0];
+	uint32_t c2 = (uint32_t) (p0 >> 32) ^ ctr[3] ^ key[1];
+	ctr[0] = c0;
+	ctr[1] = (uint32_t) p1;
+	ctr[2] = c2;
+	ctr[3] = (uint32_t) p0;
+}
+
+/**
+ * @brief Generate 4 random 32-bit words from a counter and a key with Philox4x32-10
+ *
+ * @param counter The counter
+ * @param key The key
+ * @param out The random words
+ */
+void philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4]) {
+	uint32_t k[2] = {key[0], key[1]};
+	for (int w = 0; w < 4; w++) {
+		out[w] = counter[w];
+	}
+	for (int r = 0; r < PHILOX_ROUNDS; r++) {
+		if (r > 0) {
+			k[0] += PHILOX_W0;
+			k[1] += PHILOX_W1;
+		}
+		philox_round(out, k);
+	}
+}
+
+/**
+ * @brief Generate a uniform random number in [0, 1) for a given seed and id. The same
+ *        (seed, id, stream) always gives the same number, however the work is split up.
+ *
+ * @param seed The random seed
+ * @param id What the number is for (e.g. the global id of a particle)
+ * @param stream Which of the numbers for this id to generate
+ * @return double The random number (with 53 random bits)
+ */
+double rng_uniform(long seed, long id, int stream) {
+	uint32_t key[2] = {(uint32_t) seed, (uint32_t) ((unsigned long) seed >> 32)};
+	uint32_t counter[4] = {(uint32_t) id, (uint32_t) ((unsigned long) id >> 32), (uint32_t) stream, 0};
+	uint32_t out[4];
+	philox4x32(counter, key, out);
+	return (((out[0] >> 5) * 67108864.0) + (out[1] >> 6)) / 9007199254740992.0;
+}
+
+/**
+ * @brief Add a value to a fixed point sum. Integer addition is associative, so the total
+ *        is the same whatever order the values are added (or reduced) in.
+ *
+ * @param sum The sum to add to
+ * @param v The value to add
+ */
+void fixed_sum_add(long long sum[FIXED_SUM_WORDS], double v) {
+	double hi = floor(v * FIXED_SCALE);
+	sum[0] += (long long) hi;
+	sum[1] += llround(((v * FIXED_SCALE) - hi) * FIXED_SCALE);
+}
+
+/**
+ * @brief Get the value of a fixed point sum
+ *
+ * @param sum The sum
+ * @return double The (rounded) value of the sum
+ */
+double fixed_sum_value(const long long sum[FIXED_SUM_WORDS]) {
+	return (sum[0] / FIXED_SCALE) + (sum[1] / (FIXED_SCALE * FIXED_SCALE));
+}
@@ -5,7 +5,9 @@
 
 #include "setup.h"
 #include "data.h"
+#include "rng.h"
 #include "vtk.h"
+#include "restart.h"
 
 /**
  * @brief Set up some default configuration options
@@ -22,8 +24,6 @@ void set_defaults() {
  * 
  */
 void setup() {
-	srand(seed);
-
 	r_cut_off_2 = r_cut_off * r_cut_off;
 	r_cut_off_2_inv = 1.0 / r_cut_off_2;
 	r_cut_off_6_inv = r_cut_off_2_inv * r_cut_off_2_inv * r_cut_off_2_inv;
@@ -31,7 +31,10 @@ void setup() {
 	Uc = 4.0 * r_cut_off_6_inv * (r_cut_off_6_inv - 1.0);
 	Duc = -48 * r_cut_off_6_inv * (r_cut_off_6_inv - 0.5) / r_cut_off;
 
-	dt = t_end / niters;
+	// a restart carries on with the time step it was written with
+	if (restart_file[0] == '\0') {
+		dt = t_end / niters;
+	}
 	dth = dt / 2.0;
 }
 
@@ -54,8 +57,8 @@ void problem_setup() {
 	particles.vx = malloc(sizeof(double) * num_particles);
 	particles.vy = malloc(sizeof(double) * num_particles);
 
-	double v_sum_x = 0.0;
-	double v_sum_y = 0.0;
+	// the momentum is summed in fixed point, so the total is the same for any number of threads
+	long long v_sum[2*FIXED_SUM_WORDS] = {0};
 
 	// set the normalisation magnitude using the ideal gas law (T = mv^2 / 3)
 	double v_magnitude = sqrt(3.0 * init_temp);
@@ -63,10 +66,10 @@ void problem_setup() {
 	int num_part_per_dim_2 = num_part_per_dim * num_part_per_dim;
 	int size = 2 * num_part_per_dim_2;
 
-	double pi_2_rand =  2.0 * M_PI / RAND_MAX;
 	double num_part_per_dim_inv = 1.0 / num_part_per_dim;
 	
-	// #pragma omp parallel for reduction(+:v_sum_x,v_sum_y)
+	// every particle's velocity only depends on its id, so the cells can be set up in parallel
+	#pragma omp parallel for reduction(+:v_sum[:2*FIXED_SUM_WORDS])
 	for (int i = 1; i < x+1; i++) {
 		for (int j = 1; j < y+1; j++) {
 			cells[i][j].count = 0;
@@ -80,8 +83,9 @@ void problem_setup() {
 					double part_y = 0.5 * num_part_per_dim_inv + ((double) b / num_part_per_dim);
 
 					// generate random velocities for the particles, but make sure the overall magnitude is 1.0
-					// i.e. generate an angle between 0 and 2*PI then use cos and sin
-					double phi = (double) rand() * pi_2_rand;
+					// i.e. generate an angle between 0 and 2*PI then use cos and sin. The angle only
+					// depends on the seed and the particle id, so it is the same however the work is split
+					double phi = rng_uniform(seed, p_count, 0) * 2.0 * M_PI;
 					double rand_vx = cos(phi);
 					double rand_vy = sin(phi);
 
@@ -92,16 +96,16 @@ void problem_setup() {
 					particles.vy[p_count] = rand_vy * v_magnitude;
 					add_particle(&(cells[i][j]), p_count);
 					
-					v_sum_x += particles.vx[p_count];
-					v_sum_y += particles.vy[p_count];
+					fixed_sum_add(&v_sum[0], particles.vx[p_count]);
+					fixed_sum_add(&v_sum[FIXED_SUM_WORDS], particles.vy[p_count]);
 				}
 			}	
 		}
 	}
 
 	// Normalise data to make sure that the total momentum is 0.0 at the start
-	double v_avg_x = v_sum_x / num_particles;
-	double v_avg_y = v_sum_y / num_particles;
+	double v_avg_x = fixed_sum_value(&v_sum[0]) / num_particles;
+	double v_avg_y = fixed_sum_value(&v_sum[FIXED_SUM_WORDS]) / num_particles;
 
 	#pragma omp parallel for
 	for (int i = 0; i < num_particles; i++) {
@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "stream.h"
+#include "args.h"
+#include "data.h"
+
+char stream_address[256] = "";
+
+// the arrays of a frame, built once per published frame for each set of fields asked for and
+// shared by every subscriber that asked for those fields (it is freed once none of them still
+// have it queued)
+struct frame_body {
+	int refs;
+	size_t size;
+	char data[];
+};
+
+// a frame waiting to be sent to a subscriber: its own header (with its dropped count), then
+// the shared arrays
+struct queued_frame {
+	struct stream_frame_header header;
+	struct frame_body * body;
+};
+
+// a connected subscriber, with the frames waiting to be sent to it (oldest first). The first
+// frame may have been partly sent.
+struct subscriber {
+	int fd;
+	int subscribed;
+	int waited;
+	struct stream_subscription request;
+	size_t request_bytes;
+	uint64_t frames_seen, dropped;
+	struct queued_frame queue[STREAM_QUEUE];
+	int queued;
+	size_t sent;
+};
+
+static int listen_fd = -1;
+static struct subscriber subscribers[STREAM_MAX_SUBSCRIBERS];
+static int num_subscribers;
+static long frames_published, frames_dropped;
+
+/**
+ * @brief Open the listening socket for the stream address. Subscribers are accepted (without
+ *        blocking) whenever a frame is published.
+ *
+ */
+void start_stream() {
+	if (strncmp(stream_address, "unix:", 5) == 0) {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		// the length of the path was checked with the arguments
+		memcpy(addr.sun_path, stream_address + 5, strlen(stream_address + 5) + 1);
+		unlink(addr.sun_path);
+		listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+			perror("Error: could not open the stream socket");
+			exit(1);
+		}
+	} else {
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = htons(atoi(stream_address + 4));
+		int one = 1;
+		listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (listen_fd >= 0) setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+			perror("Error: could not open the stream socket");
+			exit(1);
+		}
+	}
+	if (listen(listen_fd, STREAM_MAX_SUBSCRIBERS) != 0) {
+		perror("Error: could not listen on the stream socket");
+		exit(1);
+	}
+	fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+	num_subscribers = 0;
+}
+
+/**
+ * @brief Let go of a subscriber's reference to the arrays of a frame, freeing them if no other
+ *        subscriber still has the frame queued
+ *
+ * @param body The arrays of the frame
+ */
+static void release_body(struct frame_body * body) {
+	if (--body->refs == 0) {
+		free(body);
+	}
+}
+
+/**
+ * @brief Remove a frame from a subscriber's queue
+ *
+ * @param sub The subscriber
+ * @param f The position of the frame in the queue
+ */
+static void dequeue_frame(struct subscriber * sub, int f) {
+	release_body(sub->queue[f].body);
+	memmove(sub->queue + f, sub->queue + f + 1, sizeof(struct queued_frame) * (sub->queued - f - 1));
+	sub->queued--;
+}
+
+/**
+ * @brief Disconnect a subscriber, dropping anything still waiting to be sent to it
+ *
+ * @param s The index of the subscriber
+ */
+static void drop_subscriber(int s) {
+	close(subscribers[s].fd);
+	for (int f = 0; f < subscribers[s].queued; f++) {
+		release_body(subscribers[s].queue[f].body);
+	}
+	subscribers[s] = subscribers[--num_subscribers];
+}
+
+/**
+ * @brief Accept any new subscribers, and read the subscription of any that haven't sent it yet.
+ *        A client that hasn't sent its subscription within STREAM_SUBSCRIBE_TIMEOUT published
+ *        frames is disconnected, so it can't hold on to a slot.
+ *
+ */
+static void accept_subscribers() {
+	int fd;
+	while (num_subscribers < STREAM_MAX_SUBSCRIBERS && (fd = accept(listen_fd, NULL, NULL)) >= 0) {
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		struct subscriber * sub = &subscribers[num_subscribers++];
+		memset(sub, 0, sizeof(*sub));
+		sub->fd = fd;
+	}
+
+	for (int s = num_subscribers - 1; s >= 0; s--) {
+		struct subscriber * sub = &subscribers[s];
+		if (sub->subscribed) {
+			continue;
+		}
+		ssize_t n = recv(sub->fd, ((char *) &sub->request) + sub->request_bytes, sizeof(sub->request) - sub->request_bytes, 0);
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+			drop_subscriber(s);
+			continue;
+		}
+		if (n > 0) {
+			sub->request_bytes += n;
+		}
+		if (sub->request_bytes == sizeof(sub->request)) {
+			if (memcmp(sub->request.magic, STREAM_SUBSCRIBE_MAGIC, 4) != 0) {
+				drop_subscriber(s);
+				continue;
+			}
+			if (sub->request.every < 1) {
+				sub->request.every = 1;
+			}
+			sub->subscribed = 1;
+		} else if (++sub->waited == STREAM_SUBSCRIBE_TIMEOUT) {
+			drop_subscriber(s);
+		}
+	}
+}
+
+/**
+ * @brief Build the arrays of a frame of the current state
+ *
+ * @param fields The optional fields to include
+ * @return struct frame_body* The arrays (with no references yet)
+ */
+static struct frame_body * build_frame(uint32_t fields) {
+	size_t per_particle = 2 * sizeof(double);
+	if (fields & STREAM_VELOCITY) per_particle += 2 * sizeof(double);
+	if (fields & STREAM_ACCELERATION) per_particle += 2 * sizeof(double);
+	if (fields & STREAM_ENERGY) per_particle += 2 * sizeof(double);
+	if (fields & STREAM_ID) per_particle += sizeof(int32_t);
+
+	struct frame_body * body = malloc(sizeof(struct frame_body) + (per_particle * num_particles));
+	body->refs = 0;
+	body->size = per_particle * num_particles;
+
+	// the arrays follow each other, in the order of the fields
+	double * pos = (double *) body->data;
+	double * vel = pos + (2 * num_particles);
+	double * acc = vel + ((fields & STREAM_VELOCITY) ? 2 * num_particles : 0);
+	double * energy = acc + ((fields & STREAM_ACCELERATION) ? 2 * num_particles : 0);
+	int32_t * ids = (int32_t *) (energy + ((fields & STREAM_ENERGY) ? 2 * num_particles : 0));
+	long n = 0;
+	for (int i = 1; i < x+1; i++) {
+		for (int j = 1; j < y+1; j++) {
+			for (int k = 0; k < cells[i][j].count; k++) {
+				int p = cells[i][j].part_ids[k];
+				pos[2*n] = ((i-1) * cell_size) + particles.x[p];
+				pos[2*n+1] = ((j-1) * cell_size) + particles.y[p];
+				if (fields & STREAM_VELOCITY) {
+					vel[2*n] = particles.vx[p];
+					vel[2*n+1] = particles.vy[p];
+				}
+				if (fields & STREAM_ACCELERATION) {
+					acc[2*n] = particles.ax[p];
+					acc[2*n+1] = particles.ay[p];
+				}
+				if (fields & STREAM_ENERGY) {
+					energy[2*n] = particles.energy[p];
+					energy[2*n+1] = particles.virial[p];
+				}
+				if (fields & STREAM_ID) {
+					ids[n] = p;
+				}
+				n++;
+			}
+		}
+	}
+	return body;
+}
+
+/**
+ * @brief Send as much of the queued frames to every subscriber as can be sent without
+ *        blocking, and disconnect any that have gone away
+ *
+ */
+void progress_stream() {
+	for (int s = num_subscribers - 1; s >= 0; s--) {
+		struct subscriber * sub = &subscribers[s];
+		while (sub->queued > 0) {
+			// send what is left of the header and the arrays of the oldest frame
+			struct queued_frame * frame = &sub->queue[0];
+			size_t header_size = sizeof(frame->header);
+			struct iovec iov[2];
+			int num_iov = 0;
+			if (sub->sent < header_size) {
+				iov[num_iov].iov_base = ((char *) &frame->header) + sub->sent;
+				iov[num_iov].iov_len = header_size - sub->sent;
+				num_iov++;
+			}
+			size_t body_sent = (sub->sent > header_size) ? sub->sent - header_size : 0;
+			iov[num_iov].iov_base = frame->body->data + body_sent;
+			iov[num_iov].iov_len = frame->body->size - body_sent;
+			num_iov++;
+
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = num_iov;
+			ssize_t n = sendmsg(sub->fd, &msg, MSG_NOSIGNAL);
+			if (n < 0) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK) {
+					drop_subscriber(s);
+				}
+				break;
+			}
+			sub->sent += n;
+			if (sub->sent == header_size + frame->body->size) {
+				dequeue_frame(sub, 0);
+				sub->sent = 0;
+			}
+		}
+	}
+}
+
+/**
+ * @brief Publish a frame to every subscriber that wants this one. If a subscriber is too slow
+ *        and already has STREAM_QUEUE frames waiting, its oldest frame that hasn't started
+ *        being sent is dropped, so the simulation never waits for a subscriber.
+ *
+ * @param iters The current iteration number
+ * @param t The simulation time
+ */
+void publish_frame(int iters, double t) {
+	accept_subscribers();
+
+	// the energies are only recorded with --extended
+	uint32_t available = STREAM_VELOCITY | STREAM_ACCELERATION | STREAM_ID;
+	if (particles.energy != NULL) available |= STREAM_ENERGY;
+
+	// each set of fields is built at most once, and shared by the subscribers that asked for it
+	struct frame_body * built[STREAM_ID << 1];
+	memset(built, 0, sizeof(built));
+
+	for (int s = 0; s < num_subscribers; s++) {
+		struct subscriber * sub = &subscribers[s];
+		if (!sub->subscribed || (sub->frames_seen++ % sub->request.every) != 0) {
+			continue;
+		}
+		if (sub->queued == STREAM_QUEUE) {
+			dequeue_frame(sub, (sub->sent > 0) ? 1 : 0);
+			sub->dropped++;
+			frames_dropped++;
+		}
+		uint32_t fields = sub->request.fields & available;
+		if (built[fields] == NULL) {
+			built[fields] = build_frame(fields);
+		}
+		struct queued_frame * frame = &sub->queue[sub->queued++];
+		frame->body = built[fields];
+		frame->body->refs++;
+
+		struct stream_frame_header * header = &frame->header;
+		header->length = sizeof(*header) - sizeof(header->length) + frame->body->size;
+		memcpy(header->magic, STREAM_FRAME_MAGIC, 4);
+		header->fields = fields;
+		header->step = iters;
+		header->t = t;
+		header->num_particles = num_particles;
+		header->dropped = sub->dropped;
+	}
+	frames_published++;
+
+	progress_stream();
+}
+
+/**
+ * @brief Make a last attempt to send what is queued (without blocking), then disconnect
+ *        every subscriber and close the socket
+ *
+ */
+void stop_stream() {
+	progress_stream();
+	while (num_subscribers > 0) {
+		drop_subscriber(num_subscribers - 1);
+	}
+	close(listen_fd);
+	if (strncmp(stream_address, "unix:", 5) == 0) {
+		unlink(stream_address + 5);
+	}
+	if (verbose) {
+		printf("Stream: %ld frames published, %ld dropped for slow subscribers\n", frames_published, frames_dropped);
+	}
+}
@@ -0,0 +1,53 @@
+#ifndef STREAM_H
+#define STREAM_H
+#include <stdint.h>
+
+// Frames are streamed to subscribers over a UNIX domain socket ("unix:PATH") or a TCP socket
+// on localhost ("tcp:PORT"). A subscriber connects and sends a stream_subscription, and is
+// then sent every few frames, each of which is a stream_frame_header followed by the arrays
+// it holds: the positions (x, y), then, if asked for, the velocities (vx, vy), accelerations
+// (ax, ay), energies (potential energy, virial; only with --extended) and ids (int32). The
+// length at the start of each frame is the number of bytes that follow it. Everything is in
+// the byte order of the machine running the simulation.
+#define STREAM_SUBSCRIBE_MAGIC "MDSB"
+#define STREAM_FRAME_MAGIC "MDFR"
+
+// the most frames waiting to be sent to a subscriber (older frames are dropped)
+#define STREAM_QUEUE 4
+#define STREAM_MAX_SUBSCRIBERS 16
+// the frames published before a client that hasn't sent its subscription is disconnected
+#define STREAM_SUBSCRIBE_TIMEOUT 4
+
+// the optional fields of a frame
+enum stream_field {
+	STREAM_VELOCITY = 1,
+	STREAM_ACCELERATION = 2,
+	STREAM_ENERGY = 4,
+	STREAM_ID = 8
+};
+
+struct stream_subscription {
+	char magic[4];
+	uint32_t every;  // send every N-th frame
+	uint32_t fields; // the optional fields wanted
+};
+
+struct stream_frame_header {
+	uint64_t length;
+	char magic[4];
+	uint32_t fields;        // the optional fields in this frame
+	int64_t step;
+	double t;
+	int64_t num_particles;
+	uint64_t dropped;       // the frames dropped for this subscriber so far
+};
+
+// the address to stream to (empty for none)
+extern char stream_address[256];
+
+void start_stream();
+void publish_frame(int iters, double t);
+void progress_stream();
+void stop_stream();
+
+#endif
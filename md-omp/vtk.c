@@ -2,13 +2,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <float.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <omp.h>
 
 #include "vtk.h"
+#include "args.h"
 #include "data.h"
+#include "restart.h"
 
 char checkpoint_basename[1024];
 char result_filename[1024];
 char mesh_filename[1024];
+char static_filename[1024];
+char collection_filename[1024];
+char collection_entry[1024];
+
+// the checkpoints in the collection so far
+static int num_collected, collection_size;
+static int * collected_iters;
+static double * collected_times;
 
 /**
  * @brief Set the default basename for file output to out/vortex
@@ -29,6 +45,12 @@ void set_basename(char *base) {
     sprintf(checkpoint_basename, "%s-%%d.vtp", base);
     sprintf(result_filename, "%s.vtp", base);
 	sprintf(mesh_filename, "%s-mesh.vti", base);
+	sprintf(static_filename, "%s-static.vtp", base);
+	sprintf(collection_filename, "%s.pvd", base);
+	// the collection refers to the checkpoints relative to itself
+	char * dir = strrchr(base, '/');
+	sprintf(collection_entry, "%s-%%d.vtp", (dir != NULL) ? dir + 1 : base);
+	set_restart_basename(base);
 }
 
 /**
@@ -41,7 +63,8 @@ char *get_basename() {
 }
 
 /**
- * @brief Write a checkpoint VTK file (with the iteration number in the filename)
+ * @brief Write a checkpoint VTK file (with the iteration number in the filename), and add it
+ *        to the collection
  * 
  * @param iteration The current iteration number
  * @return int Return whether the write was successful
@@ -49,7 +72,10 @@ char *get_basename() {
 int write_checkpoint(int iters, double t) { 
     char filename[1024];
     sprintf(filename, checkpoint_basename, iters);
-    return write_vtk(filename, iters, t);
+    if (write_vtk(filename, iters, t) != 0) {
+        return -1;
+    }
+    return add_to_collection(iters, t);
 }
 
 /**
@@ -62,22 +88,510 @@ int write_result(int iters, double t) {
 }
 
 /**
- * @brief Write out a particle VTK file (i.e. a .vtp file).
- * 
+ * @brief Get the byte order of this machine, as named in VTK files
+ *
+ * @return const char* "LittleEndian" or "BigEndian"
+ */
+static const char * byte_order() {
+	int one = 1;
+	return (*(char *) &one == 1) ? "LittleEndian" : "BigEndian";
+}
+
+/**
+ * @brief Allocate an array of point data (with one tuple per particle)
+ *
+ * @param array The array
+ * @param name The name of the array
+ * @param type The VTK type of the values ("Float64", "Float32" or "Int32")
+ * @param components The number of values per particle
+ * @param value_size The size of each value in bytes
+ */
+static void init_array(struct vtk_array * array, const char * name, const char * type, int components, size_t value_size) {
+	memset(array, 0, sizeof(*array));
+	array->name = name;
+	array->type = type;
+	array->components = components;
+	array->value_size = value_size;
+	array->size = (size_t) num_particles * components * value_size;
+	array->data = malloc(array->size > 0 ? array->size : 1);
+}
+
+/**
+ * @brief Free an array of point data
+ *
+ * @param array The array
+ */
+static void free_array(struct vtk_array * array) {
+	free(array->data);
+	free(array->header);
+	free(array->packed);
+}
+
+/**
+ * @brief Store a 2D vector in a buffer of 3 component Float64 or Float32 vectors (with a zero z
+ *        component, as VTK expects)
+ *
+ * @param buffer The buffer
+ * @param n The index of the vector in the buffer
+ * @param vx The x component
+ * @param vy The y component
+ * @param single Whether the buffer holds single precision values
+ */
+static void store_vector(char * buffer, long n, double vx, double vy, int single) {
+	if (single) {
+		float * vector = ((float *) buffer) + (3*n);
+		vector[0] = (float) vx;
+		vector[1] = (float) vy;
+		vector[2] = 0.0f;
+	} else {
+		double * vector = ((double *) buffer) + (3*n);
+		vector[0] = vx;
+		vector[1] = vy;
+		vector[2] = 0.0;
+	}
+}
+
+/**
+ * @brief Store a value in a buffer of Float64 or Float32 values
+ *
+ * @param buffer The buffer
+ * @param n The index of the value in the buffer
+ * @param v The value
+ * @param single Whether the buffer holds single precision values
+ */
+static void store_scalar(char * buffer, long n, double v, int single) {
+	if (single) {
+		((float *) buffer)[n] = (float) v;
+	} else {
+		((double *) buffer)[n] = v;
+	}
+}
+
+/**
+ * @brief Allocate the arrays of a particle file: the points, then (with extended) the
+ *        velocity, acceleration, potential energy and virial, then (with ids) the particle id
+ *
+ * @param arrays The arrays (room for VTK_MAX_ARRAYS)
+ * @param single Whether to store the floating point values in single precision
+ * @param extended Whether to add the velocity, acceleration, potential energy and virial
+ * @param ids Whether to add the particle ids
+ * @return int The number of arrays
+ */
+static int init_particle_arrays(struct vtk_array * arrays, int single, int extended, int ids) {
+	const char * type = single ? "Float32" : "Float64";
+	size_t size = single ? sizeof(float) : sizeof(double);
+	int n = 0;
+	init_array(&arrays[n++], "particles", type, 3, size);
+	if (extended) {
+		init_array(&arrays[n++], "velocity", type, 3, size);
+		init_array(&arrays[n++], "acceleration", type, 3, size);
+		init_array(&arrays[n++], "potential_energy", type, 1, size);
+		init_array(&arrays[n++], "virial", type, 1, size);
+	}
+	if (ids) {
+		init_array(&arrays[n++], "id", "Int32", 1, sizeof(int32_t));
+	}
+	return n;
+}
+
+/**
+ * @brief Gather every array of a particle file in a single pass over the particles, either in
+ *        cell order or in particle id order (so that a particle is the same point in every file)
+ *
+ * @param arrays The arrays, as set up by init_particle_arrays
+ * @param c The cell lists to write
+ * @param parts The particles to write
+ * @param single Whether to store the floating point values in single precision
+ * @param extended Whether to gather the velocity, acceleration, potential energy and virial
+ * @param ids Whether to gather the particle ids
+ * @param by_id Whether to store the particles in id order
+ */
+static void gather_particles(struct vtk_array * arrays, struct cell_list ** c, struct particle_t * parts, int single, int extended, int ids, int by_id) {
+	struct vtk_array * id_array = &arrays[extended ? 5 : 1];
+	long n = 0;
+	for (int i = 1; i < x+1; i++) {
+		for (int j = 1; j < y+1; j++) {
+			for (int k = 0; k < c[i][j].count; k++) {
+				int p = c[i][j].part_ids[k];
+				long idx = by_id ? p : n;
+				store_vector(arrays[0].data, idx, ((i-1) * cell_size) + parts->x[p], ((j-1) * cell_size) + parts->y[p], single);
+				if (extended) {
+					store_vector(arrays[1].data, idx, parts->vx[p], parts->vy[p], single);
+					store_vector(arrays[2].data, idx, parts->ax[p], parts->ay[p], single);
+					store_scalar(arrays[3].data, idx, parts->energy[p], single);
+					store_scalar(arrays[4].data, idx, parts->virial[p], single);
+				}
+				if (ids) {
+					((int32_t *) id_array->data)[idx] = p;
+				}
+				n++;
+			}
+		}
+	}
+}
+
+/**
+ * @brief Compress one block of an array with zlib, recording its compressed size in the header
+ *
+ * @param array The array (with its header and packed buffer allocated)
+ * @param b The block
+ * @param num_blocks The number of blocks in the array
+ * @return int Return whether the compression failed
+ */
+static int compress_block(struct vtk_array * array, long b, long num_blocks) {
+	uLongf len = array->packed_stride;
+	uLong block_size = (b == num_blocks - 1) ? array->header[2] : VTK_ZLIB_BLOCK;
+	int failed = (compress2((Bytef *) array->packed + (b * array->packed_stride), &len, (Bytef *) array->data + (b * VTK_ZLIB_BLOCK), block_size, zlib_level) != Z_OK);
+	array->header[3 + b] = len;
+	return failed;
+}
+
+/**
+ * @brief Compress an array with zlib, in the format read by VTK's vtkZLibDataCompressor: a
+ *        header with the number of blocks, the (uncompressed) block size, the size of the last
+ *        block and the compressed size of each block, followed by the compressed blocks. The
+ *        blocks are compressed in parallel by the OpenMP threads (unless serial is set).
+ *
+ * @param array The array
+ * @param serial Whether to compress the blocks one after another on the calling thread
+ * @return int Return whether the compression was successful
+ */
+static int compress_array(struct vtk_array * array, int serial) {
+	long num_blocks = (array->size + VTK_ZLIB_BLOCK - 1) / VTK_ZLIB_BLOCK;
+	array->packed_stride = compressBound(VTK_ZLIB_BLOCK);
+	array->packed = malloc((num_blocks > 0 ? num_blocks : 1) * array->packed_stride);
+	array->header_entries = 3 + num_blocks;
+	array->header = malloc(sizeof(uint64_t) * array->header_entries);
+	array->header[0] = num_blocks;
+	array->header[1] = VTK_ZLIB_BLOCK;
+	array->header[2] = (num_blocks > 0) ? array->size - ((num_blocks - 1) * VTK_ZLIB_BLOCK) : 0;
+
+	int failed = 0;
+	if (serial) {
+		for (long b = 0; b < num_blocks; b++) {
+			failed |= compress_block(array, b, num_blocks);
+		}
+	} else {
+		#pragma omp parallel for schedule(dynamic) reduction(|:failed)
+		for (long b = 0; b < num_blocks; b++) {
+			failed |= compress_block(array, b, num_blocks);
+		}
+	}
+
+	array->encoded_size = sizeof(uint64_t) * array->header_entries;
+	for (long b = 0; b < num_blocks; b++) {
+		array->encoded_size += array->header[3 + b];
+	}
+	return failed ? -1 : 0;
+}
+
+/**
+ * @brief Get an array ready to be appended to a file, either as it is (after a UInt64 byte
+ *        count) or compressed with zlib if a compression level is set
+ *
+ * @param array The array
+ * @param serial Whether to encode the array without any OpenMP parallel regions
+ * @return int Return whether the encoding was successful
+ */
+static int encode_array(struct vtk_array * array, int serial) {
+	if (zlib_level > 0) {
+		return compress_array(array, serial);
+	}
+	array->header_entries = 1;
+	array->header = malloc(sizeof(uint64_t));
+	array->header[0] = array->size;
+	array->encoded_size = sizeof(uint64_t) + array->size;
+	return 0;
+}
+
+/**
+ * @brief Write an encoded array to the appended data section of a file
+ *
+ * @param f The file to write to
+ * @param array The array
+ */
+static void write_array_appended(FILE * f, struct vtk_array * array) {
+	fwrite(array->header, sizeof(uint64_t), array->header_entries, f);
+	if (array->packed == NULL) {
+		fwrite(array->data, 1, array->size, f);
+	} else {
+		for (int b = 3; b < array->header_entries; b++) {
+			fwrite(array->packed + ((b - 3) * array->packed_stride), 1, array->header[b], f);
+		}
+	}
+}
+
+// the powers of ten that are exact in a long double with a 64 bit mantissa
+static const long double powers_of_ten[] = {
+	1e0L, 1e1L, 1e2L, 1e3L, 1e4L, 1e5L, 1e6L, 1e7L, 1e8L, 1e9L, 1e10L, 1e11L, 1e12L, 1e13L,
+	1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L, 1e20L, 1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L,
+	1e27L
+};
+#define MAX_EXACT_POWER 27
+
+/**
+ * @brief Write a double as text, exactly as printf's "%.12e" would. The value is scaled to a
+ *        13 digit integer with a single (long double) rounding, which is out by well under
+ *        1e-6, so it can be rounded to the right digits unless it is within 1e-6 of half way
+ *        between them. Those values (and anything out of the range of the exact powers of
+ *        ten, infinities and NaNs) are left to snprintf.
+ *
+ * @param s Where to write the text (with room for at least 24 characters)
+ * @param v The value
+ * @return char* The end of the text
+ */
+static char * format_double(char * s, double v) {
+#if LDBL_MANT_DIG >= 64
+	if (v == 0.0) {
+		if (signbit(v)) *s++ = '-';
+		memcpy(s, "0.000000000000e+00", 18);
+		return s + 18;
+	}
+	if (isfinite(v)) {
+		long double a = fabsl((long double) v);
+		// estimate the decimal exponent from the binary one (it can be out by one)
+		int binary_exponent;
+		frexp(v, &binary_exponent);
+		int e = (int) floor((binary_exponent - 1) * 0.30102999566398120);
+		long double scaled = 0.0L;
+		for (int attempt = 0; attempt < 3; attempt++) {
+			int shift = 12 - e;
+			if (shift > MAX_EXACT_POWER || shift < -MAX_EXACT_POWER) {
+				break;
+			}
+			scaled = (shift >= 0) ? a * powers_of_ten[shift] : a / powers_of_ten[-shift];
+			if (scaled >= 1e13L) {
+				e++;
+			} else if (scaled < 1e12L) {
+				e--;
+			} else {
+				break;
+			}
+		}
+		if (scaled >= 1e12L && scaled < 1e13L) {
+			int64_t m = (int64_t) scaled;
+			long double fraction = scaled - m;
+			if (fabsl(fraction - 0.5L) > 1e-6L) {
+				if (fraction > 0.5L) m++;
+				if (m == 10000000000000LL) {
+					m = 1000000000000LL;
+					e++;
+				}
+				if (v < 0.0) *s++ = '-';
+				char digits[13];
+				for (int d = 12; d >= 0; d--) {
+					digits[d] = '0' + (m % 10);
+					m /= 10;
+				}
+				*s++ = digits[0];
+				*s++ = '.';
+				memcpy(s, digits + 1, 12);
+				s += 12;
+				*s++ = 'e';
+				*s++ = (e < 0) ? '-' : '+';
+				e = abs(e);
+				if (e >= 100) *s++ = '0' + (e / 100);
+				*s++ = '0' + ((e / 10) % 10);
+				*s++ = '0' + (e % 10);
+				return s;
+			}
+		}
+	}
+#endif
+	return s + snprintf(s, 24, "%.12e", v);
+}
+
+/**
+ * @brief Write an int as text, as printf's "%d" would
+ *
+ * @param s Where to write the text (with room for at least 12 characters)
+ * @param v The value
+ * @return char* The end of the text
+ */
+static char * format_int(char * s, int32_t v) {
+	char digits[10];
+	int n = 0;
+	int64_t u = v;
+	if (u < 0) {
+		*s++ = '-';
+		u = -u;
+	}
+	do {
+		digits[n++] = '0' + (u % 10);
+		u /= 10;
+	} while (u > 0);
+	while (n > 0) {
+		*s++ = digits[--n];
+	}
+	return s;
+}
+
+/**
+ * @brief Format a range of the tuples of an array as text, one tuple per line. Vectors (i.e.
+ *        points) are written as "x y 0".
+ *
+ * @param s Where to write the text (with room for tuple_text_size bytes per tuple)
+ * @param array The array
+ * @param first The first tuple
+ * @param last One past the last tuple
+ * @return size_t The number of bytes written
+ */
+static size_t format_tuples(char * s, struct vtk_array * array, long first, long last) {
+	char * start = s;
+	int ints = (strcmp(array->type, "Int32") == 0);
+	for (long n = first; n < last; n++) {
+		if (array->components == 3) {
+			double * vector = ((double *) array->data) + (3*n);
+			s = format_double(s, vector[0]);
+			*s++ = ' ';
+			s = format_double(s, vector[1]);
+			memcpy(s, " 0 \n", 4);
+			s += 4;
+			continue;
+		}
+		for (int d = 0; d < array->components; d++) {
+			long v = (n * array->components) + d;
+			if (ints) {
+				s = format_int(s, ((int32_t *) array->data)[v]);
+			} else {
+				s = format_double(s, ((double *) array->data)[v]);
+			}
+			*s++ = ' ';
+		}
+		*s++ = '\n';
+	}
+	return s - start;
+}
+
+/**
+ * @brief The most bytes that format_tuples can write for each tuple of an array
+ *
+ * @param array The array
+ * @return size_t The size in bytes
+ */
+static size_t tuple_text_size(struct vtk_array * array) {
+	size_t value_size = (strcmp(array->type, "Int32") == 0) ? 12 : 24;
+	return (array->components * (value_size + 1)) + 4;
+}
+
+/**
+ * @brief Write an array as text, one tuple per line. The tuples are split evenly between the
+ *        OpenMP threads by count (so a thread's share can start or end part way through a
+ *        cell), and each thread formats its share into its own buffer. The buffers are then
+ *        written side by side with pwrite, each at the sum of the sizes of the ones before it.
+ *        With serial set the whole array is formatted into one buffer on the calling thread.
+ *
+ * @param f The file to write to (the array is written at its current position, and it is left
+ *          at the end of the array)
+ * @param array The array
+ * @param serial Whether to format the array without any OpenMP parallel regions
+ * @return int Return whether the write was successful
+ */
+static int write_array_ascii(FILE * f, struct vtk_array * array, int serial) {
+	fflush(f);
+	int fd = fileno(f);
+	off_t start = ftello(f);
+	int max_threads = serial ? 1 : omp_get_max_threads();
+	size_t * sizes = calloc(max_threads, sizeof(size_t));
+	int err = 0;
+
+	if (serial) {
+		char * buffer = malloc((tuple_text_size(array) * num_particles) + 1);
+		sizes[0] = format_tuples(buffer, array, 0, num_particles);
+		err = write_at(fd, buffer, sizes[0], start);
+		free(buffer);
+	} else {
+		#pragma omp parallel
+		{
+			int thread = omp_get_thread_num();
+			int num_threads = omp_get_num_threads();
+			long first = (num_particles * (long) thread) / num_threads;
+			long last = (num_particles * (long) (thread + 1)) / num_threads;
+			char * buffer = malloc((tuple_text_size(array) * (last - first)) + 1);
+			sizes[thread] = format_tuples(buffer, array, first, last);
+
+			#pragma omp barrier
+			off_t offset = start;
+			for (int t = 0; t < thread; t++) {
+				offset += sizes[t];
+			}
+			if (write_at(fd, buffer, sizes[thread], offset) != 0) {
+				#pragma omp atomic write
+				err = -1;
+			}
+			free(buffer);
+		}
+	}
+
+	off_t end = start;
+	for (int t = 0; t < max_threads; t++) {
+		end += sizes[t];
+	}
+	free(sizes);
+	if (err != 0) {
+		perror("Error");
+		return -1;
+	}
+	fseeko(f, end, SEEK_SET);
+	return 0;
+}
+
+/**
+ * @brief Write the XML element for an array
+ *
+ * @param f The file to write to
+ * @param array The array
+ * @param offset Where the array starts in the appended data (or -1 for an ASCII array)
+ */
+static void write_array_element(FILE * f, struct vtk_array * array, long offset) {
+	if (offset < 0) {
+		fprintf(f, "<DataArray type=\"%s\" Name=\"%s\" NumberOfComponents=\"%d\" format=\"ascii\">\n", array->type, array->name, array->components);
+	} else {
+		fprintf(f, "<DataArray type=\"%s\" Name=\"%s\" NumberOfComponents=\"%d\" format=\"appended\" offset=\"%ld\"/>\n", array->type, array->name, array->components, offset);
+	}
+}
+
+/**
+ * @brief Write out a particle VTK file (i.e. a .vtp file) holding the given points and point
+ *        data. With the binary formats the arrays are stored as appended data (raw, or
+ *        compressed with zlib if a compression level is set), which is much smaller and
+ *        faster to write than the ASCII format.
+ *
  * @param filename The filename to use for output
  * @param iters The number of iterations
  * @param t The simulation time
+ * @param arrays The arrays to write, the points first
+ * @param num_arrays The number of arrays
+ * @param serial Whether to encode and format the arrays without any OpenMP parallel regions
  * @return int Return whether the write was successful
  */
-int write_vtk(char * filename, int iters, double t) {
+static int write_particle_file(char * filename, int iters, double t, struct vtk_array * arrays, int num_arrays, int serial) {
+	double start = omp_get_wtime();
+	int ascii = (vtk_format == VTK_ASCII);
+	size_t raw_size = 0, encoded_size = 0;
+	if (!ascii) {
+		for (int a = 0; a < num_arrays; a++) {
+			if (encode_array(&arrays[a], serial) != 0) {
+				fprintf(stderr, "Error: could not compress the particles for %s\n", filename);
+				return -1;
+			}
+			raw_size += arrays[a].size;
+			encoded_size += arrays[a].encoded_size;
+		}
+	}
+
 	FILE * f = fopen(filename, "w");
     if (f == NULL) {
         perror("Error");
         return -1;
     }
-	
+
 	fprintf(f, "<?xml version=\"1.0\"?>\n");
-	fprintf(f, "<VTKFile type=\"PolyData\" version=\"0.1\" byte_order=\"LittleEndian\">\n");
+	if (ascii) {
+		fprintf(f, "<VTKFile type=\"PolyData\" version=\"0.1\" byte_order=\"LittleEndian\">\n");
+	} else {
+		fprintf(f, "<VTKFile type=\"PolyData\" version=\"0.1\" byte_order=\"%s\" header_type=\"UInt64\"%s>\n", byte_order(), (zlib_level > 0) ? " compressor=\"vtkZLibDataCompressor\"" : "");
+	}
 	fprintf(f, "<PolyData>\n");
 	fprintf(f, "<FieldData>\n");
     fprintf(f, "<DataArray type=\"Float64\" Name=\"TIME\" NumberOfTuples=\"1\" format=\"ascii\">\n");
@@ -88,25 +602,159 @@ int write_vtk(char * filename, int iters, double t) {
     fprintf(f, "</DataArray>\n");
     fprintf(f, "</FieldData>\n");
 	fprintf(f, "<Piece NumberOfPoints=\"%d\" NumberOfVerts=\"0\" NumberOfLines=\"0\" NumberOfStrips=\"0\" NumberOfCells=\"0\">\n", num_particles);
-	fprintf(f, "<Points>\n");
-	fprintf(f, "<DataArray type=\"Float64\" Name=\"particles\" NumberOfComponents=\"3\" format=\"ascii\">\n");
-	for (int i = 1; i < x+1; i++) {
-		for (int j = 1; j < y+1; j++) {
-			for (int k = 0; k < cells[i][j].count; k++) {
-				int p = cells[i][j].part_ids[k];
-				double p_real_x = ((i-1) * cell_size) + particles.x[p];
-				double p_real_y = ((j-1) * cell_size) + particles.y[p];
-				fprintf(f, "%.12e %.12e 0 \n", p_real_x, p_real_y);
+
+	long offset = 0;
+	for (int a = 0; a < num_arrays; a++) {
+		if (a == 0) {
+			fprintf(f, "<Points>\n");
+		} else if (a == 1) {
+			fprintf(f, "<PointData>\n");
+		}
+		write_array_element(f, &arrays[a], ascii ? -1 : offset);
+		offset += arrays[a].encoded_size;
+		if (ascii) {
+			if (write_array_ascii(f, &arrays[a], serial) != 0) {
+				fclose(f);
+				return -1;
 			}
+			fprintf(f, "\n</DataArray>\n");
+		}
+		if (a == 0) {
+			fprintf(f, "</Points>\n");
+		} else if (a == num_arrays - 1) {
+			fprintf(f, "</PointData>\n");
 		}
 	}
-	
-	fprintf(f, "\n</DataArray>\n");
-	fprintf(f, "</Points>\n");
 	fprintf(f, "</Piece>\n");
 	fprintf(f, "</PolyData>\n");
+
+	if (!ascii) {
+		fprintf(f, "<AppendedData encoding=\"raw\">\n");
+		fprintf(f, "_");
+		for (int a = 0; a < num_arrays; a++) {
+			write_array_appended(f, &arrays[a]);
+		}
+		fprintf(f, "\n</AppendedData>\n");
+	}
 	fprintf(f, "</VTKFile>\n");
 	fclose(f);
+
+	if (verbose && zlib_level > 0 && !ascii) {
+		double seconds = omp_get_wtime() - start;
+		printf("Wrote %s: %.3lf MB compressed to %.3lf MB (ratio %.2lf) at %.1lf MB/s\n", filename, raw_size / 1e6, encoded_size / 1e6, (double) raw_size / encoded_size, (raw_size / 1e6) / seconds);
+		// flush now, as checkpoint processes exit without flushing
+		fflush(stdout);
+	}
+	return 0;
+}
+
+/**
+ * @brief Write out a particle VTK file (i.e. a .vtp file).
+ * 
+ * @param filename The filename to use for output
+ * @param iters The number of iterations
+ * @param t The simulation time
+ * @return int Return whether the write was successful
+ */
+int write_vtk(char * filename, int iters, double t) {
+	return write_vtk_cells(filename, iters, t, cells, &particles, 0);
+}
+
+/**
+ * @brief Write out a particle VTK file from a given set of cell lists and particles (e.g. a
+ *        snapshot taken for the checkpoint writer). With --extended the velocity, acceleration,
+ *        potential energy, virial and id of each particle are written as point data, gathered
+ *        in the same pass as the positions. With --static-fields the points are in particle id
+ *        order, so they line up with the ids in the static file (and the ids aren't repeated).
+ *
+ * @param filename The filename to use for output
+ * @param iters The number of iterations
+ * @param t The simulation time
+ * @param c The cell lists to write (only the cells 1..x, 1..y are read)
+ * @param parts The particles to write (the positions, and everything else with --extended)
+ * @param serial Whether to write without any OpenMP parallel regions (e.g. in a forked
+ *               checkpoint process, which can't use the parent's OpenMP threads)
+ * @return int Return whether the write was successful
+ */
+int write_vtk_cells(char * filename, int iters, double t, struct cell_list ** c, struct particle_t * parts, int serial) {
+	int single = (vtk_format == VTK_BINARY32);
+	int extended = extended_output && (parts->energy != NULL);
+	int ids = extended && !static_fields;
+	struct vtk_array arrays[VTK_MAX_ARRAYS];
+	int num_arrays = init_particle_arrays(arrays, single, extended, ids);
+	gather_particles(arrays, c, parts, single, extended, ids, static_fields);
+
+	int err = write_particle_file(filename, iters, t, arrays, num_arrays, serial);
+	for (int a = 0; a < num_arrays; a++) {
+		free_array(&arrays[a]);
+	}
+	return err;
+}
+
+/**
+ * @brief Write out the fields that don't change during the run (the particle ids) to
+ *        BASENAME-static.vtp, with the current positions. Particles are in id order, as in
+ *        every other file written with --static-fields.
+ *
+ * @param iters The number of iterations
+ * @param t The simulation time
+ * @return int Return whether the write was successful
+ */
+int write_static(int iters, double t) {
+	int single = (vtk_format == VTK_BINARY32);
+	struct vtk_array arrays[2];
+	init_particle_arrays(arrays, single, 0, 1);
+	gather_particles(arrays, cells, &particles, single, 0, 1, 1);
+
+	int err = write_particle_file(static_filename, iters, t, arrays, 2, 0);
+	free_array(&arrays[0]);
+	free_array(&arrays[1]);
+	return err;
+}
+
+/**
+ * @brief Add a checkpoint to the BASENAME.pvd collection, so the checkpoints can be opened
+ *        as one time series. The collection is written to a temporary file and renamed over
+ *        the old one, so it is always complete. This should only be called once the
+ *        checkpoint file has been written.
+ *
+ * @param iters The iteration number of the checkpoint
+ * @param t The simulation time of the checkpoint
+ * @return int Return whether the write was successful
+ */
+int add_to_collection(int iters, double t) {
+	if (num_collected == collection_size) {
+		collection_size = (collection_size > 0) ? collection_size * 2 : 64;
+		collected_iters = realloc(collected_iters, sizeof(int) * collection_size);
+		collected_times = realloc(collected_times, sizeof(double) * collection_size);
+	}
+	collected_iters[num_collected] = iters;
+	collected_times[num_collected] = t;
+	num_collected++;
+
+	char tmp_filename[1040];
+	sprintf(tmp_filename, "%s.tmp", collection_filename);
+	FILE * f = fopen(tmp_filename, "w");
+	if (f == NULL) {
+		perror("Error");
+		return -1;
+	}
+	fprintf(f, "<?xml version=\"1.0\"?>\n");
+	fprintf(f, "<VTKFile type=\"Collection\" version=\"0.1\" byte_order=\"LittleEndian\">\n");
+	fprintf(f, "<Collection>\n");
+	for (int n = 0; n < num_collected; n++) {
+		char filename[1024];
+		sprintf(filename, collection_entry, collected_iters[n]);
+		fprintf(f, "<DataSet timestep=\"%.12e\" group=\"\" part=\"0\" file=\"%s\"/>\n", collected_times[n], filename);
+	}
+	fprintf(f, "</Collection>\n");
+	fprintf(f, "</VTKFile>\n");
+	fclose(f);
+
+	if (rename(tmp_filename, collection_filename) != 0) {
+		perror("Error");
+		return -1;
+	}
 	return 0;
 }
 
@@ -1,12 +1,49 @@
 #ifndef VTK_H
 #define VTK_H
 
+#include <stdint.h>
+#include <stddef.h>
+
+#include "data.h"
+
+// the encoding of the particle positions in .vtp files
+enum vtk_format {
+	VTK_ASCII,    // text, for debugging
+	VTK_BINARY,   // raw appended Float64
+	VTK_BINARY32  // raw appended Float32
+};
+
+// the (uncompressed) size of each block of compressed binary output, in bytes
+#define VTK_ZLIB_BLOCK (1 << 18)
+
+// the most arrays in a particle file (the points, velocity, acceleration, potential energy,
+// virial and id)
+#define VTK_MAX_ARRAYS 6
+
+// an array of point data, gathered into memory and encoded for output
+struct vtk_array {
+	const char * name;
+	const char * type;     // the VTK type of the values
+	int components;        // the number of values per particle
+	size_t value_size;
+	size_t size;           // the size of the data in bytes
+	char * data;
+	uint64_t * header;     // the byte count (or zlib block header) written before the data
+	int header_entries;
+	char * packed;         // the compressed blocks, packed_stride bytes apart (zlib only)
+	size_t packed_stride;
+	size_t encoded_size;   // the size of the array in the appended data, with its header
+};
+
 void set_default_base();
 void set_basename(char *base);
 char *get_basename();
 int write_checkpoint(int iters, double t);
 int write_result(int iters, double t);
 int write_vtk(char* filename, int iters, double t);
+int write_vtk_cells(char * filename, int iters, double t, struct cell_list ** c, struct particle_t * parts, int serial);
+int write_static(int iters, double t);
+int add_to_collection(int iters, double t);
 int write_mesh();
 
 #endif
\ No newline at end of file
@@ -114,12 +114,9 @@ void update_cells() {
 	// move particles that need to move cell lists
 	for (int i = 1; i < x+1; i++) {
 		for (int j = 1; j < y+1; j++) {
-			// we have to store the next particle here, as the remove/add at the end may be destructive
-			
-			int cell_count = cells[i][j].count;
-			int * cell_part_ids = cells[i][j].part_ids;
-			for (int k = 0; k < cell_count; k++) {
-				int p = cell_part_ids[k];
+			// removing a particle shifts the rest of the list down, so the count has to be re-read
+			for (int k = 0; k < cells[i][j].count; k++) {
+				int p = cells[i][j].part_ids[k];
 
 				// if a particles x or y value is greater than the cell size or less than 0, it must have moved cell
 				// do a quick check to make sure its not moved 2 cells (since this means our time step is too large, or something else is going wrong)
@@ -148,6 +145,8 @@ void update_cells() {
 					// remove the particle from its current cell list, then add it to the new cell list
 					remove_particle(&(cells[i][j]), k);
 					add_particle(&(cells[new_i][new_j]), p);
+					// the next particle has been shifted into this slot
+					k--;
 				}
 			}
 		}
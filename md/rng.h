@@ -0,0 +1,16 @@
+#ifndef RNG_H
+#define RNG_H
+#include <stdint.h>
+
+// a counter-based generator (Philox4x32-10), so every random number is a pure function of
+// the seed and what it is for (e.g. a global particle id), and doesn't depend on the order
+// it is drawn in. This file is the same in every version of the application.
+void philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4]);
+double rng_uniform(long seed, long id, int stream);
+
+// an order independent sum of doubles, held in fixed point (2 words of 30 fractional bits)
+#define FIXED_SUM_WORDS 2
+void fixed_sum_add(long long sum[FIXED_SUM_WORDS], double v);
+double fixed_sum_value(const long long sum[FIXED_SUM_WORDS]);
+
+#endif
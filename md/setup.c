@@ -5,6 +5,7 @@
 
 #include "setup.h"
 #include "data.h"
+#include "rng.h"
 #include "vtk.h"
 
 /**
@@ -22,8 +23,6 @@ void set_defaults() {
  * 
  */
 void setup() {
-	srand(seed);
-
 	r_cut_off_2 = r_cut_off * r_cut_off;
 	r_cut_off_2_inv = 1.0 / r_cut_off_2;
 	r_cut_off_6_inv = r_cut_off_2_inv * r_cut_off_2_inv * r_cut_off_2_inv;
@@ -54,8 +53,8 @@ void problem_setup() {
 	particles.vx = malloc(sizeof(double) * num_particles);
 	particles.vy = malloc(sizeof(double) * num_particles);
 
-	double v_sum_x = 0.0;
-	double v_sum_y = 0.0;
+	// the momentum is summed in fixed point, so the total matches the parallel versions exactly
+	long long v_sum[2*FIXED_SUM_WORDS] = {0};
 
 	// set the normalisation magnitude using the ideal gas law (T = mv^2 / 3)
 	double v_magnitude = sqrt(3.0 * init_temp);
@@ -74,8 +73,9 @@ void problem_setup() {
 					double part_y = 0.5 * (1.0 / num_part_per_dim) + ((double) b / num_part_per_dim);
 
 					// generate random velocities for the particles, but make sure the overall magnitude is 1.0
-					// i.e. generate an angle between 0 and 2*PI then use cos and sin
-					double phi = (double) rand() * 2.0 * M_PI / RAND_MAX;
+					// i.e. generate an angle between 0 and 2*PI then use cos and sin. The angle only
+					// depends on the seed and the particle id, so it is the same however the work is split
+					double phi = rng_uniform(seed, p_count, 0) * 2.0 * M_PI;
 					double rand_vx = cos(phi);
 					double rand_vy = sin(phi);
 
@@ -86,8 +86,8 @@ void problem_setup() {
 					particles.vy[p_count] = rand_vy * v_magnitude;
 					add_particle(&(cells[i][j]), p_count);
 
-					v_sum_x += particles.vx[p_count];
-					v_sum_y += particles.vy[p_count];
+					fixed_sum_add(&v_sum[0], particles.vx[p_count]);
+					fixed_sum_add(&v_sum[FIXED_SUM_WORDS], particles.vy[p_count]);
 
 					p_count++;
 				}
@@ -96,8 +96,8 @@ void problem_setup() {
 	}
 
 	// Normalise data to make sure that the total momentum is 0.0 at the start
-	double v_avg_x = v_sum_x / num_particles;
-	double v_avg_y = v_sum_y / num_particles;
+	double v_avg_x = fixed_sum_value(&v_sum[0]) / num_particles;
+	double v_avg_y = fixed_sum_value(&v_sum[FIXED_SUM_WORDS]) / num_particles;
 
 	for (int i = 0; i < num_particles; i++) {
 		particles.vx[i] -= v_avg_x;
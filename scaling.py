@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+"""Strong and weak scaling study for md-omp (threads) and md-mpi (ranks).
+
+Runs the chosen version over a list of thread/rank counts with a fixed seed, collects
+the total time and the per-phase timers that --timings prints, and writes CSV or JSON
+with the speedup and parallel efficiency relative to the smallest count.
+
+For strong scaling the grid is the same for every count. For weak scaling the grid is
+the per-worker grid multiplied up by a near-square factorisation of the count, so each
+worker always has the same number of cells.
+
+Examples:
+    ./scaling.py omp strong --counts 1,2,4,8 -x 200 -y 200
+    ./scaling.py mpi weak --counts 1,4,16 -x 100 -y 100 --mpirun "mpirun --oversubscribe" --format json
+"""
+
+import argparse
+import csv
+import json
+import os
+import re
+import subprocess
+import sys
+
+ROOT = os.path.dirname(os.path.abspath(__file__))
+BINARIES = {"omp": os.path.join(ROOT, "md-omp", "md"), "mpi": os.path.join(ROOT, "md-mpi", "md")}
+
+
+def factor(count):
+    """Split count into a x b with a >= b and a / b as small as possible."""
+    b = int(count ** 0.5)
+    while count % b != 0:
+        b -= 1
+    return count // b, b
+
+
+def grid(mode, count, x, y):
+    if mode == "strong":
+        return x, y
+    a, b = factor(count)
+    return x * a, y * b
+
+
+def run(args, count, x, y):
+    """Run one configuration and return its total time, phase times and final energy."""
+    cmd = [BINARIES[args.version], "-x", str(x), "-y", str(y), "-i", str(args.iters),
+           "-e", str(args.seed), "-n", "-T"] + args.md_args.split()
+    env = dict(os.environ)
+    if args.version == "omp":
+        env["OMP_NUM_THREADS"] = str(count)
+    else:
+        cmd = args.mpirun.split() + ["-np", str(count)] + cmd
+
+    result = subprocess.run(cmd, env=env, stdout=subprocess.PIPE, universal_newlines=True, check=True)
+    total = float(re.search(r"Total time:\s*(\S+)", result.stdout).group(1))
+    energy = float(re.search(r"Final energy:\s*(\S+)", result.stdout).group(1))
+    timings = re.search(r"Timings:(.*)", result.stdout).group(1).split()
+    phases = {}
+    for field in timings:
+        key, value = field.split("=")
+        if key not in ("threads", "ranks"):
+            phases[key] = float(value)
+    return total, phases, energy
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("version", choices=sorted(BINARIES), help="md-omp (threads) or md-mpi (ranks)")
+    parser.add_argument("mode", choices=["strong", "weak"])
+    parser.add_argument("--counts", default="1,2,4", help="comma separated thread/rank counts")
+    parser.add_argument("-x", type=int, default=100, help="cells in x (per worker for weak scaling)")
+    parser.add_argument("-y", type=int, default=100, help="cells in y (per worker for weak scaling)")
+    parser.add_argument("-i", "--iters", type=int, default=200)
+    parser.add_argument("-e", "--seed", type=int, default=7)
+    parser.add_argument("--repeat", type=int, default=1, help="runs per count (the fastest is kept)")
+    parser.add_argument("--mpirun", default="mpirun", help="launcher for md-mpi (without -np)")
+    parser.add_argument("--md-args", default="", help="extra options for md")
+    parser.add_argument("--format", choices=["csv", "json"], default="csv")
+    parser.add_argument("-o", "--output", help="output file (default stdout)")
+    args = parser.parse_args()
+
+    rows = []
+    for count in [int(c) for c in args.counts.split(",")]:
+        x, y = grid(args.mode, count, args.x, args.y)
+        best = None
+        for _ in range(args.repeat):
+            sample = run(args, count, x, y)
+            if best is None or sample[0] < best[0]:
+                best = sample
+        total, phases, energy = best
+        row = {"version": args.version, "mode": args.mode, "workers": count, "x": x, "y": y,
+               "iters": args.iters, "seed": args.seed, "total": total, "energy": energy}
+        row.update(phases)
+        rows.append(row)
+        print("%s %s: %d workers, %d x %d cells, %.4f seconds" % (args.version, args.mode, count, x, y, total),
+              file=sys.stderr)
+
+    # the smallest count is the baseline; strong scaling should get faster with more workers,
+    # weak scaling should take the same time
+    base = rows[0]
+    for row in rows:
+        row["speedup"] = base["total"] / row["total"]
+        if args.mode == "strong":
+            row["efficiency"] = row["speedup"] * base["workers"] / row["workers"]
+        else:
+            row["efficiency"] = row["speedup"]
+
+    out = open(args.output, "w", newline="") if args.output else sys.stdout
+    if args.format == "json":
+        json.dump(rows, out, indent=2)
+        out.write("\n")
+    else:
+        fields = list(rows[0].keys())
+        writer = csv.DictWriter(out, fieldnames=fields)
+        writer.writeheader()
+        writer.writerows(rows)
+    if args.output:
+        out.close()
+
+
+if __name__ == "__main__":
+    main()